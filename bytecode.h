@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2023, Gary Sims
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+#ifndef __BYTECODE_H__
+#define __BYTECODE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vartype.h"
+
+/*
+ * The compiled form of a BASIC program. Code is a flat array of 32 bit
+ * words: an opcode followed by its operands. Operands are plain numbers
+ * (variable numbers, immediates, jump targets as word offsets, offsets
+ * into the float or string pools) so a program never holds pointers
+ * into the source text.
+ *
+ * X(name, operands, pops, pushes), the last two being the operand stack
+ * words the instruction takes and leaves. CONCAT also takes as many as
+ * its operand says.
+ */
+#define BC_OPCODES(X)                                                          \
+  X(END, 0, 0, 0)                                                              \
+  X(PUSHI, 1, 0, 1)    /* integer immediate */                                 \
+  X(PUSHF, 1, 0, 1)    /* float pool index */                                  \
+  X(PUSHS, 1, 0, 1)    /* string pool offset */                                \
+  X(LOADI, 1, 0, 1)    /* variable */                                          \
+  X(LOADF, 1, 0, 1)                                                            \
+  X(LOADS, 1, 0, 1)                                                            \
+  X(STOREI, 1, 1, 0)                                                           \
+  X(STOREF, 1, 1, 0)                                                           \
+  X(STORES, 1, 1, 0)                                                           \
+  X(LOADT, 1, 0, 1)    /* temp, a value hoisted out of a loop */               \
+  X(STORET, 1, 1, 0)                                                           \
+  X(ADDI, 0, 2, 1)                                                             \
+  X(SUBI, 0, 2, 1)                                                             \
+  X(MULI, 0, 2, 1)                                                             \
+  X(DIVI, 0, 2, 1)                                                             \
+  X(MODI, 0, 2, 1)                                                             \
+  X(ANDI, 0, 2, 1)                                                             \
+  X(ORI, 0, 2, 1)                                                              \
+  X(LTI, 0, 2, 1)                                                              \
+  X(GTI, 0, 2, 1)                                                              \
+  X(EQI, 0, 2, 1)                                                              \
+  X(ADDF, 0, 2, 1)                                                             \
+  X(SUBF, 0, 2, 1)                                                             \
+  X(MULF, 0, 2, 1)                                                             \
+  X(DIVF, 0, 2, 1)                                                             \
+  X(LTF, 0, 2, 1)      /* float comparisons push an integer */                 \
+  X(GTF, 0, 2, 1)                                                              \
+  X(EQF, 0, 2, 1)                                                              \
+  X(ITOF, 0, 1, 1)                                                             \
+  X(FTOI, 0, 1, 1)                                                             \
+  X(ITOS, 0, 1, 1)                                                             \
+  X(FTOS, 0, 1, 1)     /* trimmed, as printed */                               \
+  X(FTOSF, 0, 1, 1)    /* plain "%f" */                                        \
+  X(CONCAT, 1, 0, 1)   /* count, pops that many strings */                    \
+  X(LEN, 0, 1, 1)      /* length of a string */                                \
+  X(BUILTIN, 1, 1, 1)  /* token */                                             \
+  X(BUILTINF, 1, 1, 1) /* token */                                             \
+  X(PRINTI, 0, 1, 0)                                                           \
+  X(PRINTF, 0, 1, 0)                                                           \
+  X(PRINTS, 0, 1, 0)                                                           \
+  X(PRINTLIT, 1, 0, 0) /* string pool offset */                                \
+  X(PRINTSP, 0, 0, 0)                                                          \
+  X(PRINTNL, 0, 0, 0)                                                          \
+  X(JMP, 1, 0, 0)      /* target */                                            \
+  X(JZ, 1, 1, 0)       /* target */                                            \
+  X(GOSUB, 1, 0, 0)    /* target */                                            \
+  X(RETURN, 0, 0, 0)                                                           \
+  X(FOR, 1, 2, 0)      /* variable, pops limit and step */                     \
+  X(FORF, 1, 2, 0)                                                             \
+  X(NEXT, 1, 0, 0)     /* variable */                                          \
+  X(NEXTF, 1, 0, 0)                                                            \
+  X(PEEK, 1, 1, 0)     /* variable */                                          \
+  X(POKE, 0, 2, 0)                                                             \
+  X(SLEEP, 0, 1, 0)                                                            \
+  X(DELAY, 0, 1, 0)                                                            \
+  X(RANDOMIZE, 0, 1, 0)                                                        \
+  X(PUSH, 0, 1, 0)                                                             \
+  X(POP, 1, 0, 0)      /* variable */                                          \
+  X(OS, 0, 1, 0)                                                               \
+  X(GPIOINIT, 0, 1, 0)                                                         \
+  X(GPIODIRIN, 0, 1, 0)                                                        \
+  X(GPIODIROUT, 0, 1, 0)                                                       \
+  X(GPIOON, 0, 1, 0)                                                           \
+  X(GPIOOFF, 0, 1, 0)                                                          \
+  /* superinstructions, see emit_stmt() in compiler.c */                       \
+  X(ADDVI, 2, 0, 0)    /* variable, immediate: let x = x + 1 */                \
+  X(JLTVI, 3, 0, 0)    /* variable, immediate, target: if x < 9 then goto */  \
+  X(JGTVI, 3, 0, 0)                                                            \
+  X(JEQVI, 3, 0, 0)                                                            \
+  X(FORI, 3, 0, 0)     /* variable, limit, step immediates */                  \
+  X(GPIOONI, 1, 0, 0)  /* pin */                                               \
+  X(GPIOOFFI, 1, 0, 0)                                                         \
+  X(DELAYI, 1, 0, 0)   /* milliseconds */
+
+#define BC_ENUM(name, operands, pops, pushes) OP_##name,
+enum { BC_OPCODES(BC_ENUM) OP__COUNT };
+#undef BC_ENUM
+
+/* Variables a to z, the operand of LOADI and the other variable opcodes */
+#define MAX_VARNUM 26
+
+/* Operand stack slots the VM provides, deeper expressions don't compile */
+#define BC_STACK_DEPTH 32
+
+/* Temps for values computed before a loop, see hoist_program() */
+#define BC_TEMPS 16
+
+/*
+ * Recorded in compiled images (image.h), which are refused by an
+ * interpreter of another version. Bump it whenever the meaning of the
+ * code or the layout of images changes.
+ */
+#define BC_VERSION 5
+
+/*
+ * A string the VM counts references to. The string pool holds its
+ * strings laid out the same way, 4 byte aligned with refs -1 so they are
+ * never counted or freed, and the VM uses them where they are. Offsets
+ * into the pool are to the text.
+ */
+struct bc_string {
+  int32_t refs;
+  int32_t len;
+  char text[4]; /* and the rest, with a terminating 0 */
+};
+
+#define BC_STRING(s)                                                           \
+  ((struct bc_string *)((s) - offsetof(struct bc_string, text)))
+
+/* Maps the first instruction of each source line to its line number */
+struct bc_line {
+  int pc;
+  int line;
+};
+
+struct bc_program {
+  int32_t *code;
+  int code_len;
+  VARFLOAT_TYPE *floats;
+  int floats_len;
+  char *strings;
+  int strings_len;
+  struct bc_line *lines;
+  int lines_len;
+  int stack_depth;
+  int temps;
+};
+
+#endif /* __BYTECODE_H__ */
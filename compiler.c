@@ -0,0 +1,2088 @@
+/*
+ * Copyright (c) 2023, Gary Sims
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Load time compiler. Parses the whole program once with the tokenizer,
+ * builds a small tree per statement and emits the bytecode described in
+ * bytecode.h. Statements mean the same as in the text interpreter in
+ * ubasic.c, but numeric expressions are typed as a whole at load (see
+ * typed()) rather than by the first token, so mixed integer and float
+ * expressions work and are evaluated in one pass.
+ *
+ * Anything the compiler doesn't understand makes compiler_compile() fail
+ * and ubasic.c falls back to the text interpreter, which then reports the
+ * error when (and if) the offending line is reached.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "tokenizer.h"
+
+#define DEBUG 0
+
+#if DEBUG
+#define DEBUG_PRINTF(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_PRINTF(...)
+#endif
+
+/* Strings one CONCAT joins at most, longer chains take one per this many */
+#define CONCAT_MAX 8
+
+/* Print what the loop optimisation hoisted, see hoist_program() */
+#ifndef COMPILER_DUMP
+#define COMPILER_DUMP 0
+#endif
+
+enum { T_INT, T_FLOAT, T_STRING };
+
+enum {
+  N_NUM,
+  N_NUMF,
+  N_STR,
+  N_VAR,
+  N_VARF,
+  N_VARS,
+  N_BINOP,    /* op is the operator token */
+  N_CONV,     /* op is the conversion opcode */
+  N_BUILTIN,  /* op is the builtin token */
+  N_BUILTINF,
+  N_ITEM,     /* print/os item, op is one of the ITEM_ values */
+  N_TEMP,     /* value computed before a loop, v.var is the temp */
+  N_HOIST,    /* left computed into temp v.var, chained through right */
+};
+
+enum { ITEM_EXPR, ITEM_LITERAL, ITEM_COMMA, ITEM_SEMICOLON };
+
+struct node {
+  unsigned char kind;
+  unsigned char type;
+  short op;
+  int left, right;
+  union {
+    VARIABLE_TYPE i;
+    VARFLOAT_TYPE f;
+    int var;
+    int str;
+  } v;
+};
+
+enum {
+  S_PRINT,
+  S_OS,
+  S_IF,
+  S_GOTO,
+  S_GOSUB,
+  S_RETURN,
+  S_FOR,
+  S_NEXT,
+  S_PEEK,
+  S_POKE,
+  S_POP,
+  S_SIMPLE, /* one integer argument, op is the opcode */
+  S_END,
+  S_LABEL,
+  S_LET,
+};
+
+struct stmt {
+  unsigned char kind;
+  unsigned char top;  /* not nested in an if */
+  unsigned char dead; /* never runs or does nothing, see prune_program() */
+  unsigned char type;
+  short op;
+  int line;
+  int var;
+  int e1, e2, e3;
+  int label;
+  int then_stmt, else_stmt;
+  int hoist; /* for: N_HOIST chain to run before the loop */
+  int pc;
+};
+
+struct label {
+  char name[MAX_LABELLEN];
+  int stmt;
+};
+
+struct fixup {
+  int at;
+  int label;
+};
+
+static struct node *nodes;
+static int nodes_len, nodes_cap;
+static struct stmt *stmts;
+static int stmts_len, stmts_cap;
+static struct label *labels;
+static int labels_len, labels_cap;
+static struct fixup *fixups;
+static int fixups_len, fixups_cap;
+
+static struct bc_program *prog;
+static int code_cap, floats_cap, strings_cap, lines_cap;
+
+static int failed;
+static const char *fail_msg;
+static int fail_line;
+static int pruned;
+static int line_no;
+static char const *line_scan;
+
+static int expr(void);
+static int exprs(void);
+static int statement(int nested);
+
+/*---------------------------------------------------------------------------*/
+static void fail(char *msg) {
+  if (!failed) {
+    DEBUG_PRINTF("compiler: line %d: %s\n", line_no, msg);
+    failed = 1;
+    fail_msg = msg;
+    fail_line = line_no;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static int grow(void **array, int *cap, int need, int size) {
+  void *p;
+  int newcap;
+
+  if (need <= *cap) {
+    return 1;
+  }
+  newcap = *cap ? *cap : 32;
+  while (newcap < need) {
+    newcap *= 2;
+  }
+  p = realloc(*array, newcap * size);
+  if (p == NULL) {
+    fail("out of memory");
+    return 0;
+  }
+  *array = p;
+  *cap = newcap;
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+/* Source line of the current token, counted forward as parsing proceeds */
+static int token_line(void) {
+  char const *pos = tokenizer_pos();
+  while (line_scan < pos) {
+    if (*line_scan++ == '\n') {
+      line_no++;
+    }
+  }
+  return line_no;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * A statement ends at a CR, at the end of the program, or when a trailing
+ * comment has already swallowed the CR and the next token is on a new line.
+ */
+static int at_end(int line) {
+  int token = tokenizer_token();
+  return token == TOKENIZER_CR || token == TOKENIZER_ENDOFINPUT ||
+         token_line() != line;
+}
+/*---------------------------------------------------------------------------*/
+static int expect(int token) {
+  if (tokenizer_token() != token) {
+    fail("unexpected token");
+    return 0;
+  }
+  tokenizer_next();
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+static int new_node(int kind, int type) {
+  if (!grow((void **)&nodes, &nodes_cap, nodes_len + 1, sizeof(struct node))) {
+    return -1;
+  }
+  memset(&nodes[nodes_len], 0, sizeof(struct node));
+  nodes[nodes_len].kind = kind;
+  nodes[nodes_len].type = type;
+  nodes[nodes_len].left = nodes[nodes_len].right = -1;
+  return nodes_len++;
+}
+/*---------------------------------------------------------------------------*/
+static int new_op(int kind, int type, int op, int left, int right) {
+  int n;
+
+  if (failed || left < 0) {
+    return -1;
+  }
+  n = new_node(kind, type);
+  if (n >= 0) {
+    nodes[n].op = op;
+    nodes[n].left = left;
+    nodes[n].right = right;
+  }
+  return n;
+}
+/*---------------------------------------------------------------------------*/
+static int new_var(int kind, int type) {
+  int n = new_node(kind, type);
+  if (n >= 0) {
+    nodes[n].v.var = tokenizer_variable_num();
+  }
+  tokenizer_next();
+  return n;
+}
+/*---------------------------------------------------------------------------*/
+/* The first len characters of s as a pool string (struct bc_string) */
+static int add_text(const char *s, int len) {
+  struct bc_string h;
+  int offset = (prog->strings_len + 3) & ~3;
+
+  if (!grow((void **)&prog->strings, &strings_cap,
+            offset + (int)offsetof(struct bc_string, text) + len + 1, 1)) {
+    return 0;
+  }
+  memset(prog->strings + prog->strings_len, 0, offset - prog->strings_len);
+  h.refs = -1;
+  h.len = len;
+  memcpy(prog->strings + offset, &h, offsetof(struct bc_string, text));
+  offset += offsetof(struct bc_string, text);
+  memcpy(prog->strings + offset, s, len);
+  prog->strings[offset + len] = 0;
+  prog->strings_len = offset + len + 1;
+  return offset;
+}
+/*---------------------------------------------------------------------------*/
+static int add_string(const char *s) { return add_text(s, strlen(s)); }
+/*---------------------------------------------------------------------------*/
+static int add_float(VARFLOAT_TYPE f) {
+  int i;
+
+  for (i = 0; i < prog->floats_len; i++) {
+    if (prog->floats[i] == f) {
+      return i;
+    }
+  }
+  if (!grow((void **)&prog->floats, &floats_cap, i + 1,
+            sizeof(VARFLOAT_TYPE))) {
+    return 0;
+  }
+  prog->floats[i] = f;
+  return prog->floats_len++;
+}
+/*---------------------------------------------------------------------------*/
+static int string_literal(void) {
+  int n = new_node(N_STR, T_STRING);
+  const char *s;
+  int len;
+
+  s = tokenizer_string(&len);
+  if (n >= 0) {
+    nodes[n].v.str = add_text(s, len);
+  }
+  tokenizer_next();
+  return n;
+}
+/*---------------------------------------------------------------------------*/
+/* Builtin call arguments, an empty () passes zero */
+static int builtin_arg(int (*parse)(void)) {
+  int arg = -1;
+
+  tokenizer_next();
+  if (!expect(TOKENIZER_LEFTPAREN)) {
+    return -2;
+  }
+  if (tokenizer_token() != TOKENIZER_RIGHTPAREN) {
+    arg = parse();
+  }
+  if (!expect(TOKENIZER_RIGHTPAREN)) {
+    return -2;
+  }
+  return arg;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Numeric expressions are parsed by one grammar whatever their type.
+ * Leaves get their type from the token (1 is an integer, 1.0 and x# are
+ * floats) and typed() works out the rest once the expression is complete.
+ */
+static int factor(void) {
+  int n, token, arg;
+
+  token = tokenizer_token();
+  switch (token) {
+  case TOKENIZER_NUMBER:
+    n = new_node(N_NUM, T_INT);
+    if (n >= 0) {
+      nodes[n].v.i = tokenizer_num();
+    }
+    tokenizer_next();
+    return n;
+  case TOKENIZER_NUMFLOAT:
+    n = new_node(N_NUMF, T_FLOAT);
+    if (n >= 0) {
+      nodes[n].v.f = tokenizer_numfloat();
+    }
+    tokenizer_next();
+    return n;
+  case TOKENIZER_ZERO:
+  case TOKENIZER_NOT:
+  case TOKENIZER_RANDINT:
+  case TOKENIZER_TIME:
+  case TOKENIZER_SQR:
+  case TOKENIZER_RND:
+  case TOKENIZER_ABS:
+  case TOKENIZER_ATN:
+  case TOKENIZER_COS:
+  case TOKENIZER_EXP:
+  case TOKENIZER_LOG:
+  case TOKENIZER_SIN:
+  case TOKENIZER_TAN:
+    arg = builtin_arg(expr);
+    if (arg < -1 || failed) {
+      return -1;
+    }
+    if (token < TOKENIZER_BUILTINS__END) {
+      n = new_node(N_BUILTIN, T_INT);
+    } else {
+      n = new_node(N_BUILTINF, T_FLOAT);
+    }
+    if (n >= 0) {
+      nodes[n].op = token;
+      nodes[n].left = arg;
+    }
+    return n;
+  case TOKENIZER_LEN:
+    /* a conversion from string to integer, as far as the passes go */
+    arg = builtin_arg(exprs);
+    if (arg < 0 || failed) {
+      fail("len needs a string");
+      return -1;
+    }
+    return new_op(N_CONV, T_INT, OP_LEN, arg, -1);
+  case TOKENIZER_LEFTPAREN:
+    tokenizer_next();
+    n = expr();
+    expect(TOKENIZER_RIGHTPAREN);
+    return n;
+  case TOKENIZER_MINUS:
+    /* -x as 0 - x, typed() and folding sort out the zero */
+    tokenizer_next();
+    n = new_node(N_NUM, T_INT);
+    if (n >= 0) {
+      nodes[n].v.i = 0;
+    }
+    return new_op(N_BINOP, T_INT, TOKENIZER_MINUS, n, factor());
+  case TOKENIZER_VARFLOAT:
+    return new_var(N_VARF, T_FLOAT);
+  case TOKENIZER_VARIABLE:
+    return new_var(N_VAR, T_INT);
+  }
+  fail("unexpected token in expression");
+  return -1;
+}
+/*---------------------------------------------------------------------------*/
+static int term(void) {
+  int n, op;
+
+  n = factor();
+  op = tokenizer_token();
+  while (!failed && (op == TOKENIZER_ASTR || op == TOKENIZER_SLASH ||
+                     op == TOKENIZER_MOD)) {
+    tokenizer_next();
+    n = new_op(N_BINOP, T_INT, op, n, factor());
+    op = tokenizer_token();
+  }
+  return n;
+}
+/*---------------------------------------------------------------------------*/
+static int sum(void) {
+  int n, op;
+
+  n = term();
+  op = tokenizer_token();
+  while (!failed && (op == TOKENIZER_PLUS || op == TOKENIZER_MINUS ||
+                     op == TOKENIZER_AND || op == TOKENIZER_OR)) {
+    tokenizer_next();
+    n = new_op(N_BINOP, T_INT, op, n, term());
+    op = tokenizer_token();
+  }
+  return n;
+}
+/*---------------------------------------------------------------------------*/
+/* Comparisons bind loosest, so they work anywhere an expression does */
+static int expr(void) {
+  int n, op;
+
+  n = sum();
+  op = tokenizer_token();
+  while (!failed && (op == TOKENIZER_LT || op == TOKENIZER_GT ||
+                     op == TOKENIZER_EQ)) {
+    tokenizer_next();
+    n = new_op(N_BINOP, T_INT, op, n, sum());
+    op = tokenizer_token();
+  }
+  return n;
+}
+/*---------------------------------------------------------------------------*/
+/* n converted to type, if it isn't already */
+static int coerce(int n, int type) {
+  if (n < 0 || nodes[n].type == type) {
+    return n;
+  }
+  return new_op(N_CONV, type, type == T_INT ? OP_FTOI : OP_ITOF, n, -1);
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Type a numeric expression tree. An operator is done in float if either
+ * operand is a float, and then only that operand is converted, so
+ * "a * b + x#" multiplies integers and converts once, and "let a = b# * 2"
+ * multiplies floats and truncates the result. Division is also done in
+ * float when the whole expression is wanted as a float (want is T_INT,
+ * T_FLOAT or -1 for either), even under %, & and | or a comparison, as
+ * the text interpreter does. %, & and | are integer only. Comparisons
+ * give an integer 0 or 1.
+ *
+ * A variable's type is fixed by its name (a, a#, a$), so every operand
+ * type is known here and the VM has no generic operations left to
+ * specialise at run time.
+ */
+static int typed(int n, int want) {
+  int l, r, type, op;
+
+  if (n < 0 || failed) {
+    return -1;
+  }
+  switch (nodes[n].kind) {
+  case N_BUILTIN:
+    l = typed(nodes[n].left, T_INT);
+    nodes[n].left = coerce(l, T_INT);
+    return n;
+  case N_BUILTINF:
+    l = typed(nodes[n].left, T_FLOAT);
+    nodes[n].left = coerce(l, T_FLOAT);
+    return n;
+  case N_BINOP:
+    break;
+  default:
+    return n;
+  }
+
+  op = nodes[n].op;
+  l = typed(nodes[n].left, want);
+  r = typed(nodes[n].right, want);
+  if (l < 0 || r < 0) {
+    return -1;
+  }
+  if (op == TOKENIZER_MOD || op == TOKENIZER_AND || op == TOKENIZER_OR) {
+    type = T_INT;
+  } else if (nodes[l].type == T_FLOAT || nodes[r].type == T_FLOAT) {
+    type = T_FLOAT;
+  } else if (op == TOKENIZER_SLASH && want == T_FLOAT) {
+    type = T_FLOAT;
+  } else {
+    type = T_INT;
+  }
+  l = coerce(l, type);
+  r = coerce(r, type);
+  nodes[n].left = l;
+  nodes[n].right = r;
+  nodes[n].type = op == TOKENIZER_LT || op == TOKENIZER_GT ||
+                          op == TOKENIZER_EQ
+                      ? T_INT
+                      : type;
+  return n;
+}
+/*---------------------------------------------------------------------------*/
+/* Parse and type a numeric expression, converted to want unless it is -1 */
+static int numeric(int (*parse)(void), int want) {
+  int n = typed(parse(), want);
+
+  return want < 0 ? n : coerce(n, want);
+}
+/*---------------------------------------------------------------------------*/
+static int factors(void) {
+  int n;
+
+  switch (tokenizer_token()) {
+  case TOKENIZER_NUMBER:
+  case TOKENIZER_VARIABLE:
+    return new_op(N_CONV, T_STRING, OP_ITOS, factor(), -1);
+  case TOKENIZER_NUMFLOAT:
+    return new_op(N_CONV, T_STRING, OP_FTOS, factor(), -1);
+  case TOKENIZER_VARFLOAT:
+    return new_op(N_CONV, T_STRING, OP_FTOSF, new_var(N_VARF, T_FLOAT), -1);
+  case TOKENIZER_LEFTPAREN:
+    tokenizer_next();
+    n = exprs();
+    expect(TOKENIZER_RIGHTPAREN);
+    return n;
+  case TOKENIZER_VARSTRING:
+    return new_var(N_VARS, T_STRING);
+  case TOKENIZER_STRING:
+    return string_literal();
+  }
+  fail("unexpected token in string expression");
+  return -1;
+}
+/*---------------------------------------------------------------------------*/
+static int exprs(void) {
+  int n;
+
+  n = factors();
+  while (!failed && tokenizer_token() == TOKENIZER_PLUS) {
+    tokenizer_next();
+    n = new_op(N_BINOP, T_STRING, TOKENIZER_PLUS, n, factors());
+  }
+  return n;
+}
+/*---------------------------------------------------------------------------*/
+static int new_stmt(int kind, int line) {
+  int s;
+
+  if (!grow((void **)&stmts, &stmts_cap, stmts_len + 1, sizeof(struct stmt))) {
+    return -1;
+  }
+  s = stmts_len++;
+  memset(&stmts[s], 0, sizeof(struct stmt));
+  stmts[s].kind = kind;
+  stmts[s].line = line;
+  stmts[s].e1 = stmts[s].e2 = stmts[s].e3 = -1;
+  stmts[s].label = stmts[s].then_stmt = stmts[s].else_stmt = -1;
+  stmts[s].hoist = -1;
+  return s;
+}
+/*---------------------------------------------------------------------------*/
+static int find_label(void) {
+  char l[MAX_LABELLEN];
+  int i;
+
+  tokenizer_label(l, MAX_LABELLEN);
+  tokenizer_next();
+  for (i = 0; i < labels_len; i++) {
+    if (strcmp(labels[i].name, l) == 0) {
+      return i;
+    }
+  }
+  if (!grow((void **)&labels, &labels_cap, labels_len + 1,
+            sizeof(struct label))) {
+    return -1;
+  }
+  strcpy(labels[i].name, l);
+  labels[i].stmt = -1;
+  return labels_len++;
+}
+/*---------------------------------------------------------------------------*/
+/* Items of a print or os statement, chained through node.right */
+static int items(int line, int nested, int print) {
+  int first = -1, last = -1, n, e, kind, token;
+
+  while (!failed && !at_end(line)) {
+    token = tokenizer_token();
+    e = -1;
+    if (token == TOKENIZER_STRING) {
+      kind = ITEM_LITERAL;
+      e = string_literal();
+    } else if (token == TOKENIZER_VARSTRING) {
+      kind = ITEM_EXPR;
+      e = exprs();
+    } else if (print && token == TOKENIZER_COMMA) {
+      kind = ITEM_COMMA;
+      tokenizer_next();
+    } else if (print && token == TOKENIZER_SEMICOLON) {
+      kind = ITEM_SEMICOLON;
+      tokenizer_next();
+    } else if (print && (token == TOKENIZER_VARIABLE ||
+                         token == TOKENIZER_NUMBER ||
+                         token == TOKENIZER_MINUS ||
+                         token == TOKENIZER_LEFTPAREN ||
+                         token == TOKENIZER_VARFLOAT ||
+                         token == TOKENIZER_NUMFLOAT ||
+                         token == TOKENIZER_LEN ||
+                         (token > TOKENIZER_BUILTINS__START &&
+                          token < TOKENIZER_BUILTINS__END) ||
+                         (token > TOKENIZER_BUILTINSF__START &&
+                          token < TOKENIZER_BUILTINSF__END))) {
+      kind = ITEM_EXPR;
+      e = numeric(expr, -1);
+    } else {
+      break;
+    }
+    n = new_node(N_ITEM, 0);
+    if (n < 0) {
+      return -1;
+    }
+    nodes[n].op = kind;
+    nodes[n].left = e;
+    if (last >= 0) {
+      nodes[last].right = n;
+    } else {
+      first = n;
+    }
+    last = n;
+  }
+  if (!at_end(line) && !(nested && tokenizer_token() == TOKENIZER_ELSE)) {
+    fail("unexpected token in print");
+  }
+  return first;
+}
+/*---------------------------------------------------------------------------*/
+static int statement(int nested) {
+  int line = token_line();
+  int token = tokenizer_token();
+  int s, e, type;
+
+  switch (token) {
+  case TOKENIZER_PRINT:
+  case TOKENIZER_OS:
+    s = new_stmt(token == TOKENIZER_PRINT ? S_PRINT : S_OS, line);
+    tokenizer_next();
+    e = items(line, nested, token == TOKENIZER_PRINT);
+    if (s >= 0) {
+      stmts[s].e1 = e;
+    }
+    return s;
+  case TOKENIZER_IF:
+    s = new_stmt(S_IF, line);
+    tokenizer_next();
+    e = numeric(expr, T_INT);
+    if (!expect(TOKENIZER_THEN) || s < 0) {
+      return -1;
+    }
+    stmts[s].e1 = e;
+    e = statement(1);
+    stmts[s].then_stmt = e;
+    if (!failed && tokenizer_token() == TOKENIZER_ELSE) {
+      tokenizer_next();
+      e = statement(1);
+      stmts[s].else_stmt = e;
+    }
+    if (!at_end(line) && tokenizer_token() != TOKENIZER_ELSE) {
+      fail("unexpected token after if");
+    }
+    return s;
+  case TOKENIZER_GOTO:
+  case TOKENIZER_GOSUB:
+    s = new_stmt(token == TOKENIZER_GOTO ? S_GOTO : S_GOSUB, line);
+    tokenizer_next();
+    if (tokenizer_token() != TOKENIZER_LABEL) {
+      fail("expected label");
+      return -1;
+    }
+    e = find_label();
+    if (s >= 0) {
+      stmts[s].label = e;
+    }
+    return s;
+  case TOKENIZER_LABEL:
+    s = new_stmt(S_LABEL, line);
+    e = find_label();
+    if (s < 0 || e < 0) {
+      return -1;
+    }
+    stmts[s].label = e;
+    if (labels[e].stmt < 0) {
+      labels[e].stmt = s;
+    }
+    if (!at_end(line)) {
+      fail("expected end of line after label");
+    }
+    return s;
+  case TOKENIZER_RETURN:
+  case TOKENIZER_END:
+    s = new_stmt(token == TOKENIZER_RETURN ? S_RETURN : S_END, line);
+    tokenizer_next();
+    return s;
+  case TOKENIZER_FOR:
+    s = new_stmt(S_FOR, line);
+    tokenizer_next();
+    token = tokenizer_token();
+    if (s < 0 ||
+        (token != TOKENIZER_VARIABLE && token != TOKENIZER_VARFLOAT)) {
+      fail("expected variable");
+      return -1;
+    }
+    type = token == TOKENIZER_VARIABLE ? T_INT : T_FLOAT;
+    stmts[s].type = type;
+    stmts[s].var = tokenizer_variable_num();
+    tokenizer_next();
+    expect(TOKENIZER_EQ);
+    e = numeric(expr, type);
+    stmts[s].e1 = e;
+    expect(TOKENIZER_TO);
+    e = numeric(expr, type);
+    stmts[s].e2 = e;
+    if (tokenizer_token() == TOKENIZER_STEP) {
+      tokenizer_next();
+      e = numeric(expr, type);
+      stmts[s].e3 = e;
+    }
+    if (!at_end(line)) {
+      fail("expected end of line after for");
+    }
+    return s;
+  case TOKENIZER_NEXT:
+  case TOKENIZER_POP:
+    s = new_stmt(token == TOKENIZER_NEXT ? S_NEXT : S_POP, line);
+    tokenizer_next();
+    if (s < 0) {
+      return -1;
+    }
+    stmts[s].var = -1;
+    if (tokenizer_token() == TOKENIZER_VARIABLE ||
+        (token == TOKENIZER_NEXT && tokenizer_token() == TOKENIZER_VARFLOAT)) {
+      stmts[s].type = tokenizer_token() == TOKENIZER_VARIABLE ? T_INT : T_FLOAT;
+      stmts[s].var = tokenizer_variable_num();
+      tokenizer_next();
+    } else if (token == TOKENIZER_NEXT) {
+      fail("expected variable");
+    }
+    return s;
+  case TOKENIZER_PEEK:
+    s = new_stmt(S_PEEK, line);
+    tokenizer_next();
+    e = numeric(expr, T_INT);
+    expect(TOKENIZER_COMMA);
+    if (s < 0 || tokenizer_token() != TOKENIZER_VARIABLE) {
+      fail("expected variable");
+      return -1;
+    }
+    stmts[s].e1 = e;
+    stmts[s].var = tokenizer_variable_num();
+    tokenizer_next();
+    return s;
+  case TOKENIZER_POKE:
+    s = new_stmt(S_POKE, line);
+    tokenizer_next();
+    e = numeric(expr, T_INT);
+    expect(TOKENIZER_COMMA);
+    if (s >= 0) {
+      stmts[s].e1 = e;
+      e = numeric(expr, T_INT);
+      stmts[s].e2 = e;
+    }
+    return s;
+  case TOKENIZER_SLEEP:
+  case TOKENIZER_DELAY:
+  case TOKENIZER_RANDOMIZE:
+  case TOKENIZER_PUSH:
+  case TOKENIZER_GPIOINIT:
+  case TOKENIZER_GPIODIRIN:
+  case TOKENIZER_GPIODIROUT:
+  case TOKENIZER_GPIOON:
+  case TOKENIZER_GPIOOFF:
+    s = new_stmt(S_SIMPLE, line);
+    tokenizer_next();
+    e = numeric(expr, T_INT);
+    if (s >= 0) {
+      stmts[s].e1 = e;
+      switch (token) {
+      case TOKENIZER_SLEEP:
+        stmts[s].op = OP_SLEEP;
+        break;
+      case TOKENIZER_DELAY:
+        stmts[s].op = OP_DELAY;
+        break;
+      case TOKENIZER_RANDOMIZE:
+        stmts[s].op = OP_RANDOMIZE;
+        break;
+      case TOKENIZER_PUSH:
+        stmts[s].op = OP_PUSH;
+        break;
+      case TOKENIZER_GPIOINIT:
+        stmts[s].op = OP_GPIOINIT;
+        break;
+      case TOKENIZER_GPIODIRIN:
+        stmts[s].op = OP_GPIODIRIN;
+        break;
+      case TOKENIZER_GPIODIROUT:
+        stmts[s].op = OP_GPIODIROUT;
+        break;
+      case TOKENIZER_GPIOON:
+        stmts[s].op = OP_GPIOON;
+        break;
+      default:
+        stmts[s].op = OP_GPIOOFF;
+        break;
+      }
+    }
+    return s;
+  case TOKENIZER_LET:
+    tokenizer_next();
+    token = tokenizer_token();
+    /* Fall through. */
+  case TOKENIZER_VARIABLE:
+  case TOKENIZER_VARFLOAT:
+  case TOKENIZER_VARSTRING:
+    if (token == TOKENIZER_VARIABLE) {
+      type = T_INT;
+    } else if (token == TOKENIZER_VARFLOAT) {
+      type = T_FLOAT;
+    } else if (token == TOKENIZER_VARSTRING) {
+      type = T_STRING;
+    } else {
+      fail("expected variable");
+      return -1;
+    }
+    s = new_stmt(S_LET, line);
+    if (s < 0) {
+      return -1;
+    }
+    stmts[s].type = type;
+    stmts[s].var = tokenizer_variable_num();
+    tokenizer_next();
+    expect(TOKENIZER_EQ);
+    if (type != T_STRING) {
+      e = numeric(expr, type);
+    } else {
+      e = exprs();
+    }
+    stmts[s].e1 = e;
+    return s;
+  }
+  fail("unknown statement");
+  return -1;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Constant folding. Runs on the statement trees between parsing and
+ * emitting: operators and conversions whose operands are all constants
+ * are replaced, in place, by the constant they evaluate to. Variables
+ * that get exactly one constant value before any jump or label (and are
+ * not read before that) are replaced by the value wherever they are read.
+ */
+static int known[3][MAX_VARNUM]; /* constant node for a variable, or -1 */
+static int reads[3][MAX_VARNUM];
+static int writes[3][MAX_VARNUM];
+static int folded;
+
+static int var_type(int kind) {
+  return kind == N_VAR ? T_INT : kind == N_VARF ? T_FLOAT : T_STRING;
+}
+/*---------------------------------------------------------------------------*/
+static int is_const(int n) {
+  return n >= 0 && (nodes[n].kind == N_NUM || nodes[n].kind == N_NUMF ||
+                    nodes[n].kind == N_STR);
+}
+/*---------------------------------------------------------------------------*/
+static void set_const(int n, int kind, struct node *value) {
+  nodes[n].kind = kind;
+  nodes[n].left = nodes[n].right = -1;
+  nodes[n].v = value->v;
+  folded++;
+}
+/*---------------------------------------------------------------------------*/
+static void fold_binop(int n) {
+  struct node *p = &nodes[n], *l = &nodes[p->left], *r = &nodes[p->right];
+  struct node value;
+  char *s;
+
+  if (l->type == T_STRING) {
+    s = malloc(strlen(prog->strings + l->v.str) +
+               strlen(prog->strings + r->v.str) + 1);
+    if (s == NULL) {
+      return;
+    }
+    strcpy(s, prog->strings + l->v.str);
+    strcat(s, prog->strings + r->v.str);
+    value.v.str = add_string(s);
+    free(s);
+    set_const(n, N_STR, &value);
+    return;
+  }
+  if (l->type == T_FLOAT) {
+    switch (p->op) {
+    case TOKENIZER_LT:
+      value.v.i = l->v.f < r->v.f;
+      set_const(n, N_NUM, &value);
+      return;
+    case TOKENIZER_GT:
+      value.v.i = l->v.f > r->v.f;
+      set_const(n, N_NUM, &value);
+      return;
+    case TOKENIZER_EQ:
+      value.v.i = l->v.f == r->v.f;
+      set_const(n, N_NUM, &value);
+      return;
+    case TOKENIZER_PLUS:
+      value.v.f = l->v.f + r->v.f;
+      break;
+    case TOKENIZER_MINUS:
+      value.v.f = l->v.f - r->v.f;
+      break;
+    case TOKENIZER_ASTR:
+      value.v.f = l->v.f * r->v.f;
+      break;
+    default:
+      value.v.f = l->v.f / r->v.f;
+      break;
+    }
+    set_const(n, N_NUMF, &value);
+    return;
+  }
+  switch (p->op) {
+  case TOKENIZER_PLUS:
+    value.v.i = l->v.i + r->v.i;
+    break;
+  case TOKENIZER_MINUS:
+    value.v.i = l->v.i - r->v.i;
+    break;
+  case TOKENIZER_ASTR:
+    value.v.i = l->v.i * r->v.i;
+    break;
+  case TOKENIZER_SLASH:
+  case TOKENIZER_MOD:
+    if (r->v.i == 0) {
+      return; /* left for the VM to fail on */
+    }
+    value.v.i = p->op == TOKENIZER_SLASH ? l->v.i / r->v.i : l->v.i % r->v.i;
+    break;
+  case TOKENIZER_AND:
+    value.v.i = l->v.i & r->v.i;
+    break;
+  case TOKENIZER_OR:
+    value.v.i = l->v.i | r->v.i;
+    break;
+  case TOKENIZER_LT:
+    value.v.i = l->v.i < r->v.i;
+    break;
+  case TOKENIZER_GT:
+    value.v.i = l->v.i > r->v.i;
+    break;
+  default:
+    value.v.i = l->v.i == r->v.i;
+    break;
+  }
+  set_const(n, N_NUM, &value);
+}
+/*---------------------------------------------------------------------------*/
+static void fold_conv(int n) {
+  struct node *p = &nodes[n], *l = &nodes[p->left];
+  struct node value;
+  char buff[64];
+
+  switch (p->op) {
+  case OP_ITOF:
+    value.v.f = (VARFLOAT_TYPE)l->v.i;
+    set_const(n, N_NUMF, &value);
+    break;
+  case OP_FTOI:
+    value.v.i = (VARIABLE_TYPE)l->v.f;
+    set_const(n, N_NUM, &value);
+    break;
+  case OP_ITOS:
+    sprintf(buff, "%d", l->v.i);
+    value.v.str = add_string(buff);
+    set_const(n, N_STR, &value);
+    break;
+  case OP_FTOSF:
+    sprintf(buff, "%f", l->v.f);
+    value.v.str = add_string(buff);
+    set_const(n, N_STR, &value);
+    break;
+  case OP_LEN:
+    value.v.i = BC_STRING(prog->strings + l->v.str)->len;
+    set_const(n, N_NUM, &value);
+    break;
+  }
+  /* OP_FTOS is left to the VM, it formats like print */
+}
+/*---------------------------------------------------------------------------*/
+static void fold(int n) {
+  struct node *p;
+  int c;
+
+  if (n < 0) {
+    return;
+  }
+  p = &nodes[n];
+  switch (p->kind) {
+  case N_VAR:
+  case N_VARF:
+  case N_VARS:
+    c = known[var_type(p->kind)][p->v.var];
+    if (c >= 0) {
+      set_const(n, nodes[c].kind, &nodes[c]);
+    } else {
+      reads[var_type(p->kind)][p->v.var] = 1;
+    }
+    break;
+  case N_BINOP:
+    fold(p->left);
+    fold(p->right);
+    if (is_const(p->left) && is_const(p->right)) {
+      fold_binop(n);
+    }
+    break;
+  case N_CONV:
+    fold(p->left);
+    if (is_const(p->left)) {
+      fold_conv(n);
+    }
+    break;
+  case N_BUILTIN:
+  case N_BUILTINF:
+  case N_ITEM:
+    fold(p->left);
+    fold(p->right);
+    break;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void count_write(int type, int var, int n) {
+  if (var >= 0 && var < MAX_VARNUM) {
+    writes[type][var] += n;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void fold_program(void) {
+  int s, straight = 1;
+  struct stmt *st;
+
+  memset(known, -1, sizeof(known));
+  memset(reads, 0, sizeof(reads));
+  memset(writes, 0, sizeof(writes));
+  folded = 0;
+  for (s = 0; s < stmts_len; s++) {
+    st = &stmts[s];
+    switch (st->kind) {
+    case S_LET:
+      count_write(st->type, st->var, 1);
+      break;
+    case S_FOR:
+    case S_NEXT:
+      count_write(st->type, st->var, 2);
+      break;
+    case S_PEEK:
+    case S_POP:
+      count_write(T_INT, st->var, 2);
+      break;
+    }
+  }
+
+  /* Statements in order, noting constants until the first jump or label */
+  for (s = 0; s < stmts_len; s++) {
+    st = &stmts[s];
+    if (!st->top) {
+      continue;
+    }
+    switch (st->kind) {
+    case S_LET:
+    case S_PRINT:
+    case S_OS:
+    case S_SIMPLE:
+    case S_POKE:
+    case S_PEEK:
+    case S_POP:
+      break;
+    default:
+      straight = 0;
+      break;
+    }
+    if (!straight) {
+      break;
+    }
+    fold(st->e1);
+    fold(st->e2);
+    if (st->kind == S_LET && is_const(st->e1) &&
+        writes[st->type][st->var] == 1 && !reads[st->type][st->var]) {
+      known[st->type][st->var] = st->e1;
+    }
+  }
+
+  for (s = 0; s < stmts_len; s++) {
+    fold(stmts[s].e1);
+    fold(stmts[s].e2);
+    fold(stmts[s].e3);
+  }
+  DEBUG_PRINTF("compiler: folded %d nodes\n", folded);
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Dead code. Comments never reach the compiler and labels emit nothing,
+ * but statements that can't run still cost code and line table: those
+ * after a goto, end or return that no goto or gosub of a live statement
+ * leads back to, and the branch an if with a folded condition never
+ * takes. A goto to the statement that follows anyway is dropped too.
+ * emit_program() leaves dead statements out and counts what they would
+ * have cost in pruned.
+ */
+static int taken(int s) {
+  struct stmt *st = &stmts[s];
+
+  if (st->kind != S_IF || !is_const(st->e1) || nodes[st->e1].kind != N_NUM) {
+    return -2;
+  }
+  return nodes[st->e1].v.i ? st->then_stmt : st->else_stmt;
+}
+/*---------------------------------------------------------------------------*/
+/* Whether the statement after s can run next */
+static int falls_through(int s) {
+  int t;
+
+  if (s < 0) {
+    return 1;
+  }
+  switch (stmts[s].kind) {
+  case S_GOTO:
+  case S_END:
+  case S_RETURN:
+    return 0;
+  case S_IF:
+    t = taken(s);
+    if (t != -2) {
+      return falls_through(t);
+    }
+    return stmts[s].else_stmt < 0 || falls_through(stmts[s].then_stmt) ||
+           falls_through(stmts[s].else_stmt);
+  }
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+/* Marks the labels s can jump to, returns 1 if any was new */
+static int mark_targets(int s, char *used) {
+  int t;
+
+  if (s < 0) {
+    return 0;
+  }
+  switch (stmts[s].kind) {
+  case S_GOTO:
+  case S_GOSUB:
+    if (used[stmts[s].label]) {
+      return 0;
+    }
+    used[stmts[s].label] = 1;
+    return 1;
+  case S_IF:
+    t = taken(s);
+    if (t != -2) {
+      return mark_targets(t, used);
+    }
+    return mark_targets(stmts[s].then_stmt, used) |
+           mark_targets(stmts[s].else_stmt, used);
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* The first statement after s that emits code (labels don't), or stmts_len */
+static int next_live(int s) {
+  for (s++; s < stmts_len; s++) {
+    if (stmts[s].top && !stmts[s].dead && stmts[s].kind != S_LABEL) {
+      break;
+    }
+  }
+  return s;
+}
+/*---------------------------------------------------------------------------*/
+static void prune_program(void) {
+  char *used;
+  int s, t, live, changed = 1;
+
+  used = calloc(labels_len + 1, 1);
+  if (used == NULL) {
+    return;
+  }
+  for (s = 0; s < stmts_len; s++) {
+    stmts[s].dead = 1;
+  }
+  /* Until no live statement leads to a label not yet marked */
+  while (changed) {
+    changed = 0;
+    live = 1;
+    for (s = 0; s < stmts_len; s++) {
+      if (!stmts[s].top) {
+        continue;
+      }
+      if (stmts[s].kind == S_LABEL && used[stmts[s].label]) {
+        live = 1;
+      }
+      if (live) {
+        stmts[s].dead = 0;
+        changed |= mark_targets(s, used);
+        live = falls_through(s);
+      }
+    }
+  }
+  /* Backwards, so "goto a: goto a: a:" loses both */
+  for (s = stmts_len - 1; s >= 0; s--) {
+    if (stmts[s].top && !stmts[s].dead && stmts[s].kind == S_GOTO) {
+      t = labels[stmts[s].label].stmt;
+      if (t > s && next_live(s) > t) {
+        stmts[s].dead = 1;
+      }
+    }
+  }
+  free(used);
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Loop invariant hoisting. For each for/next pair whose body can only be
+ * entered through the for (no labels inside, next not inside an if), the
+ * largest sub-expressions of the body that only read variables the body
+ * never writes are computed once before the loop, into a temp, and the
+ * body reads the temp instead. A gosub in the body counts as writing
+ * every variable the program writes anywhere.
+ *
+ * Only pure integer and float expressions move: no strings, no rnd,
+ * randint or time, and no integer division unless by a non zero
+ * constant, since the hoisted expression runs even if the statement
+ * holding it doesn't.
+ */
+static int loop_writes[3][MAX_VARNUM];
+static int temps_len;
+
+static int pure_builtin(int token) {
+  return token != TOKENIZER_RANDINT && token != TOKENIZER_TIME &&
+         token != TOKENIZER_RND;
+}
+/*---------------------------------------------------------------------------*/
+static int invariant(int n) {
+  struct node *p;
+
+  if (n < 0) {
+    return 1;
+  }
+  p = &nodes[n];
+  switch (p->kind) {
+  case N_NUM:
+  case N_NUMF:
+  case N_TEMP:
+    return 1;
+  case N_VAR:
+  case N_VARF:
+    return !loop_writes[p->type][p->v.var];
+  case N_BINOP:
+    if (p->type == T_STRING || nodes[p->left].type == T_STRING) {
+      return 0;
+    }
+    if ((p->op == TOKENIZER_SLASH || p->op == TOKENIZER_MOD) &&
+        p->type == T_INT &&
+        (nodes[p->right].kind != N_NUM || nodes[p->right].v.i == 0)) {
+      return 0;
+    }
+    return invariant(p->left) && invariant(p->right);
+  case N_CONV:
+    return p->type != T_STRING && invariant(p->left);
+  case N_BUILTIN:
+  case N_BUILTINF:
+    return pure_builtin(p->op) && invariant(p->left);
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+#if COMPILER_DUMP
+static void dump_expr(int n) {
+  static const char *const conv[] = {"itof", "ftoi", "itos", "ftos", "ftosf"};
+  static const struct {
+    int token;
+    const char *name;
+  } builtins[] = {
+      {TOKENIZER_ZERO, "zero"}, {TOKENIZER_NOT, "not"},
+      {TOKENIZER_ABS, "abs"},   {TOKENIZER_ATN, "atn"},
+      {TOKENIZER_COS, "cos"},   {TOKENIZER_EXP, "exp"},
+      {TOKENIZER_LOG, "log"},   {TOKENIZER_SIN, "sin"},
+      {TOKENIZER_SQR, "sqr"},   {TOKENIZER_TAN, "tan"},
+      {0, "builtin"}};
+  struct node *p = &nodes[n];
+  int i;
+
+  switch (p->kind) {
+  case N_NUM:
+    printf("%d", p->v.i);
+    break;
+  case N_NUMF:
+    printf("%g", p->v.f);
+    break;
+  case N_VAR:
+    printf("%c", 'a' + p->v.var);
+    break;
+  case N_VARF:
+    printf("%c#", 'a' + p->v.var);
+    break;
+  case N_TEMP:
+    printf("t%d", p->v.var);
+    break;
+  case N_BINOP:
+    printf("(");
+    dump_expr(p->left);
+    printf(" %c ", "+-&|*/%<>="[p->op == TOKENIZER_PLUS    ? 0
+                                 : p->op == TOKENIZER_MINUS ? 1
+                                 : p->op == TOKENIZER_AND   ? 2
+                                 : p->op == TOKENIZER_OR    ? 3
+                                 : p->op == TOKENIZER_ASTR  ? 4
+                                 : p->op == TOKENIZER_SLASH ? 5
+                                 : p->op == TOKENIZER_MOD   ? 6
+                                 : p->op == TOKENIZER_LT    ? 7
+                                 : p->op == TOKENIZER_GT    ? 8
+                                                            : 9]);
+    dump_expr(p->right);
+    printf(")");
+    break;
+  case N_CONV:
+    printf("%s(", conv[p->op - OP_ITOF]);
+    dump_expr(p->left);
+    printf(")");
+    break;
+  default:
+    for (i = 0; builtins[i].token != p->op && builtins[i].token != 0; i++) {
+    }
+    printf("%s(", builtins[i].name);
+    if (p->left >= 0) {
+      dump_expr(p->left);
+    }
+    printf(")");
+    break;
+  }
+}
+#endif
+/*---------------------------------------------------------------------------*/
+/* Replace the invariant parts of tree n by temps computed before loop */
+static void hoist_tree(int n, int loop) {
+  int c, h;
+
+  if (n < 0 || failed) {
+    return;
+  }
+  switch (nodes[n].kind) {
+  case N_BINOP:
+  case N_CONV:
+  case N_BUILTIN:
+  case N_BUILTINF:
+    if (temps_len < BC_TEMPS && invariant(n)) {
+      c = new_node(nodes[n].kind, nodes[n].type);
+      h = new_node(N_HOIST, nodes[n].type);
+      if (c < 0 || h < 0) {
+        return;
+      }
+      nodes[c] = nodes[n];
+      nodes[h].left = c;
+      nodes[h].right = stmts[loop].hoist;
+      nodes[h].v.var = temps_len;
+      stmts[loop].hoist = h;
+      nodes[n].kind = N_TEMP;
+      nodes[n].left = nodes[n].right = -1;
+      nodes[n].v.var = temps_len++;
+#if COMPILER_DUMP
+      printf("hoist line %d: ", stmts[loop].line);
+      dump_expr(c);
+      printf(" -> t%d\n", nodes[n].v.var);
+#endif
+      return;
+    }
+    break;
+  case N_ITEM:
+    break;
+  default:
+    return;
+  }
+  hoist_tree(nodes[n].left, loop);
+  hoist_tree(nodes[n].right, loop);
+}
+/*---------------------------------------------------------------------------*/
+static void note_write(int type, int var) {
+  if (var >= 0 && var < MAX_VARNUM) {
+    loop_writes[type][var] = 1;
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* The next closing the for at s, or -1 if the loop isn't a simple one */
+static int loop_end(int s) {
+  int e, nesting = 0;
+
+  for (e = s + 1; e < stmts_len; e++) {
+    switch (stmts[e].kind) {
+    case S_LABEL:
+      return -1;
+    case S_FOR:
+      nesting++;
+      break;
+    case S_NEXT:
+      if (!stmts[e].top) {
+        return -1;
+      }
+      if (nesting == 0) {
+        return stmts[e].var == stmts[s].var && stmts[e].type == stmts[s].type
+                   ? e
+                   : -1;
+      }
+      nesting--;
+      break;
+    }
+  }
+  return -1;
+}
+/*---------------------------------------------------------------------------*/
+static void hoist_loop(int s) {
+  int e, end = loop_end(s), gosub = 0;
+  struct stmt *st;
+
+  if (end < 0) {
+    return;
+  }
+  memset(loop_writes, 0, sizeof(loop_writes));
+  for (e = s; e <= end; e++) {
+    st = &stmts[e];
+    switch (st->kind) {
+    case S_LET:
+    case S_FOR:
+    case S_NEXT:
+      note_write(st->type, st->var);
+      break;
+    case S_PEEK:
+    case S_POP:
+      note_write(T_INT, st->var);
+      break;
+    case S_GOSUB:
+      gosub = 1;
+      break;
+    }
+  }
+  if (gosub) {
+    for (e = 0; e < MAX_VARNUM; e++) {
+      loop_writes[T_INT][e] |= writes[T_INT][e] > 0;
+      loop_writes[T_FLOAT][e] |= writes[T_FLOAT][e] > 0;
+    }
+  }
+  for (e = s + 1; e < end; e++) {
+    hoist_tree(stmts[e].e1, s);
+    hoist_tree(stmts[e].e2, s);
+    hoist_tree(stmts[e].e3, s);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* Outer loops first, so an expression moves as far out as it can */
+static void hoist_program(void) {
+  int s;
+
+  temps_len = 0;
+  for (s = 0; s < stmts_len && !failed; s++) {
+    if (stmts[s].kind == S_FOR && stmts[s].top && !stmts[s].dead) {
+      hoist_loop(s);
+    }
+  }
+  prog->temps = temps_len;
+}
+/*---------------------------------------------------------------------------*/
+static int emit(int word) {
+  if (!grow((void **)&prog->code, &code_cap, prog->code_len + 1,
+            sizeof(int32_t))) {
+    return 0;
+  }
+  prog->code[prog->code_len] = word;
+  return prog->code_len++;
+}
+/*---------------------------------------------------------------------------*/
+static int emit2(int op, int operand) {
+  int at = emit(op);
+  emit(operand);
+  return at + 1;
+}
+/*---------------------------------------------------------------------------*/
+static void emit_fixup(int at, int label) {
+  if (!grow((void **)&fixups, &fixups_cap, fixups_len + 1,
+            sizeof(struct fixup))) {
+    return;
+  }
+  fixups[fixups_len].at = at;
+  fixups[fixups_len].label = label;
+  fixups_len++;
+}
+/*---------------------------------------------------------------------------*/
+static void emit_jump(int op, int label) {
+  emit_fixup(emit2(op, 0), label);
+}
+/*---------------------------------------------------------------------------*/
+static int depth(int n);
+
+/*
+ * A chain of string + is joined by CONCATs of up to CONCAT_MAX strings,
+ * parentheses don't matter. These walk its parts in order, pending being
+ * how many are on the stack waiting to be joined.
+ */
+static int is_concat(int n) {
+  return nodes[n].kind == N_BINOP && nodes[n].type == T_STRING;
+}
+/*---------------------------------------------------------------------------*/
+static int concat_depth(int n, int *pending) {
+  int l, r;
+
+  if (is_concat(n)) {
+    l = concat_depth(nodes[n].left, pending);
+    r = concat_depth(nodes[n].right, pending);
+    return l > r ? l : r;
+  }
+  if (*pending == CONCAT_MAX) {
+    *pending = 1;
+  }
+  return (*pending)++ + depth(n);
+}
+/*---------------------------------------------------------------------------*/
+/* Operand stack slots needed to evaluate a tree */
+static int depth(int n) {
+  int l, r, pending = 0;
+
+  switch (nodes[n].kind) {
+  case N_BINOP:
+    if (is_concat(n)) {
+      return concat_depth(n, &pending);
+    }
+    l = depth(nodes[n].left);
+    r = depth(nodes[n].right) + 1;
+    return l > r ? l : r;
+  case N_CONV:
+    return depth(nodes[n].left);
+  case N_BUILTIN:
+  case N_BUILTINF:
+    return nodes[n].left >= 0 ? depth(nodes[n].left) : 1;
+  }
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+static void need_stack(int n, int below) {
+  int d = depth(n) + below;
+
+  if (d > BC_STACK_DEPTH) {
+    fail("expression too complex");
+  }
+  if (d > prog->stack_depth) {
+    prog->stack_depth = d;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static int binop_opcode(int token, int type) {
+  switch (token) {
+  case TOKENIZER_PLUS:
+    return type == T_INT ? OP_ADDI : OP_ADDF;
+  case TOKENIZER_MINUS:
+    return type == T_INT ? OP_SUBI : OP_SUBF;
+  case TOKENIZER_ASTR:
+    return type == T_INT ? OP_MULI : OP_MULF;
+  case TOKENIZER_SLASH:
+    return type == T_INT ? OP_DIVI : OP_DIVF;
+  case TOKENIZER_MOD:
+    return OP_MODI;
+  case TOKENIZER_AND:
+    return OP_ANDI;
+  case TOKENIZER_OR:
+    return OP_ORI;
+  case TOKENIZER_LT:
+    return type == T_INT ? OP_LTI : OP_LTF;
+  case TOKENIZER_GT:
+    return type == T_INT ? OP_GTI : OP_GTF;
+  }
+  return type == T_INT ? OP_EQI : OP_EQF;
+}
+/*---------------------------------------------------------------------------*/
+static void emit_expr(int n);
+
+static void emit_concat(int n, int *pending) {
+  if (is_concat(n)) {
+    emit_concat(nodes[n].left, pending);
+    emit_concat(nodes[n].right, pending);
+    return;
+  }
+  if (*pending == CONCAT_MAX) {
+    emit2(OP_CONCAT, CONCAT_MAX);
+    *pending = 1;
+  }
+  emit_expr(n);
+  (*pending)++;
+}
+/*---------------------------------------------------------------------------*/
+static void emit_expr(int n) {
+  struct node *p = &nodes[n];
+  int pending = 0;
+
+  switch (p->kind) {
+  case N_NUM:
+    emit2(OP_PUSHI, p->v.i);
+    break;
+  case N_NUMF:
+    emit2(OP_PUSHF, add_float(p->v.f));
+    break;
+  case N_STR:
+    emit2(OP_PUSHS, p->v.str);
+    break;
+  case N_VAR:
+    emit2(OP_LOADI, p->v.var);
+    break;
+  case N_VARF:
+    emit2(OP_LOADF, p->v.var);
+    break;
+  case N_VARS:
+    emit2(OP_LOADS, p->v.var);
+    break;
+  case N_TEMP:
+    emit2(OP_LOADT, p->v.var);
+    break;
+  case N_BINOP:
+    if (is_concat(n)) {
+      /* Each part copied once, into a string made at its full length */
+      emit_concat(n, &pending);
+      emit2(OP_CONCAT, pending);
+      break;
+    }
+    emit_expr(p->left);
+    emit_expr(nodes[n].right);
+    /* the operand type, comparisons of floats give an integer */
+    emit(binop_opcode(nodes[n].op, nodes[nodes[n].left].type));
+    break;
+  case N_CONV:
+    emit_expr(p->left);
+    emit(nodes[n].op);
+    break;
+  case N_BUILTIN:
+  case N_BUILTINF:
+    if (p->left >= 0) {
+      emit_expr(p->left);
+    } else if (p->kind == N_BUILTIN) {
+      emit2(OP_PUSHI, 0);
+    } else {
+      emit2(OP_PUSHF, add_float(0.0));
+    }
+    emit2(nodes[n].kind == N_BUILTIN ? OP_BUILTIN : OP_BUILTINF,
+          nodes[n].op);
+    break;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void emit_value(int n, int below) {
+  need_stack(n, below);
+  emit_expr(n);
+}
+/*---------------------------------------------------------------------------*/
+static void emit_items(int n, int print) {
+  for (; n >= 0; n = nodes[n].right) {
+    switch (nodes[n].op) {
+    case ITEM_LITERAL:
+      if (print) {
+        emit2(OP_PRINTLIT, nodes[nodes[n].left].v.str);
+      } else {
+        emit_value(nodes[n].left, 0);
+        emit(OP_OS);
+      }
+      break;
+    case ITEM_COMMA:
+      emit(OP_PRINTSP);
+      break;
+    case ITEM_SEMICOLON:
+      break;
+    default:
+      emit_value(nodes[n].left, 0);
+      if (!print) {
+        emit(OP_OS);
+      } else if (nodes[nodes[n].left].type == T_INT) {
+        emit(OP_PRINTI);
+      } else if (nodes[nodes[n].left].type == T_FLOAT) {
+        emit(OP_PRINTF);
+      } else {
+        emit(OP_PRINTS);
+      }
+      break;
+    }
+  }
+  emit(OP_PRINTNL);
+}
+/*---------------------------------------------------------------------------*/
+static int is_num(int n) { return n >= 0 && nodes[n].kind == N_NUM; }
+/*---------------------------------------------------------------------------*/
+static int is_var(int n, int var) {
+  return n >= 0 && nodes[n].kind == N_VAR && (var < 0 || nodes[n].v.var == var);
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Superinstructions for the most common statements, each a single
+ * instruction instead of a push/load/operate/store sequence. Returns 0
+ * if s doesn't match any of them.
+ */
+static int emit_fused(int s) {
+  struct stmt *st = &stmts[s];
+  struct node *e;
+
+  switch (st->kind) {
+  case S_LET:
+    /* let x = x + 1, let x = x - 1, let x = 1 + x */
+    e = &nodes[st->e1];
+    if (st->type != T_INT || e->kind != N_BINOP ||
+        (e->op != TOKENIZER_PLUS && e->op != TOKENIZER_MINUS)) {
+      return 0;
+    }
+    if (is_var(e->left, st->var) && is_num(e->right)) {
+      emit2(OP_ADDVI, st->var);
+      emit(e->op == TOKENIZER_PLUS ? nodes[e->right].v.i
+                                   : -nodes[e->right].v.i);
+      return 1;
+    }
+    if (e->op == TOKENIZER_PLUS && is_num(e->left) &&
+        is_var(e->right, st->var)) {
+      emit2(OP_ADDVI, st->var);
+      emit(nodes[e->left].v.i);
+      return 1;
+    }
+    return 0;
+  case S_IF:
+    /* if x < 9 then goto l:, also > and = */
+    e = &nodes[st->e1];
+    if (st->else_stmt >= 0 || stmts[st->then_stmt].kind != S_GOTO ||
+        e->kind != N_BINOP || !is_var(e->left, -1) || !is_num(e->right)) {
+      return 0;
+    }
+    switch (e->op) {
+    case TOKENIZER_LT:
+      emit2(OP_JLTVI, nodes[e->left].v.var);
+      break;
+    case TOKENIZER_GT:
+      emit2(OP_JGTVI, nodes[e->left].v.var);
+      break;
+    case TOKENIZER_EQ:
+      emit2(OP_JEQVI, nodes[e->left].v.var);
+      break;
+    default:
+      return 0;
+    }
+    emit(nodes[e->right].v.i);
+    emit_fixup(emit(0), stmts[st->then_stmt].label);
+    return 1;
+  case S_FOR:
+    /* for i = ... to 10 [step 2] */
+    if (st->type != T_INT || !is_num(st->e2) ||
+        (st->e3 >= 0 && !is_num(st->e3))) {
+      return 0;
+    }
+    emit_value(st->e1, 0);
+    emit2(OP_STOREI, st->var);
+    emit2(OP_FORI, st->var);
+    emit(nodes[st->e2].v.i);
+    emit(st->e3 >= 0 ? nodes[st->e3].v.i : 1);
+    return 1;
+  case S_SIMPLE:
+    /* pinon 25, pinoff 25, delay 100 */
+    if (!is_num(st->e1)) {
+      return 0;
+    }
+    switch (st->op) {
+    case OP_GPIOON:
+      emit2(OP_GPIOONI, nodes[st->e1].v.i);
+      return 1;
+    case OP_GPIOOFF:
+      emit2(OP_GPIOOFFI, nodes[st->e1].v.i);
+      return 1;
+    case OP_DELAY:
+      emit2(OP_DELAYI, nodes[st->e1].v.i);
+      return 1;
+    }
+    return 0;
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static void emit_stmt(int s) {
+  static const int store[] = {OP_STOREI, OP_STOREF, OP_STORES};
+  int at, jump, h;
+
+  stmts[s].pc = prog->code_len;
+  if (prog->lines_len == 0 ||
+      prog->lines[prog->lines_len - 1].line != stmts[s].line) {
+    if (grow((void **)&prog->lines, &lines_cap, prog->lines_len + 1,
+             sizeof(struct bc_line))) {
+      prog->lines[prog->lines_len].pc = prog->code_len;
+      prog->lines[prog->lines_len].line = stmts[s].line;
+      prog->lines_len++;
+    }
+  }
+
+  for (h = stmts[s].hoist; h >= 0; h = nodes[h].right) {
+    emit_value(nodes[h].left, 0);
+    emit2(OP_STORET, nodes[h].v.var);
+  }
+  at = taken(s);
+  if (at != -2) {
+    if (at >= 0) {
+      emit_stmt(at);
+    }
+    return;
+  }
+  if (emit_fused(s)) {
+    return;
+  }
+  switch (stmts[s].kind) {
+  case S_PRINT:
+  case S_OS:
+    emit_items(stmts[s].e1, stmts[s].kind == S_PRINT);
+    break;
+  case S_IF:
+    emit_value(stmts[s].e1, 0);
+    at = emit2(OP_JZ, 0);
+    emit_stmt(stmts[s].then_stmt);
+    if (stmts[s].else_stmt >= 0) {
+      jump = emit2(OP_JMP, 0);
+      prog->code[at] = prog->code_len;
+      emit_stmt(stmts[s].else_stmt);
+      prog->code[jump] = prog->code_len;
+    } else {
+      prog->code[at] = prog->code_len;
+    }
+    break;
+  case S_GOTO:
+    emit_jump(OP_JMP, stmts[s].label);
+    break;
+  case S_GOSUB:
+    emit_jump(OP_GOSUB, stmts[s].label);
+    break;
+  case S_RETURN:
+    emit(OP_RETURN);
+    break;
+  case S_FOR:
+    emit_value(stmts[s].e1, 0);
+    emit2(store[stmts[s].type], stmts[s].var);
+    emit_value(stmts[s].e2, 0);
+    if (stmts[s].e3 >= 0) {
+      emit_value(stmts[s].e3, 1);
+    } else if (stmts[s].type == T_INT) {
+      emit2(OP_PUSHI, 1);
+    } else {
+      emit2(OP_PUSHF, add_float(1.0));
+    }
+    emit2(stmts[s].type == T_INT ? OP_FOR : OP_FORF, stmts[s].var);
+    break;
+  case S_NEXT:
+    emit2(stmts[s].type == T_INT ? OP_NEXT : OP_NEXTF, stmts[s].var);
+    break;
+  case S_PEEK:
+    emit_value(stmts[s].e1, 0);
+    emit2(OP_PEEK, stmts[s].var);
+    break;
+  case S_POKE:
+    emit_value(stmts[s].e1, 0);
+    emit_value(stmts[s].e2, 1);
+    emit(OP_POKE);
+    break;
+  case S_POP:
+    if (stmts[s].var >= 0) {
+      emit2(OP_POP, stmts[s].var);
+    }
+    break;
+  case S_SIMPLE:
+    emit_value(stmts[s].e1, 0);
+    emit(stmts[s].op);
+    break;
+  case S_END:
+    emit(OP_END);
+    break;
+  case S_LABEL:
+    break;
+  case S_LET:
+    emit_value(stmts[s].e1, 0);
+    emit2(store[stmts[s].type], stmts[s].var);
+    break;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void parse_program(const char *program) {
+  int s;
+
+  line_no = 1;
+  line_scan = program;
+  tokenizer_init(program);
+  while (!failed && tokenizer_token() != TOKENIZER_ENDOFINPUT) {
+    s = statement(0);
+    if (failed) {
+      break;
+    }
+    stmts[s].top = 1;
+    if (tokenizer_token() == TOKENIZER_CR) {
+      tokenizer_next();
+    } else if (tokenizer_token() == TOKENIZER_ERROR) {
+      fail("syntax error");
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void emit_program(void) {
+  int s, i, l, pc, lines, fixup, live = 1;
+
+  pruned = 0;
+  for (s = 0; s < stmts_len && !failed; s++) {
+    if (!stmts[s].top) {
+      continue;
+    }
+    if (!stmts[s].dead) {
+      emit_stmt(s);
+      live = falls_through(s);
+      continue;
+    }
+    /* Emitted only to be measured, then taken back */
+    pc = prog->code_len;
+    lines = prog->lines_len;
+    fixup = fixups_len;
+    emit_stmt(s);
+    pruned += (prog->code_len - pc) * sizeof(int32_t) +
+              (prog->lines_len - lines) * sizeof(struct bc_line);
+    prog->code_len = pc;
+    prog->lines_len = lines;
+    fixups_len = fixup;
+  }
+  /* Not needed when the last statement can't fall off the end */
+  if (live) {
+    emit(OP_END);
+  } else {
+    pruned += sizeof(int32_t);
+  }
+
+  for (i = 0; i < fixups_len && !failed; i++) {
+    s = labels[fixups[i].label].stmt;
+    if (s < 0) {
+      /* the line of the jump, from the line table */
+      for (l = 0; l < prog->lines_len && prog->lines[l].pc <= fixups[i].at;
+           l++) {
+        line_no = prog->lines[l].line;
+      }
+      fail("label not found");
+      break;
+    }
+    prog->code[fixups[i].at] = stmts[s].pc;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void free_tree(void) {
+  free(nodes);
+  free(stmts);
+  free(labels);
+  free(fixups);
+  nodes = NULL;
+  stmts = NULL;
+  labels = NULL;
+  fixups = NULL;
+  nodes_len = nodes_cap = stmts_len = stmts_cap = 0;
+  labels_len = labels_cap = fixups_len = fixups_cap = 0;
+}
+/*---------------------------------------------------------------------------*/
+int compiler_compile(const char *program, struct bc_program *p) {
+  memset(p, 0, sizeof(struct bc_program));
+  prog = p;
+  code_cap = floats_cap = strings_cap = lines_cap = 0;
+  failed = 0;
+  fail_msg = NULL;
+
+  parse_program(program);
+  if (!failed) {
+    fold_program();
+    prune_program();
+    hoist_program();
+    emit_program();
+  }
+  free_tree();
+  if (failed) {
+    compiler_free(p);
+    return -1;
+  }
+  DEBUG_PRINTF("compiler: %d words of code, %d floats, %d bytes of strings, "
+               "%d bytes of dead code left out\n",
+               p->code_len, p->floats_len, p->strings_len, pruned);
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* Statements that run from start to end without jumping anywhere */
+static int straight(int s) {
+  if (s < 0) {
+    return 1;
+  }
+  switch (stmts[s].kind) {
+  case S_LET:
+  case S_PRINT:
+  case S_OS:
+  case S_SIMPLE:
+  case S_POKE:
+  case S_PEEK:
+  case S_POP:
+    return 1;
+  case S_IF:
+    return straight(stmts[s].then_stmt) && straight(stmts[s].else_stmt);
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Compiles just the statement at the tokenizer's position, for the line
+ * cache of the text interpreter (see line_statement() in ubasic.c), and
+ * leaves the tokenizer after it, where the interpreter would have got
+ * to. Only straight() statements compile, anything else returns -1 with
+ * the tokenizer somewhere inside the statement. The code is folded but
+ * knows nothing of the rest of the program, and it ends in OP_END.
+ */
+int compiler_compile_line(struct bc_program *p) {
+  int s;
+
+  memset(p, 0, sizeof(struct bc_program));
+  prog = p;
+  code_cap = floats_cap = strings_cap = lines_cap = 0;
+  failed = 0;
+  fail_msg = NULL;
+  line_no = 1;
+  line_scan = tokenizer_pos();
+
+  s = statement(0);
+  if (!failed && (s < 0 || !straight(s))) {
+    fail("not a straight line statement");
+  }
+  if (!failed) {
+    stmts[s].top = 1;
+    if (tokenizer_token() == TOKENIZER_CR) {
+      tokenizer_next();
+    } else if (tokenizer_token() == TOKENIZER_ERROR) {
+      fail("syntax error");
+    }
+  }
+  if (!failed) {
+    fold_program();
+    emit_program();
+  }
+  free_tree();
+  if (failed) {
+    compiler_free(p);
+    return -1;
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+int compiler_pruned(void) { return pruned; }
+/*---------------------------------------------------------------------------*/
+const char *compiler_error(int *line) {
+  *line = fail_line;
+  return fail_msg;
+}
+/*---------------------------------------------------------------------------*/
+void compiler_free(struct bc_program *p) {
+  free(p->code);
+  free(p->floats);
+  free(p->strings);
+  free(p->lines);
+  memset(p, 0, sizeof(struct bc_program));
+}
@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2023, Gary Sims
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Compiled program images, see image.h. Images are written and read in
+ * the byte order of the machine, which is little endian for both the
+ * hosts pbcc runs on and the RP2040.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+/*---------------------------------------------------------------------------*/
+static uint32_t crc32(const unsigned char *p, int len) {
+  /* a nibble at a time, the table is small enough for any target */
+  static const uint32_t table[16] = {
+      0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4,
+      0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+      0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+  uint32_t crc = 0xffffffff;
+
+  while (len-- > 0) {
+    crc ^= *p++;
+    crc = (crc >> 4) ^ table[crc & 15];
+    crc = (crc >> 4) ^ table[crc & 15];
+  }
+  return ~crc;
+}
+/*---------------------------------------------------------------------------*/
+static int section_sizes(const struct image_header *h, int *floats,
+                         int *code, int *lines) {
+  *floats = h->floats_len * (int)sizeof(VARFLOAT_TYPE);
+  *code = h->code_len * (int)sizeof(int32_t);
+  *lines = h->lines_len * (int)sizeof(struct bc_line);
+  return (int)sizeof(struct image_header) + *floats + *code + *lines +
+         h->strings_len;
+}
+/*---------------------------------------------------------------------------*/
+int image_size(const struct bc_program *prog) {
+  struct image_header h;
+  int floats, code, lines;
+
+  h.floats_len = prog->floats_len;
+  h.code_len = prog->code_len;
+  h.lines_len = prog->lines_len;
+  h.strings_len = prog->strings_len;
+  return section_sizes(&h, &floats, &code, &lines);
+}
+/*---------------------------------------------------------------------------*/
+/* image must have room for image_size() bytes */
+void image_build(const struct bc_program *prog, int gosub_depth,
+                 const char *source, char *image) {
+  struct image_header h;
+  int floats, code, lines, size;
+  char *p = image + sizeof(h);
+
+  memset(&h, 0, sizeof(h));
+  h.magic = IMAGE_MAGIC;
+  h.version = BC_VERSION;
+  h.opcodes = OP__COUNT;
+  h.float_size = sizeof(VARFLOAT_TYPE);
+  h.code_len = prog->code_len;
+  h.floats_len = prog->floats_len;
+  h.strings_len = prog->strings_len;
+  h.lines_len = prog->lines_len;
+  h.stack_depth = prog->stack_depth;
+  h.temps = prog->temps;
+  h.gosub_depth = gosub_depth;
+  h.source_len = strlen(source);
+  h.source_hash = crc32((const unsigned char *)source, h.source_len);
+  size = section_sizes(&h, &floats, &code, &lines);
+
+  memcpy(p, prog->floats, floats);
+  p += floats;
+  memcpy(p, prog->code, code);
+  p += code;
+  memcpy(p, prog->lines, lines);
+  p += lines;
+  memcpy(p, prog->strings, h.strings_len);
+
+  h.checksum = crc32((const unsigned char *)image + sizeof(h),
+                     size - (int)sizeof(h));
+  memcpy(image, &h, sizeof(h));
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Whether image was compiled from source by this interpreter version, so
+ * it can be run instead. Only the header is looked at, image_load() still
+ * has to check the rest.
+ */
+int image_matches(const char *image, int len, const char *source) {
+  const struct image_header *h = (const struct image_header *)image;
+  int source_len = strlen(source);
+
+  return len >= (int)sizeof(*h) && h->magic == IMAGE_MAGIC &&
+         h->version == BC_VERSION && h->opcodes == OP__COUNT &&
+         h->float_size == sizeof(VARFLOAT_TYPE) &&
+         h->source_len == source_len &&
+         h->source_hash == crc32((const unsigned char *)source, source_len);
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * The operand stack of each opcode as "pops>pushes", i for an integer, f
+ * for a float and s for a string. Opcodes without an entry leave the
+ * stack alone, CONCAT, LOADT and STORET are checked by verify_code().
+ */
+static const char *const stack_types[OP__COUNT] = {
+    [OP_PUSHI] = ">i",     [OP_PUSHF] = ">f",      [OP_PUSHS] = ">s",
+    [OP_LOADI] = ">i",     [OP_LOADF] = ">f",      [OP_LOADS] = ">s",
+    [OP_STOREI] = "i>",    [OP_STOREF] = "f>",     [OP_STORES] = "s>",
+    [OP_ADDI] = "ii>i",    [OP_SUBI] = "ii>i",     [OP_MULI] = "ii>i",
+    [OP_DIVI] = "ii>i",    [OP_MODI] = "ii>i",     [OP_ANDI] = "ii>i",
+    [OP_ORI] = "ii>i",     [OP_LTI] = "ii>i",      [OP_GTI] = "ii>i",
+    [OP_EQI] = "ii>i",     [OP_ADDF] = "ff>f",     [OP_SUBF] = "ff>f",
+    [OP_MULF] = "ff>f",    [OP_DIVF] = "ff>f",     [OP_LTF] = "ff>i",
+    [OP_GTF] = "ff>i",     [OP_EQF] = "ff>i",      [OP_ITOF] = "i>f",
+    [OP_FTOI] = "f>i",     [OP_ITOS] = "i>s",      [OP_FTOS] = "f>s",
+    [OP_FTOSF] = "f>s",    [OP_LEN] = "s>i",       [OP_BUILTIN] = "i>i",
+    [OP_BUILTINF] = "f>f", [OP_PRINTI] = "i>",     [OP_PRINTF] = "f>",
+    [OP_PRINTS] = "s>",    [OP_JZ] = "i>",         [OP_FOR] = "ii>",
+    [OP_FORF] = "ff>",     [OP_PEEK] = "i>",       [OP_POKE] = "ii>",
+    [OP_SLEEP] = "i>",     [OP_DELAY] = "i>",      [OP_RANDOMIZE] = "i>",
+    [OP_PUSH] = "i>",      [OP_OS] = "s>",         [OP_GPIOINIT] = "i>",
+    [OP_GPIODIRIN] = "i>", [OP_GPIODIROUT] = "i>", [OP_GPIOON] = "i>",
+    [OP_GPIOOFF] = "i>",
+};
+
+/* Marks verify_code() keeps for each code word */
+#define START 1  /* an instruction starts here */
+#define TARGET 2 /* and something jumps to it */
+/*---------------------------------------------------------------------------*/
+/* Which operand of op is a jump target, 0 if none is */
+static int jump_operand(int op) {
+  switch (op) {
+  case OP_JMP:
+  case OP_JZ:
+  case OP_GOSUB:
+    return 1;
+  case OP_JLTVI:
+  case OP_JGTVI:
+  case OP_JEQVI:
+    return 3;
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* Whether off is the text of a string in the pool, as the compiler lays it out */
+static int pool_string(const struct bc_program *prog, int32_t off) {
+  const struct bc_string *s;
+
+  if (off < (int32_t)offsetof(struct bc_string, text) ||
+      off >= prog->strings_len || off % 4 != 0) {
+    return 0;
+  }
+  s = BC_STRING(prog->strings + off);
+  return s->refs < 0 && s->len >= 0 && s->len < prog->strings_len - off &&
+         prog->strings[off + s->len] == '\0';
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Checks the code of prog as the VM will run it, so an image that passed
+ * the crc but wasn't written by pbcc (or by a pbcc that had a bug) can't
+ * make the VM dispatch on a bad opcode or index outside its tables:
+ * every opcode and operand is in range, jumps land on instructions, the
+ * code can't run off its end and every instruction finds the types it
+ * expects on the operand stack. The compiler only jumps, sleeps and loops
+ * with an empty stack, so following the code in order is enough to know
+ * the stack at each instruction. Returns NULL or what is wrong.
+ */
+static const char *verify_code(const struct bc_program *prog) {
+#define BC_OPERANDS(name, operands, pops, pushes) operands,
+  static const unsigned char operands[] = {BC_OPCODES(BC_OPERANDS)};
+#undef BC_OPERANDS
+  const int32_t *code = prog->code;
+  char stack[BC_STACK_DEPTH], temps[BC_TEMPS];
+  unsigned char *marks;
+  const char *types, *err = NULL;
+  int pc, op = OP_END, depth = 0, i;
+
+  marks = calloc(prog->code_len, 1);
+  if (marks == NULL) {
+    return "out of memory";
+  }
+  memset(temps, 0, sizeof(temps));
+
+  /* Instructions and their operands, and where the jumps go */
+  for (pc = 0; pc < prog->code_len; pc += 1 + operands[op]) {
+    op = code[pc];
+    if (op < 0 || op >= OP__COUNT) {
+      err = "bad opcode";
+      break;
+    }
+    if (operands[op] >= prog->code_len - pc) {
+      err = "truncated instruction";
+      break;
+    }
+    marks[pc] |= START;
+    i = jump_operand(op);
+    if (i > 0 && (code[pc + i] < 0 || code[pc + i] >= prog->code_len)) {
+      err = "jump out of the code";
+      break;
+    }
+    if (i > 0) {
+      marks[code[pc + i]] |= TARGET;
+    }
+  }
+  if (err == NULL && op != OP_END && op != OP_JMP && op != OP_RETURN) {
+    err = "code runs off its end";
+  }
+
+  /* Operands and operand stack, in order */
+  for (pc = 0; pc < prog->code_len && err == NULL; pc += 1 + operands[op]) {
+    op = code[pc];
+    if ((marks[pc] & TARGET) && depth != 0) {
+      err = "jump into an expression";
+      break;
+    }
+    i = jump_operand(op);
+    if (i > 0 && !(marks[code[pc + i]] & START)) {
+      err = "jump into an instruction";
+      break;
+    }
+    /* only the other jumps count towards VM_SLICE, see vm_run() */
+    if (op == OP_JZ && code[pc + 1] <= pc) {
+      err = "backward jz";
+      break;
+    }
+    switch (op) {
+    case OP_JLTVI:
+    case OP_JGTVI:
+    case OP_JEQVI:
+    case OP_LOADI:
+    case OP_LOADF:
+    case OP_LOADS:
+    case OP_STOREI:
+    case OP_STOREF:
+    case OP_STORES:
+    case OP_FOR:
+    case OP_FORF:
+    case OP_NEXT:
+    case OP_NEXTF:
+    case OP_PEEK:
+    case OP_POP:
+    case OP_ADDVI:
+    case OP_FORI:
+      if (code[pc + 1] < 0 || code[pc + 1] >= MAX_VARNUM) {
+        err = "bad variable";
+      }
+      break;
+    case OP_PUSHF:
+      if (code[pc + 1] < 0 || code[pc + 1] >= prog->floats_len) {
+        err = "bad float";
+      }
+      break;
+    case OP_PUSHS:
+    case OP_PRINTLIT:
+      if (!pool_string(prog, code[pc + 1])) {
+        err = "bad string";
+      }
+      break;
+    case OP_LOADT:
+    case OP_STORET:
+      /* each temp holds one value of one type */
+      i = code[pc + 1];
+      if (i < 0 || i >= prog->temps) {
+        err = "bad temp";
+      } else if (op == OP_STORET && depth > 0 &&
+                 (temps[i] == 0 || temps[i] == stack[depth - 1])) {
+        temps[i] = stack[--depth];
+      } else if (op == OP_LOADT && temps[i] != 0 && depth < BC_STACK_DEPTH) {
+        stack[depth++] = temps[i];
+      } else {
+        err = "bad temp";
+      }
+      break;
+    case OP_CONCAT:
+      if (code[pc + 1] < 1 || code[pc + 1] > depth) {
+        err = "operand stack underflow";
+        break;
+      }
+      for (i = 0; i < code[pc + 1]; i++) {
+        if (stack[--depth] != 's') {
+          err = "operand of the wrong type";
+        }
+      }
+      stack[depth++] = 's';
+      break;
+    }
+    types = stack_types[op];
+    if (err == NULL && types != NULL) {
+      /* pops are listed bottom first, so check them from the top */
+      for (i = strchr(types, '>') - types; i > 0 && err == NULL; i--) {
+        if (depth == 0) {
+          err = "operand stack underflow";
+        } else if (stack[--depth] != types[i - 1]) {
+          err = "operand of the wrong type";
+        }
+      }
+      types = strchr(types, '>') + 1;
+      if (*types != '\0' && depth >= BC_STACK_DEPTH) {
+        err = "operand stack overflow";
+      } else if (*types != '\0') {
+        stack[depth++] = *types;
+      }
+    }
+    if (err != NULL) {
+      break;
+    }
+    /* The VM loses the stack when it stops or sleeps, and loops on jumps */
+    switch (op) {
+    case OP_END:
+    case OP_JMP:
+    case OP_JZ:
+    case OP_GOSUB:
+    case OP_RETURN:
+    case OP_FOR:
+    case OP_FORF:
+    case OP_FORI:
+    case OP_NEXT:
+    case OP_NEXTF:
+    case OP_SLEEP:
+    case OP_DELAY:
+    case OP_DELAYI:
+    case OP_JLTVI:
+    case OP_JGTVI:
+    case OP_JEQVI:
+      if (depth != 0) {
+        err = "operand stack not empty";
+      }
+      break;
+    }
+  }
+  free(marks);
+  return err;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Checks an image of len bytes and points prog into it, so the image has
+ * to outlive prog and be aligned for VARFLOAT_TYPE. Returns NULL, or why
+ * the image can't be run.
+ */
+const char *image_load(const char *image, int len, struct bc_program *prog,
+                       int *gosub_depth) {
+  const struct image_header *h = (const struct image_header *)image;
+  int floats, code, lines;
+  const char *p = image + sizeof(*h);
+
+  if (len < (int)sizeof(*h) || h->magic != IMAGE_MAGIC) {
+    return "not a compiled program";
+  }
+  if (h->version != BC_VERSION || h->opcodes != OP__COUNT ||
+      h->float_size != sizeof(VARFLOAT_TYPE)) {
+    return "compiled for another interpreter version";
+  }
+  if ((uintptr_t)image % sizeof(VARFLOAT_TYPE) != 0) {
+    return "image not aligned";
+  }
+  if (h->code_len <= 0 || h->floats_len < 0 || h->strings_len < 0 ||
+      h->lines_len < 0 || h->code_len > len / (int)sizeof(int32_t) ||
+      h->floats_len > len / (int)sizeof(VARFLOAT_TYPE) ||
+      h->lines_len > len / (int)sizeof(struct bc_line) ||
+      h->strings_len > len || section_sizes(h, &floats, &code, &lines) != len) {
+    return "truncated";
+  }
+  if (crc32((const unsigned char *)p, len - (int)sizeof(*h)) != h->checksum) {
+    return "checksum mismatch";
+  }
+  if (h->stack_depth > BC_STACK_DEPTH || h->temps > BC_TEMPS ||
+      (h->strings_len > 0 && image[len - 1] != '\0')) {
+    return "malformed";
+  }
+
+  memset(prog, 0, sizeof(*prog));
+  prog->floats = (VARFLOAT_TYPE *)p;
+  prog->floats_len = h->floats_len;
+  p += floats;
+  prog->code = (int32_t *)p;
+  prog->code_len = h->code_len;
+  p += code;
+  prog->lines = (struct bc_line *)p;
+  prog->lines_len = h->lines_len;
+  p += lines;
+  prog->strings = (char *)p;
+  prog->strings_len = h->strings_len;
+  prog->stack_depth = h->stack_depth;
+  prog->temps = h->temps;
+  *gosub_depth = h->gosub_depth;
+  return verify_code(prog);
+}
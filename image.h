@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2023, Gary Sims
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include "bytecode.h"
+
+/*
+ * A compiled program as a file, written by tools/pbcc and run by the
+ * device instead of main.bas. The header is followed by the float pool,
+ * the code, the line table and the string pool, each in the layout of
+ * struct bc_program, so loading an image only checks it and points a
+ * struct bc_program into it.
+ */
+#define IMAGE_MAGIC 0x00434250 /* "PBC" */
+
+struct image_header {
+  uint32_t magic;
+  uint16_t version;     /* BC_VERSION of the compiler that wrote it */
+  uint8_t opcodes;      /* OP__COUNT */
+  uint8_t float_size;   /* sizeof(VARFLOAT_TYPE) */
+  uint32_t checksum;    /* crc32 of everything after the header */
+  uint32_t source_hash; /* crc32 of the program text, see image_matches() */
+  int32_t source_len;
+  int32_t code_len;
+  int32_t floats_len;
+  int32_t strings_len;
+  int32_t lines_len;
+  int32_t stack_depth;
+  int32_t temps;
+  int32_t gosub_depth; /* the program's gosub_depth pragma */
+};
+
+int image_size(const struct bc_program *prog);
+void image_build(const struct bc_program *prog, int gosub_depth,
+                 const char *source, char *image);
+int image_matches(const char *image, int len, const char *source);
+const char *image_load(const char *image, int len, struct bc_program *prog,
+                       int *gosub_depth);
+
+#endif /* __IMAGE_H__ */
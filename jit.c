@@ -0,0 +1,453 @@
+/*
+ * Copyright (c) 2023, Gary Sims
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Target independent half of the JIT, see jit.h. A loop is the code from
+ * its head to the end of the last instruction jumping back to it. It is
+ * compiled in chunks that start and end with an empty operand stack,
+ * which is every statement and the branch of an if: a chunk with an
+ * instruction the templates don't cover becomes an exit to the VM at its
+ * start. Jumps within the loop become native jumps, backward ones through
+ * a stub that spends the VM's budget, and anything leaving the loop is an
+ * exit with the pc the VM continues at.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+
+#if UBASIC_JIT
+
+#define DEBUG 0
+
+#if DEBUG
+#define DEBUG_PRINTF(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_PRINTF(...)
+#endif
+
+#define BC_OPERANDS(name, operands, pops, pushes) operands,
+static const unsigned char operands[] = {BC_OPCODES(BC_OPERANDS)};
+#undef BC_OPERANDS
+#define BC_EFFECT(name, operands, pops, pushes) pushes - pops,
+static const signed char effect[] = {BC_OPCODES(BC_EFFECT)};
+#undef BC_EFFECT
+
+typedef int (*jit_code)(VARIABLE_TYPE *variables, void *temps, int *budget);
+
+enum { EDGE_FORWARD, EDGE_BACK, EDGE_EXIT };
+
+struct edge {
+  int at; /* displacement to patch */
+  int target;
+  int kind;
+};
+
+struct region {
+  void *code;
+  int len;
+};
+
+static const struct bc_program *prog;
+static struct jit_vm vm;
+
+/* Per instruction word of the program */
+static int *counts;        /* times a loop head was reached, -1 if not one */
+static int *ends;          /* end of the loop whose head is here */
+static int *heads;         /* where a next loops back to, -1 if unknown */
+static jit_code *entries;  /* native code for a loop head */
+unsigned char *jit_heads;  /* loop heads still worth a jit_loop() call */
+
+static struct region *regions;
+static int regions_len, regions_cap;
+static int code_bytes;
+
+static struct edge *edges;
+static int edges_len, edges_cap;
+
+/*---------------------------------------------------------------------------*/
+void jit_put(struct jit_buf *b, const void *bytes, int len) {
+  unsigned char *p;
+  int cap;
+
+  if (b->len + len > b->cap) {
+    cap = b->cap ? b->cap * 2 : 256;
+    while (cap < b->len + len) {
+      cap *= 2;
+    }
+    p = realloc(b->code, cap);
+    if (p == NULL) {
+      b->failed = 1;
+      return;
+    }
+    b->code = p;
+    b->cap = cap;
+  }
+  memcpy(b->code + b->len, bytes, len);
+  b->len += len;
+}
+/*---------------------------------------------------------------------------*/
+void jit_free(void) {
+  int i;
+
+  for (i = 0; i < regions_len; i++) {
+    JIT_BACKEND.release(regions[i].code, regions[i].len);
+  }
+  free(regions);
+  free(counts);
+  free(ends);
+  free(heads);
+  free(entries);
+  free(jit_heads);
+  free(edges);
+  regions = NULL;
+  counts = ends = heads = NULL;
+  entries = NULL;
+  jit_heads = NULL;
+  edges = NULL;
+  regions_len = regions_cap = code_bytes = 0;
+  edges_len = edges_cap = 0;
+}
+/*---------------------------------------------------------------------------*/
+static void back_edge(int head, int pc) {
+  int end = pc + 1 + operands[prog->code[pc]];
+
+  if (head < 0) {
+    return;
+  }
+  counts[head] = 0;
+  jit_heads[head] = 1;
+  if (end > ends[head]) {
+    ends[head] = end;
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* Finds the loops: heads, where each ends, and the for each next is in */
+void jit_init(const struct bc_program *bc, const struct jit_vm *v) {
+  const int32_t *code = bc->code;
+  int after_for[2][MAX_VARNUM];
+  int pc, op, n = bc->code_len;
+
+  jit_free();
+  prog = bc;
+  vm = *v;
+  counts = malloc(n * sizeof(int));
+  ends = calloc(n, sizeof(int));
+  heads = malloc(n * sizeof(int));
+  entries = calloc(n, sizeof(jit_code));
+  jit_heads = calloc(n, 1);
+  if (counts == NULL || ends == NULL || heads == NULL || entries == NULL ||
+      jit_heads == NULL) {
+    jit_free();
+    return;
+  }
+  memset(counts, -1, n * sizeof(int));
+  memset(heads, -1, n * sizeof(int));
+  memset(after_for, -1, sizeof(after_for));
+
+  for (pc = 0; pc < n; pc += 1 + operands[op]) {
+    op = code[pc];
+    switch (op) {
+    case OP_FOR:
+    case OP_FORF:
+    case OP_FORI:
+      after_for[op == OP_FORF][code[pc + 1]] = pc + 1 + operands[op];
+      break;
+    case OP_NEXT:
+    case OP_NEXTF:
+      heads[pc] = after_for[op == OP_NEXTF][code[pc + 1]];
+      back_edge(heads[pc], pc);
+      break;
+    case OP_JMP:
+      if (code[pc + 1] <= pc) {
+        back_edge(code[pc + 1], pc);
+      }
+      break;
+    case OP_JLTVI:
+    case OP_JGTVI:
+    case OP_JEQVI:
+      if (code[pc + 3] <= pc) {
+        back_edge(code[pc + 3], pc);
+      }
+      break;
+    default:
+      break;
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void add_edge(struct jit_buf *b, int at, int target, int kind) {
+  struct edge *p;
+  int cap;
+
+  if (edges_len == edges_cap) {
+    cap = edges_cap ? edges_cap * 2 : 16;
+    p = realloc(edges, cap * sizeof(struct edge));
+    if (p == NULL) {
+      b->failed = 1;
+      return;
+    }
+    edges = p;
+    edges_cap = cap;
+  }
+  edges[edges_len].at = at;
+  edges[edges_len].target = target;
+  edges[edges_len].kind = kind;
+  edges_len++;
+}
+/*---------------------------------------------------------------------------*/
+static void add_jump(struct jit_buf *b, int at, int target, int pc) {
+  add_edge(b, at, target, target <= pc ? EDGE_BACK : EDGE_FORWARD);
+}
+/*---------------------------------------------------------------------------*/
+static int supported(int pc, int head, int end) {
+  switch (prog->code[pc]) {
+  case OP_PUSHI:
+  case OP_LOADI:
+  case OP_STOREI:
+  case OP_LOADT:
+  case OP_STORET:
+  case OP_ADDI:
+  case OP_SUBI:
+  case OP_MULI:
+  case OP_DIVI:
+  case OP_MODI:
+  case OP_ANDI:
+  case OP_ORI:
+  case OP_LTI:
+  case OP_GTI:
+  case OP_EQI:
+  case OP_JMP:
+  case OP_JZ:
+  case OP_ADDVI:
+  case OP_JLTVI:
+  case OP_JGTVI:
+  case OP_JEQVI:
+    return 1;
+  case OP_NEXT:
+    return heads[pc] >= head && heads[pc] < end;
+  default:
+    return 0;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void emit(struct jit_buf *b, int pc) {
+  const struct jit_backend *be = &JIT_BACKEND;
+  const int32_t *code = prog->code + pc;
+  int loop, to_vm;
+
+  switch (code[0]) {
+  case OP_PUSHI:
+    be->push_imm(b, code[1]);
+    break;
+  case OP_LOADI:
+    be->load_var(b, code[1]);
+    break;
+  case OP_STOREI:
+    be->store_var(b, code[1]);
+    break;
+  case OP_LOADT:
+    be->load_temp(b, code[1]);
+    break;
+  case OP_STORET:
+    be->store_temp(b, code[1]);
+    break;
+  case OP_ADDVI:
+    be->add_var_imm(b, code[1], code[2]);
+    break;
+  case OP_JMP:
+    add_jump(b, be->jump(b), code[1], pc);
+    break;
+  case OP_JZ:
+    add_jump(b, be->jump_if_zero(b), code[1], pc);
+    break;
+  case OP_JLTVI:
+  case OP_JGTVI:
+  case OP_JEQVI:
+    add_jump(b, be->jump_if_var(b, code[0], code[1], code[2]), code[3], pc);
+    break;
+  case OP_NEXT:
+    be->next(b, code[1], heads[pc], &loop, &to_vm);
+    add_edge(b, loop, heads[pc], EDGE_BACK);
+    add_edge(b, to_vm, pc, EDGE_EXIT);
+    break;
+  default:
+    be->binop(b, code[0]);
+    break;
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* Places the jumps: to a label, through a budget stub, or out to the VM */
+static void place_edges(struct jit_buf *b, int *labels, int head, int end) {
+  const struct jit_backend *be = &JIT_BACKEND;
+  struct edge *e;
+  int i, tick, label;
+
+  for (i = 0; i < edges_len; i++) {
+    e = &edges[i];
+    label = -1;
+    if (e->kind != EDGE_EXIT && e->target >= head && e->target < end) {
+      label = labels[e->target - head];
+    }
+    if (label >= 0 && e->kind == EDGE_FORWARD) {
+      be->patch(b, e->at, label);
+    } else if (label >= 0) {
+      be->patch(b, e->at, b->len);
+      tick = be->tick(b);
+      be->patch(b, be->jump(b), label);
+      be->patch(b, tick, b->len);
+      be->exit(b, e->target);
+    } else {
+      be->patch(b, e->at, b->len);
+      be->exit(b, e->target);
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static int compile(int head) {
+  const struct jit_backend *be = &JIT_BACKEND;
+  const int32_t *code = prog->code;
+  struct jit_buf b;
+  struct region *r;
+  int end = ends[head];
+  int *labels;
+  int pc, at, start, d, ok;
+  void *native;
+
+  memset(&b, 0, sizeof(b));
+  b.vm = &vm;
+  labels = malloc((end - head) * sizeof(int));
+  if (labels == NULL) {
+    return 0;
+  }
+  memset(labels, -1, (end - head) * sizeof(int));
+  edges_len = 0;
+
+  be->prologue(&b);
+  for (pc = head; pc < end && !b.failed;) {
+    start = pc;
+    d = 0;
+    ok = 1;
+    do {
+      ok = ok && supported(pc, head, end);
+      d += effect[code[pc]] - (code[pc] == OP_CONCAT ? code[pc + 1] : 0);
+      pc += 1 + operands[code[pc]];
+    } while (d != 0 && pc < end);
+    if (d != 0 || (start == head && !ok)) {
+      b.failed = 1;
+      break;
+    }
+    labels[start - head] = b.len;
+    b.cached = 0;
+    if (!ok) {
+      be->exit(&b, start);
+      continue;
+    }
+    for (at = start; at < pc; at += 1 + operands[code[at]]) {
+      emit(&b, at);
+    }
+  }
+  be->exit(&b, end);
+  place_edges(&b, labels, head, end);
+  free(labels);
+
+  native = NULL;
+  if (!b.failed && regions_len == regions_cap) {
+    regions_cap = regions_cap ? regions_cap * 2 : 8;
+    r = realloc(regions, regions_cap * sizeof(struct region));
+    if (r == NULL) {
+      b.failed = 1;
+    } else {
+      regions = r;
+    }
+  }
+  if (!b.failed) {
+    native = be->install(&b);
+  }
+  if (native != NULL) {
+    regions[regions_len].code = native;
+    regions[regions_len].len = b.len;
+    regions_len++;
+    code_bytes += b.len;
+    entries[head] = (jit_code)native;
+    DEBUG_PRINTF("jit: %s code for pc %d to %d, %d bytes\n", be->name, head,
+                 end, b.len);
+  }
+  free(b.code);
+  return native != NULL;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Called by the VM when it lands on pc by jumping backward. Returns the
+ * pc to continue at, pc itself if no native code ran.
+ *
+ * Once compiled, counts[] holds how many times in a row the native code
+ * left before jumping back even once, which is what happens when the
+ * loop body has a statement without a template on its main path. Such a
+ * loop runs faster in the VM alone, so it goes back to the VM for good.
+ */
+int jit_loop(int pc, int *budget) {
+  jit_code native;
+  int before = *budget;
+  int next;
+
+  native = entries[pc];
+  if (native == NULL) {
+    if (counts[pc] < 0 || ++counts[pc] < UBASIC_JIT_THRESHOLD) {
+      return pc;
+    }
+    counts[pc] = 0;
+    if (!compile(pc)) {
+      counts[pc] = -1;
+      jit_heads[pc] = 0;
+      return pc;
+    }
+    native = entries[pc];
+  }
+  next = native(vm.variables, vm.temps, budget);
+  if (*budget != before) {
+    counts[pc] = 0;
+  } else if (++counts[pc] >= UBASIC_JIT_THRESHOLD) {
+    DEBUG_PRINTF("jit: pc %d left to the VM\n", pc);
+    entries[pc] = NULL;
+    counts[pc] = -1;
+    jit_heads[pc] = 0;
+  }
+  return next;
+}
+/*---------------------------------------------------------------------------*/
+void jit_get_stats(int *regions_out, int *bytes_out) {
+  *regions_out = regions_len;
+  *bytes_out = code_bytes;
+}
+
+#endif /* UBASIC_JIT */
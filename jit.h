@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2023, Gary Sims
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include "bytecode.h"
+
+/*
+ * Template JIT for the hot loops of the bytecode VM. When a loop head,
+ * the target of a backward jump or of next, has been reached
+ * UBASIC_JIT_THRESHOLD times, jit.c translates the loop to machine code,
+ * instruction by instruction, with the templates of a backend. Statements
+ * it has no template for leave native code at their first instruction,
+ * where the operand stack is empty, and the VM carries on from there.
+ *
+ * Only backends for hosts exist so far, the device build leaves it out.
+ */
+#ifndef UBASIC_JIT
+#if defined(__x86_64__) && defined(__linux__)
+#define UBASIC_JIT 1
+#else
+#define UBASIC_JIT 0
+#endif
+#endif
+
+#ifndef UBASIC_JIT_THRESHOLD
+#define UBASIC_JIT_THRESHOLD 16
+#endif
+
+/* The VM state native code works on, provided by ubasic.c */
+struct jit_vm {
+  VARIABLE_TYPE *variables;
+  void *temps;
+  int temp_size;
+  /* next for a loop at head: 1 to loop, 0 when done, -1 for the VM to do */
+  int (*next)(int var, int head);
+};
+
+/* Machine code being generated */
+struct jit_buf {
+  unsigned char *code;
+  int len, cap;
+  int failed;
+  const struct jit_vm *vm;
+  int cached; /* the backend's own state, reset at every label */
+};
+
+/*
+ * One target. Each template appends the code for one instruction, the
+ * operand stack being whatever the backend likes between a label and
+ * the next. Branches return the position of their displacement, which
+ * patch() fills in once the target is known.
+ *
+ * Native code is called as
+ *   int code(VARIABLE_TYPE *variables, void *temps, int *budget)
+ * and returns the pc the VM continues at.
+ */
+struct jit_backend {
+  const char *name;
+  void (*prologue)(struct jit_buf *b);
+  void (*exit)(struct jit_buf *b, int pc);
+  void (*push_imm)(struct jit_buf *b, int32_t value);
+  void (*load_var)(struct jit_buf *b, int var);
+  void (*store_var)(struct jit_buf *b, int var);
+  void (*load_temp)(struct jit_buf *b, int temp);
+  void (*store_temp)(struct jit_buf *b, int temp);
+  void (*binop)(struct jit_buf *b, int op); /* OP_ADDI to OP_EQI */
+  void (*add_var_imm)(struct jit_buf *b, int var, int32_t value);
+  int (*jump)(struct jit_buf *b);
+  int (*jump_if_zero)(struct jit_buf *b); /* pops the condition */
+  int (*jump_if_var)(struct jit_buf *b, int op, int var, int32_t value);
+  int (*tick)(struct jit_buf *b); /* taken when the budget runs out */
+  void (*next)(struct jit_buf *b, int var, int head, int *loop, int *vm);
+  void (*patch)(struct jit_buf *b, int at, int target);
+  void *(*install)(const struct jit_buf *b);
+  void (*release)(void *code, int len);
+};
+
+#if UBASIC_JIT
+#if defined(__x86_64__)
+extern const struct jit_backend jit_x64;
+#define JIT_BACKEND jit_x64
+#else
+#error "No JIT backend for this target, build with UBASIC_JIT=0"
+#endif
+#endif
+
+/* For backends, appends machine code to the buffer */
+void jit_put(struct jit_buf *b, const void *bytes, int len);
+
+void jit_init(const struct bc_program *bc, const struct jit_vm *vm);
+void jit_free(void);
+
+/*
+ * Per instruction word, nonzero at loop heads that may still get or have
+ * native code. The VM checks it before calling jit_loop().
+ */
+extern unsigned char *jit_heads;
+int jit_loop(int pc, int *budget);
+void jit_get_stats(int *regions, int *bytes);
+
+#endif /* __JIT_H__ */
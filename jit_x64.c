@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2023, Gary Sims
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * x86-64 templates for the JIT (System V calling convention, Linux).
+ * While native code runs r12 holds the variables, r13 the temps and rbx
+ * the VM's jump budget. The operand stack is the machine stack, with its
+ * top kept in eax once something has been pushed (b->cached), so an
+ * expression like a + 1 costs no memory traffic beyond the variable.
+ */
+
+#include <string.h>
+
+#include "jit.h"
+
+#if UBASIC_JIT && defined(__x86_64__)
+
+#include <sys/mman.h>
+
+/*---------------------------------------------------------------------------*/
+static void put(struct jit_buf *b, int len, const unsigned char *bytes) {
+  jit_put(b, bytes, len);
+}
+/*---------------------------------------------------------------------------*/
+static void put32(struct jit_buf *b, int32_t value) {
+  jit_put(b, &value, 4);
+}
+/*---------------------------------------------------------------------------*/
+/* Pushes the cached top, before something else becomes the top */
+static void spill(struct jit_buf *b) {
+  if (b->cached) {
+    put(b, 1, (unsigned char[]){0x50}); /* push rax */
+  }
+  b->cached = 1;
+}
+/*---------------------------------------------------------------------------*/
+/* Makes eax the top and pops it */
+static void top(struct jit_buf *b) {
+  if (!b->cached) {
+    put(b, 1, (unsigned char[]){0x58}); /* pop rax */
+  }
+  b->cached = 0;
+}
+/*---------------------------------------------------------------------------*/
+static int32_t var_offset(int var) {
+  return var * (int32_t)sizeof(VARIABLE_TYPE);
+}
+/*---------------------------------------------------------------------------*/
+static void x64_prologue(struct jit_buf *b) {
+  static const unsigned char code[] = {
+      0x53,             /* push rbx */
+      0x41, 0x54,       /* push r12 */
+      0x41, 0x55,       /* push r13 */
+      0x49, 0x89, 0xfc, /* mov r12, rdi */
+      0x49, 0x89, 0xf5, /* mov r13, rsi */
+      0x48, 0x89, 0xd3, /* mov rbx, rdx */
+  };
+  put(b, sizeof(code), code);
+}
+/*---------------------------------------------------------------------------*/
+static void x64_exit(struct jit_buf *b, int pc) {
+  static const unsigned char code[] = {
+      0x41, 0x5d, /* pop r13 */
+      0x41, 0x5c, /* pop r12 */
+      0x5b,       /* pop rbx */
+      0xc3,       /* ret */
+  };
+  put(b, 1, (unsigned char[]){0xb8}); /* mov eax, pc */
+  put32(b, pc);
+  put(b, sizeof(code), code);
+}
+/*---------------------------------------------------------------------------*/
+static void x64_push_imm(struct jit_buf *b, int32_t value) {
+  spill(b);
+  put(b, 1, (unsigned char[]){0xb8}); /* mov eax, value */
+  put32(b, value);
+}
+/*---------------------------------------------------------------------------*/
+static void x64_load_var(struct jit_buf *b, int var) {
+  spill(b);
+  put(b, 4, (unsigned char[]){0x41, 0x8b, 0x84, 0x24}); /* mov eax, [r12+] */
+  put32(b, var_offset(var));
+}
+/*---------------------------------------------------------------------------*/
+static void x64_store_var(struct jit_buf *b, int var) {
+  top(b);
+  put(b, 4, (unsigned char[]){0x41, 0x89, 0x84, 0x24}); /* mov [r12+], eax */
+  put32(b, var_offset(var));
+}
+/*---------------------------------------------------------------------------*/
+/* Temps are copied whole, whatever their type */
+static void x64_load_temp(struct jit_buf *b, int temp) {
+  spill(b);
+  put(b, 3, (unsigned char[]){0x49, 0x8b, 0x85}); /* mov rax, [r13+] */
+  put32(b, temp * b->vm->temp_size);
+}
+/*---------------------------------------------------------------------------*/
+static void x64_store_temp(struct jit_buf *b, int temp) {
+  top(b);
+  put(b, 3, (unsigned char[]){0x49, 0x89, 0x85}); /* mov [r13+], rax */
+  put32(b, temp * b->vm->temp_size);
+}
+/*---------------------------------------------------------------------------*/
+static void x64_binop(struct jit_buf *b, int op) {
+  static const unsigned char set[] = {0x0f, 0xb6, 0xc0}; /* movzx eax, al */
+
+  if (b->cached) {
+    put(b, 3, (unsigned char[]){0x89, 0xc1, 0x58}); /* mov ecx, eax; pop rax */
+  } else {
+    put(b, 2, (unsigned char[]){0x59, 0x58}); /* pop rcx; pop rax */
+  }
+  b->cached = 1;
+  switch (op) {
+  case OP_ADDI:
+    put(b, 2, (unsigned char[]){0x01, 0xc8}); /* add eax, ecx */
+    break;
+  case OP_SUBI:
+    put(b, 2, (unsigned char[]){0x29, 0xc8}); /* sub eax, ecx */
+    break;
+  case OP_MULI:
+    put(b, 3, (unsigned char[]){0x0f, 0xaf, 0xc1}); /* imul eax, ecx */
+    break;
+  case OP_DIVI:
+    put(b, 3, (unsigned char[]){0x99, 0xf7, 0xf9}); /* cdq; idiv ecx */
+    break;
+  case OP_MODI:
+    put(b, 5, (unsigned char[]){0x99, 0xf7, 0xf9, 0x89, 0xd0}); /* eax = edx */
+    break;
+  case OP_ANDI:
+    put(b, 2, (unsigned char[]){0x21, 0xc8}); /* and eax, ecx */
+    break;
+  case OP_ORI:
+    put(b, 2, (unsigned char[]){0x09, 0xc8}); /* or eax, ecx */
+    break;
+  case OP_LTI:
+    put(b, 5, (unsigned char[]){0x39, 0xc8, 0x0f, 0x9c, 0xc0}); /* setl al */
+    put(b, sizeof(set), set);
+    break;
+  case OP_GTI:
+    put(b, 5, (unsigned char[]){0x39, 0xc8, 0x0f, 0x9f, 0xc0}); /* setg al */
+    put(b, sizeof(set), set);
+    break;
+  case OP_EQI:
+    put(b, 5, (unsigned char[]){0x39, 0xc8, 0x0f, 0x94, 0xc0}); /* sete al */
+    put(b, sizeof(set), set);
+    break;
+  default:
+    b->failed = 1;
+    break;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void x64_add_var_imm(struct jit_buf *b, int var, int32_t value) {
+  put(b, 4, (unsigned char[]){0x41, 0x81, 0x84, 0x24}); /* add [r12+], imm */
+  put32(b, var_offset(var));
+  put32(b, value);
+}
+/*---------------------------------------------------------------------------*/
+/* Emits a jump opcode with a zero rel32, returns where the rel32 is */
+static int branch(struct jit_buf *b, int len, const unsigned char *opcode) {
+  put(b, len, opcode);
+  put32(b, 0);
+  return b->len - 4;
+}
+/*---------------------------------------------------------------------------*/
+static int x64_jump(struct jit_buf *b) {
+  return branch(b, 1, (unsigned char[]){0xe9}); /* jmp */
+}
+/*---------------------------------------------------------------------------*/
+static int x64_jump_if_zero(struct jit_buf *b) {
+  top(b);
+  put(b, 2, (unsigned char[]){0x85, 0xc0});             /* test eax, eax */
+  return branch(b, 2, (unsigned char[]){0x0f, 0x84}); /* jz */
+}
+/*---------------------------------------------------------------------------*/
+static int x64_jump_if_var(struct jit_buf *b, int op, int var, int32_t value) {
+  put(b, 4, (unsigned char[]){0x41, 0x81, 0xbc, 0x24}); /* cmp [r12+], imm */
+  put32(b, var_offset(var));
+  put32(b, value);
+  switch (op) {
+  case OP_JLTVI:
+    return branch(b, 2, (unsigned char[]){0x0f, 0x8c}); /* jl */
+  case OP_JGTVI:
+    return branch(b, 2, (unsigned char[]){0x0f, 0x8f}); /* jg */
+  default:
+    return branch(b, 2, (unsigned char[]){0x0f, 0x84}); /* je */
+  }
+}
+/*---------------------------------------------------------------------------*/
+static int x64_tick(struct jit_buf *b) {
+  put(b, 2, (unsigned char[]){0xff, 0x0b});           /* dec dword [rbx] */
+  return branch(b, 2, (unsigned char[]){0x0f, 0x84}); /* jz */
+}
+/*---------------------------------------------------------------------------*/
+/* The stack is empty here, so rsp is as aligned as the prologue left it */
+static void x64_next(struct jit_buf *b, int var, int head, int *loop,
+                     int *vm) {
+  uint64_t helper = (uint64_t)(uintptr_t)b->vm->next;
+
+  put(b, 1, (unsigned char[]){0xbf}); /* mov edi, var */
+  put32(b, var);
+  put(b, 1, (unsigned char[]){0xbe}); /* mov esi, head */
+  put32(b, head);
+  put(b, 2, (unsigned char[]){0x48, 0xb8}); /* mov rax, helper */
+  jit_put(b, &helper, 8);
+  put(b, 4, (unsigned char[]){0xff, 0xd0, 0x85, 0xc0}); /* call; test */
+  *vm = branch(b, 2, (unsigned char[]){0x0f, 0x88});     /* js */
+  *loop = branch(b, 2, (unsigned char[]){0x0f, 0x8f});   /* jg */
+}
+/*---------------------------------------------------------------------------*/
+static void x64_patch(struct jit_buf *b, int at, int target) {
+  int32_t rel = target - (at + 4);
+
+  if (!b->failed) {
+    memcpy(b->code + at, &rel, 4);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* Copies the code to its own pages, never writable and executable at once */
+static void *x64_install(const struct jit_buf *b) {
+  void *code = mmap(NULL, b->len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (code == MAP_FAILED) {
+    return NULL;
+  }
+  memcpy(code, b->code, b->len);
+  if (mprotect(code, b->len, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, b->len);
+    return NULL;
+  }
+  return code;
+}
+/*---------------------------------------------------------------------------*/
+static void x64_release(void *code, int len) {
+  munmap(code, len);
+}
+/*---------------------------------------------------------------------------*/
+const struct jit_backend jit_x64 = {
+    .name = "x86-64",
+    .prologue = x64_prologue,
+    .exit = x64_exit,
+    .push_imm = x64_push_imm,
+    .load_var = x64_load_var,
+    .store_var = x64_store_var,
+    .load_temp = x64_load_temp,
+    .store_temp = x64_store_temp,
+    .binop = x64_binop,
+    .add_var_imm = x64_add_var_imm,
+    .jump = x64_jump,
+    .jump_if_zero = x64_jump_if_zero,
+    .jump_if_var = x64_jump_if_var,
+    .tick = x64_tick,
+    .next = x64_next,
+    .patch = x64_patch,
+    .install = x64_install,
+    .release = x64_release,
+};
+
+#endif /* UBASIC_JIT && __x86_64__ */
@@ -32,6 +32,21 @@ static_assert(PICCOLOBASIC_HW_FLASH_STORAGE_BASE +
                   PICO_FLASH_SIZE_BYTES,
               "PICCOLOBASIC_HW_FLASH_STORAGE_BYTES too big");
 
+// Flash for the program image run in place, see lfswrapper_file_map().
+// It is taken from the top of the space for the firmware, just below
+// LittleFS, so the filesystem stays where MicroPython expects it.
+#ifndef PICCOLOBASIC_XIP_IMAGE_BYTES
+#define PICCOLOBASIC_XIP_IMAGE_BYTES (64 * 1024)
+#endif
+static_assert(PICCOLOBASIC_XIP_IMAGE_BYTES % FLASH_SECTOR_SIZE == 0,
+              "XIP image size must be a multiple of the flash sector size");
+
+#define PICCOLOBASIC_XIP_IMAGE_BASE                                            \
+  (PICCOLOBASIC_HW_FLASH_STORAGE_BASE - PICCOLOBASIC_XIP_IMAGE_BYTES)
+
+// End of the firmware in flash, from the SDK's linker script
+extern char __flash_binary_end;
+
 // variables used by the filesystem
 lfs_t lfs;
 lfs_file_t current_lfs_file;
@@ -175,3 +190,45 @@ void lfswrapper_dump_dir(char *path) {
     printf("%s\n", info.name);
   lfswrapper_dir_close(dir);
 }
+
+// Copies a file to the flash kept for it, if it isn't there already, and
+// returns where it can be read in place through XIP. There is room for one
+// file, mapping another replaces it. NULL if the file doesn't fit.
+const char *lfswrapper_file_map(char *path, int *size) {
+  const char *xip = (const char *)(XIP_BASE + PICCOLOBASIC_XIP_IMAGE_BASE);
+  int off, n = 0;
+
+  *size = lfswrapper_get_file_size(path);
+  if (*size <= 0 || *size > PICCOLOBASIC_XIP_IMAGE_BYTES ||
+      &__flash_binary_end > xip) {
+    return NULL;
+  }
+  // A sector at a time, so the file is never all in RAM
+  uint8_t *sector = malloc(FLASH_SECTOR_SIZE);
+  if (sector == NULL) {
+    return NULL;
+  }
+  if (lfs_file_open(&lfs, &current_lfs_file, path, LFS_O_RDONLY) < 0) {
+    free(sector);
+    return NULL;
+  }
+  for (off = 0; off < *size; off += n) {
+    n = lfs_file_read(&lfs, &current_lfs_file, sector, FLASH_SECTOR_SIZE);
+    if (n <= 0) {
+      break;
+    }
+    // Unchanged since the last boot, leave the flash alone
+    if (memcmp(sector, xip + off, n) == 0) {
+      continue;
+    }
+    memset(sector + n, 0xff, FLASH_SECTOR_SIZE - n);
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_erase(PICCOLOBASIC_XIP_IMAGE_BASE + off, FLASH_SECTOR_SIZE);
+    flash_range_program(PICCOLOBASIC_XIP_IMAGE_BASE + off, sector,
+                        FLASH_SECTOR_SIZE);
+    restore_interrupts(ints);
+  }
+  lfs_file_close(&lfs, &current_lfs_file);
+  free(sector);
+  return off == *size ? xip : NULL;
+}
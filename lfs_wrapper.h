@@ -13,4 +13,5 @@ int lfswrapper_file_close();
 int lfswrapper_file_write(const void *buffer, int sz);
 int lfswrapper_file_read(void *buffer, int sz);
 int lfswrapper_get_file_size(char *path);
-int lfswrapper_delete_file(char *path);
\ No newline at end of file
+int lfswrapper_delete_file(char *path);
+const char *lfswrapper_file_map(char *path, int *size);
@@ -41,19 +41,38 @@
 #include "hardware/watchdog.h"
 #include "pico/stdlib.h"
 
+#include "image.h"
 #include "lfs_wrapper.h"
 #include "piccoloBASIC.h"
 #include "ubasic.h"
+#include "ubasic_native.h"
 
 #define MAX_CMD_LINE 100
 #define MAX_PATH_LEN 100
 
+// main.bas as compiled at the last boot, see load_cached_image()
+#define CACHE_FILE "main.cache"
+
+/*
+ * Run compiled images (main.pbc, CACHE_FILE) in place from flash rather
+ * than reading them into RAM, see lfswrapper_file_map()
+ */
+#ifndef PICCOLO_XIP
+#define PICCOLO_XIP 0
+#endif
+
+/* Set by the build when a program translated by tools/bas2c is linked in */
+#ifndef UBASIC_NATIVE
+#define UBASIC_NATIVE 0
+#endif
+
 /*
  * Eek! Globals!
  */
 char cwd[MAX_PATH_LEN];
 int lookahead = -1;
 int needsreboot = 0;
+const char *mapped_image; // in flash, see open_image()
 
 static char *getLine(int echo) {
   const uint startLineLength =
@@ -133,7 +152,9 @@ static char *getLine(int echo) {
 
 int doupload(char *uploadfilename, int uploadfilesize) {
   int count = 0;
-  char *program = malloc(PROG_BUFFER_SIZE);
+  // Compiled images can be bigger than a program
+  char *program = malloc(uploadfilesize > PROG_BUFFER_SIZE ? uploadfilesize
+                                                           : PROG_BUFFER_SIZE);
   if (program == NULL) {
     return -1;
   }
@@ -152,6 +173,114 @@ int doupload(char *uploadfilename, int uploadfilesize) {
   return count;
 }
 
+/* Reads a whole file into a malloc()ed buffer, NULL if empty or missing */
+static char *read_file(char *name, int *size) {
+  char *buf;
+
+  *size = lfswrapper_get_file_size(name);
+  if (*size <= 0) {
+    return NULL;
+  }
+  buf = malloc(*size);
+  if (buf == NULL) {
+    printf("Error: Not enough memory for %s\n", name);
+    return NULL;
+  }
+  lfswrapper_file_open(name, LFS_O_RDONLY);
+  int len = lfswrapper_file_read(buf, *size);
+  lfswrapper_file_close();
+  if (len != *size) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+/*
+ * A compiled program image to run. With PICCOLO_XIP it is copied to flash
+ * and run in place through XIP, taking no RAM, otherwise it is read into
+ * RAM. Give it back with close_image().
+ */
+static const char *open_image(char *name, int *size) {
+#if PICCOLO_XIP
+  const char *image = lfswrapper_file_map(name, size);
+
+  if (image != NULL) {
+    mapped_image = image;
+    return image;
+  }
+  // Doesn't fit the flash kept for it, run it from RAM
+#endif
+  return read_file(name, size);
+}
+
+static void close_image(const char *image) {
+  if (image != mapped_image) {
+    free((char *)image);
+  }
+}
+
+/*
+ * Reads a program compiled by tools/pbcc and starts it. Returns the image,
+ * which has to be kept while the program runs, or NULL to run main.bas.
+ */
+static const char *load_image(char *name) {
+  int size;
+  const char *image = open_image(name, &size);
+
+  if (image != NULL && ubasic_init_image(image, size) != 0) {
+    // Stale or damaged, main.bas still runs
+    printf("Error: Can't run %s, recompile it with pbcc\n", name);
+    close_image(image);
+    image = NULL;
+  }
+  return image;
+}
+
+/*
+ * Starts the image of program that an earlier boot left in CACHE_FILE, if
+ * there is one that is still valid. It is if it was compiled from this
+ * very text, same length and crc32, by this interpreter version. Any
+ * other cache is stale and gets overwritten by cache_image().
+ */
+static const char *load_cached_image(const char *program) {
+  struct image_header h;
+  const char *image;
+  int size;
+
+  // Only the header is needed to tell, don't read a stale cache
+  if (lfswrapper_file_open(CACHE_FILE, LFS_O_RDONLY) < 0) {
+    return NULL;
+  }
+  size = lfswrapper_file_read(&h, sizeof(h));
+  lfswrapper_file_close();
+  if (!image_matches((const char *)&h, size, program)) {
+    return NULL;
+  }
+  image = open_image(CACHE_FILE, &size);
+  if (image != NULL && ubasic_init_image(image, size) == 0) {
+    return image;
+  }
+  close_image(image);
+  return NULL;
+}
+
+/* Saves the program ubasic_init() just compiled for the next boot */
+static void cache_image(void) {
+  int len;
+  char *image = ubasic_build_image(&len);
+
+  if (image == NULL) {
+    // Runs on the text interpreter, nothing to cache
+    lfswrapper_delete_file(CACHE_FILE);
+    return;
+  }
+  lfswrapper_file_open(CACHE_FILE, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+  lfswrapper_file_write(image, len);
+  lfswrapper_file_close();
+  free(image);
+}
+
 int enter_CMD_mode() {
   char line[MAX_CMD_LINE];
   char *result = NULL;
@@ -196,6 +325,36 @@ int enter_CMD_mode() {
         printf("+OK\n");
         token = strtok(NULL, " "); // filename
         lfswrapper_delete_file(token);
+      } else if (strcmp(token, "stats") == 0) {
+        const struct ubasic_stats *st = ubasic_get_stats();
+        printf("+OK\n");
+        printf("gosub depth %d of %d\n", st->gosub_max_depth,
+               st->gosub_stack_depth);
+        if (st->tokens > 0) {
+          printf("token stream %d tokens, %d bytes\n", st->tokens,
+                 st->token_bytes);
+        }
+        if (st->not_compiled != NULL) {
+          printf("not compiled, line %d: %s\n", st->not_compiled_line,
+                 st->not_compiled);
+        }
+        if (st->pruned_bytes > 0) {
+          printf("dead code left out %d bytes\n", st->pruned_bytes);
+        }
+        printf("fused let %lu, if goto %lu, for %lu, pin %lu, delay %lu\n",
+               st->fused_let_add, st->fused_if_goto, st->fused_for,
+               st->fused_pin, st->fused_delay);
+        if (st->line_cache_hits + st->line_cache_misses > 0) {
+          printf("line cache hits %lu, misses %lu, evictions %lu\n",
+                 st->line_cache_hits, st->line_cache_misses,
+                 st->line_cache_evictions);
+        }
+        if (st->scratch_max > 0) {
+          printf("string scratch %d bytes, overflows %lu\n", st->scratch_max,
+                 st->scratch_overflows);
+        }
+        printf("strings made %lu, bytes copied %lu\n", st->string_allocs,
+               st->string_copied);
       } else if (strcmp(token, "cd") == 0) {
         printf("+OK\n");
         token = strtok(NULL, " ");
@@ -245,28 +404,48 @@ int main(int argc, char *argv[]) {
   lfswrapper_lfs_mount();
 
   if (!norun) {
-    // Allocate memory for the program
-    char *program = malloc(PROG_BUFFER_SIZE);
-    if (program == NULL) {
-      perror("Error allocating memory for program");
-      return 1;
-    }
+#if UBASIC_NATIVE
+    // Built in program translated by tools/bas2c, main.bas isn't read
+    ubasic_native_program();
+#else
+    char *program = NULL;
+    const char *image = load_image("main.pbc");
+
+    if (image == NULL) {
+      // Allocate memory for the program
+      program = malloc(PROG_BUFFER_SIZE);
+      if (program == NULL) {
+        perror("Error allocating memory for program");
+        return 1;
+      }
 
-    int mainsz = lfswrapper_get_file_size("main.bas");
+      int mainsz = lfswrapper_get_file_size("main.bas");
 
-    if (mainsz > 0) {
-      lfswrapper_file_open("main.bas", LFS_O_RDONLY);
-      proglen = lfswrapper_file_read(program, PROG_BUFFER_SIZE);
-      program[proglen] = 0;
-      lfswrapper_file_close();
+      program[0] = 0;
+      if (mainsz > 0) {
+        lfswrapper_file_open("main.bas", LFS_O_RDONLY);
+        proglen = lfswrapper_file_read(program, PROG_BUFFER_SIZE);
+        program[proglen] = 0;
+        lfswrapper_file_close();
+      }
+      image = load_cached_image(program);
+      if (image != NULL) {
+        // Only the image is needed to run it
+        free(program);
+        program = NULL;
+      } else {
+        ubasic_init(program);
+        cache_image();
+      }
     }
-    ubasic_init(program);
     do {
       ubasic_run();
     } while (!ubasic_finished());
 
     // Free the memory allocated for the program
     free(program);
+    close_image(image);
+#endif
   } else {
     // Eek! Hardcoded!
     gpio_init(14);
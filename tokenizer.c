@@ -54,6 +54,24 @@ struct keyword_token {
 
 static int current_token = TOKENIZER_ERROR;
 
+/*
+ * Token stream mode, see tokenizer_init_stream(). The program is lexed
+ * once into an array and tokenizer_next() just moves to the next entry.
+ * Numbers and variables are decoded at load, value holds the number,
+ * variable number, index into stream_floats or string/label length.
+ */
+struct token_record {
+  int offset; /* of the token in the program text */
+  int value;
+  unsigned char token;
+};
+static struct token_record *stream;
+static int stream_len;
+static int stream_current;
+static VARFLOAT_TYPE *stream_floats;
+static int stream_floats_len;
+static char const *stream_program;
+
 static const struct keyword_token keywords[] = {
     {"let", TOKENIZER_LET},       {"print", TOKENIZER_PRINT},
     {"if", TOKENIZER_IF},         {"then", TOKENIZER_THEN},
@@ -75,7 +93,7 @@ static const struct keyword_token keywords[] = {
     {"len", TOKENIZER_LEN},      {"os", TOKENIZER_OS},
     {"pininit", TOKENIZER_GPIOINIT},      {"pindirin", TOKENIZER_GPIODIRIN},
     {"pindirout", TOKENIZER_GPIODIROUT},  {"pinon", TOKENIZER_GPIOON},
-    {"pinoff", TOKENIZER_GPIOOFF},
+    {"pinoff", TOKENIZER_GPIOOFF},     {"step", TOKENIZER_STEP},
     {"//", TOKENIZER_REM},
     {NULL, TOKENIZER_ERROR}};
 
@@ -165,8 +183,10 @@ static int get_next_token(void) {
     nextptr = ptr;
     do {
       ++nextptr;
-    } while (*nextptr != '"');
-    ++nextptr;
+    } while (*nextptr != '"' && *nextptr != 0);
+    if (*nextptr == '"') {
+      ++nextptr;
+    }
     return TOKENIZER_STRING;
   } else {
     for (kt = keywords; kt->keyword != NULL; ++kt) {
@@ -210,20 +230,149 @@ static int get_next_token(void) {
   return TOKENIZER_ERROR;
 }
 /*---------------------------------------------------------------------------*/
+static void skip_rem(void) {
+  while (!(*nextptr == '\n' || tokenizer_finished())) {
+    ++nextptr;
+  }
+  if (*nextptr == '\n') {
+    ++nextptr;
+  }
+  tokenizer_next();
+}
+/*---------------------------------------------------------------------------*/
+static void stream_set(int i) {
+  stream_current = i;
+  ptr = stream_program + stream[i].offset;
+  current_token = stream[i].token;
+}
+/*---------------------------------------------------------------------------*/
+static void stream_free(void) {
+  free(stream);
+  free(stream_floats);
+  stream = NULL;
+  stream_floats = NULL;
+  stream_len = stream_floats_len = 0;
+}
+/*---------------------------------------------------------------------------*/
+/* Value kept for the token at ptr, or -1 if it doesn't fit the stream */
+static int stream_value(int token, VARFLOAT_TYPE *floats, int *floats_len) {
+  char const *end;
+
+  switch (token) {
+  case TOKENIZER_NUMBER:
+    return atoi(ptr);
+  case TOKENIZER_NUMFLOAT:
+    floats[*floats_len] = atof(ptr);
+    return (*floats_len)++;
+  case TOKENIZER_VARIABLE:
+  case TOKENIZER_VARFLOAT:
+  case TOKENIZER_VARSTRING:
+    return *ptr - 'a';
+  case TOKENIZER_STRING:
+    end = strchr(ptr + 1, '"');
+    return end == NULL ? -1 : end - ptr - 1;
+  case TOKENIZER_LABEL:
+    end = strchr(ptr + 1, ':');
+    return end == NULL ? -1 : end - ptr;
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
 void tokenizer_goto(const char *program) {
+  int lo, hi, mid, offset;
+
+  if (stream != NULL) {
+    /* First token at or after program, the stream holds no rem tokens */
+    offset = program - stream_program;
+    lo = 0;
+    hi = stream_len - 1;
+    while (lo < hi) {
+      mid = (lo + hi) / 2;
+      if (stream[mid].offset < offset) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    stream_set(lo);
+    return;
+  }
   ptr = program;
   current_token = get_next_token();
+  if (current_token == TOKENIZER_REM) {
+    skip_rem();
+  }
 }
 /*---------------------------------------------------------------------------*/
 void tokenizer_init(const char *program) {
+  stream_free();
   tokenizer_goto(program);
-  current_token = get_next_token();
 }
 /*---------------------------------------------------------------------------*/
+/*
+ * Lex the whole program into the token stream and start at its first
+ * token. Returns the bytes used, or -1 (and stays in text mode) if there
+ * is not enough memory.
+ */
+int tokenizer_init_stream(const char *program) {
+  struct token_record *records;
+  VARFLOAT_TYPE *floats;
+  int tokens = 1, floats_len = 0, n = 0;
+
+  tokenizer_init(program);
+  while (current_token != TOKENIZER_ENDOFINPUT) {
+    tokens++;
+    if (current_token == TOKENIZER_NUMFLOAT) {
+      floats_len++;
+    }
+    tokenizer_next();
+  }
+  records = malloc(tokens * sizeof(struct token_record));
+  floats = malloc((floats_len + 1) * sizeof(VARFLOAT_TYPE));
+  if (records == NULL || floats == NULL) {
+    free(records);
+    free(floats);
+    tokenizer_goto(program);
+    return -1;
+  }
+
+  floats_len = 0;
+  tokenizer_goto(program);
+  while (1) {
+    records[n].offset = ptr - program;
+    records[n].token = current_token;
+    records[n].value = stream_value(current_token, floats, &floats_len);
+    n++;
+    if (current_token == TOKENIZER_ENDOFINPUT) {
+      break;
+    }
+    tokenizer_next();
+  }
+  stream = records;
+  stream_len = n;
+  stream_floats = floats;
+  stream_floats_len = floats_len;
+  stream_program = program;
+  stream_set(0);
+  DEBUG_PRINTF("tokenizer_init_stream: %d tokens, %d floats\n", stream_len,
+               stream_floats_len);
+  return stream_len * sizeof(struct token_record) +
+         stream_floats_len * sizeof(VARFLOAT_TYPE);
+}
+/*---------------------------------------------------------------------------*/
+int tokenizer_stream_tokens(void) { return stream_len; }
+/*---------------------------------------------------------------------------*/
 int tokenizer_token(void) { return current_token; }
 /*---------------------------------------------------------------------------*/
 void tokenizer_next(void) {
 
+  if (stream != NULL) {
+    if (current_token != TOKENIZER_ENDOFINPUT) {
+      stream_set(stream_current + 1);
+    }
+    return;
+  }
+
   if (tokenizer_finished()) {
     return;
   }
@@ -237,13 +386,7 @@ void tokenizer_next(void) {
   current_token = get_next_token();
 
   if (current_token == TOKENIZER_REM) {
-    while (!(*nextptr == '\n' || tokenizer_finished())) {
-      ++nextptr;
-    }
-    if (*nextptr == '\n') {
-      ++nextptr;
-    }
-    tokenizer_next();
+    skip_rem();
   }
 
   DEBUG_PRINTF("tokenizer_next: '%s' %d\n", ptr, current_token);
@@ -251,37 +394,42 @@ void tokenizer_next(void) {
 }
 /*---------------------------------------------------------------------------*/
 VARIABLE_TYPE tokenizer_num(void) {
+  if (stream != NULL) {
+    return stream[stream_current].value;
+  }
   return atoi(ptr);
 }
 /*---------------------------------------------------------------------------*/
   VARFLOAT_TYPE tokenizer_numfloat(void) {
+    if (stream != NULL) {
+      return stream_floats[stream[stream_current].value];
+    }
     return atof(ptr);
   }
 /*---------------------------------------------------------------------------*/
-void tokenizer_string(char *dest, int len) {
+/*
+ * The text of the string literal at the tokenizer, len characters where
+ * it sits in the program (not 0 terminated), so it is never copied just
+ * to be read.
+ */
+const char *tokenizer_string(int *len) {
   char *string_end;
-  int string_len;
 
   if (tokenizer_token() != TOKENIZER_STRING) {
     printf("Internal error, expecting string\n");
     exit(-1);
   }
-  string_end = strchr(ptr + 1, '"');
-  if (string_end == NULL) {
-    printf("Error: Missing quote\n");
-    exit(-1);
-  }
-  string_len = string_end - ptr - 1;
-  if (len < string_len) {
-    string_len = len;
+  if (stream != NULL) {
+    *len = stream[stream_current].value;
+  } else {
+    string_end = strchr(ptr + 1, '"');
+    *len = string_end == NULL ? -1 : string_end - ptr - 1;
   }
-
-  if (string_len >= len) {
-    printf("Error: String too long\n");
+  if (*len < 0) {
+    printf("Error: Missing quote\n");
     exit(-1);
   }
-  memcpy(dest, ptr + 1, string_len);
-  dest[string_len] = 0;
+  return ptr + 1;
 }
 /*---------------------------------------------------------------------------*/
 void tokenizer_label(char *dest, int len) {
@@ -289,15 +437,16 @@ void tokenizer_label(char *dest, int len) {
   int string_len;
 
   DEBUG_PRINTF("tokenizer_label ptr is: '%s'\n", ptr);
-  string_end = strchr(ptr + 1, ':');
-  if (string_end == NULL) {
+  if (stream != NULL) {
+    string_len = stream[stream_current].value;
+  } else {
+    string_end = strchr(ptr + 1, ':');
+    string_len = string_end == NULL ? -1 : string_end - ptr;
+  }
+  if (string_len < 0) {
     printf("Internal error, no : found in label\n");
     exit(-1);
   }
-
-  DEBUG_PRINTF("tokenizer_label string_end is: '%s'\n", string_end);
-
-  string_len = string_end - ptr;
   DEBUG_PRINTF("tokenizer_label string_len is: '%d'\n", string_len);
   if (len < string_len) {
     string_len = len;
@@ -318,6 +467,44 @@ int tokenizer_finished(void) {
   return *ptr == 0 || current_token == TOKENIZER_ENDOFINPUT;
 }
 /*---------------------------------------------------------------------------*/
-int tokenizer_variable_num(void) { return *ptr - 'a'; }
+int tokenizer_variable_num(void) {
+  if (stream != NULL) {
+    return stream[stream_current].value;
+  }
+  return *ptr - 'a';
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Value of "rem pragma <name> <value>" (or "// pragma ...") on a line of
+ * its own, def if the program has no such line.
+ */
+int tokenizer_pragma(const char *program, const char *name, int def) {
+  const char *p;
+  int len = strlen(name);
+
+  for (p = program; p != NULL && *p != 0; p = strchr(p, '\n')) {
+    if (*p == '\n') {
+      p++;
+    }
+    p += strspn(p, " \t");
+    if (strncmp(p, "rem", 3) == 0) {
+      p += 3;
+    } else if (strncmp(p, "//", 2) == 0) {
+      p += 2;
+    } else {
+      continue;
+    }
+    p += strspn(p, " \t");
+    if (strncmp(p, "pragma", 6) != 0) {
+      continue;
+    }
+    p += 6;
+    p += strspn(p, " \t");
+    if (strncmp(p, name, len) == 0 && (p[len] == ' ' || p[len] == '\t')) {
+      return atoi(p + len);
+    }
+  }
+  return def;
+}
 /*---------------------------------------------------------------------------*/
 char const *tokenizer_pos(void) { return ptr; }
@@ -52,6 +52,7 @@ enum {
   TOKENIZER_ELSE,
   TOKENIZER_FOR,
   TOKENIZER_TO,
+  TOKENIZER_STEP,
   TOKENIZER_NEXT,
   TOKENIZER_GOTO,
   TOKENIZER_GOSUB,
@@ -110,12 +111,14 @@ enum {
 
 void tokenizer_goto(const char *program);
 void tokenizer_init(const char *program);
+int tokenizer_init_stream(const char *program);
+int tokenizer_stream_tokens(void);
 void tokenizer_next(void);
 int tokenizer_token(void);
 VARIABLE_TYPE tokenizer_num(void);
 VARFLOAT_TYPE tokenizer_numfloat(void);
 int tokenizer_variable_num(void);
-void tokenizer_string(char *dest, int len);
+const char *tokenizer_string(int *len);
 void tokenizer_label(char *dest, int len);
 
 int tokenizer_finished(void);
@@ -123,4 +126,6 @@ void tokenizer_error_print(int line, char *msg);
 
 char const *tokenizer_pos(void);
 
+int tokenizer_pragma(const char *program, const char *name, int def);
+
 #endif /* __TOKENIZER_H__ */
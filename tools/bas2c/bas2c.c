@@ -0,0 +1,758 @@
+/*
+ * Copyright (c) 2023, Gary Sims
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Ahead of time translator from BASIC to C, run on the host:
+ *
+ *   bas2c main.bas main_bas.c
+ *
+ * The program goes through the same load time compiler as on the device
+ * (compiler.c, with constant folding and loop hoisting) and each bytecode
+ * instruction is then written out as the C the VM would have executed
+ * for it. Jumps become gotos, the operand stack becomes locals named by
+ * slot and type (the depth and type of every slot is known here), and
+ * everything else calls the runtime in ubasic.c through ubasic_native.h,
+ * so numbers print, builtins behave and errors are reported exactly as
+ * in the VM.
+ *
+ * The output defines ubasic_native_program(). Build the firmware with
+ * -DPICCOLO_NATIVE_PROGRAM=main_bas.c and it runs instead of main.bas.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "tokenizer.h"
+#include "ubasic.h"
+
+enum { T_INT, T_FLOAT, T_STRING };
+
+#define BC_OPERANDS(name, operands, pops, pushes) operands,
+static const unsigned char operands[] = {BC_OPCODES(BC_OPERANDS)};
+#undef BC_OPERANDS
+#define BC_EFFECT(name, operands, pops, pushes) pushes - pops,
+static const signed char effect[] = {BC_OPCODES(BC_EFFECT)};
+#undef BC_EFFECT
+
+static const struct {
+  int token;
+  const char *name;
+} builtins[] = {
+    {TOKENIZER_ZERO, "TOKENIZER_ZERO"}, {TOKENIZER_NOT, "TOKENIZER_NOT"},
+    {TOKENIZER_RANDINT, "TOKENIZER_RANDINT"},
+    {TOKENIZER_TIME, "TOKENIZER_TIME"}, {TOKENIZER_RND, "TOKENIZER_RND"},
+    {TOKENIZER_ABS, "TOKENIZER_ABS"},   {TOKENIZER_ATN, "TOKENIZER_ATN"},
+    {TOKENIZER_COS, "TOKENIZER_COS"},   {TOKENIZER_EXP, "TOKENIZER_EXP"},
+    {TOKENIZER_LOG, "TOKENIZER_LOG"},   {TOKENIZER_SIN, "TOKENIZER_SIN"},
+    {TOKENIZER_SQR, "TOKENIZER_SQR"},   {TOKENIZER_TAN, "TOKENIZER_TAN"},
+};
+
+static struct bc_program bc;
+static FILE *out;
+
+/* Per instruction word, filled in by analyse() */
+static int *depth;         /* operand stack depth before the instruction */
+static unsigned char *label;  /* jumped to */
+static unsigned char *resume; /* returned to by return or next */
+
+static unsigned char slot_type[BC_STACK_DEPTH];
+static unsigned char temp_type[BC_TEMPS];
+static int has_resume;
+static int gosub_depth;
+
+/* What the translated code uses, so only that gets declared */
+static unsigned char slot_used[3][BC_STACK_DEPTH];
+static unsigned char temp_used[3][BC_TEMPS];
+static int uses_v, uses_f, uses_strings, uses_buff, uses_for, uses_gosub,
+    uses_poll;
+
+/*---------------------------------------------------------------------------*/
+static void fatal(const char *msg, const char *arg) {
+  fprintf(stderr, "bas2c: %s%s\n", msg, arg);
+  exit(1);
+}
+/*---------------------------------------------------------------------------*/
+static char *read_file(const char *name) {
+  FILE *f = fopen(name, "rb");
+  char *text;
+  long len;
+
+  if (f == NULL) {
+    fatal("can't open ", name);
+  }
+  fseek(f, 0, SEEK_END);
+  len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  text = malloc(len + 1);
+  if (text == NULL || fread(text, 1, len, f) != (size_t)len) {
+    fatal("can't read ", name);
+  }
+  text[len] = 0;
+  fclose(f);
+  return text;
+}
+/*---------------------------------------------------------------------------*/
+/* Source line of the instruction at pc, as vm_line() in ubasic.c */
+static int line_of(int pc) {
+  int lo = 0, hi = bc.lines_len - 1, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (bc.lines[mid].pc <= pc) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return bc.lines_len > 0 ? bc.lines[lo].line : 0;
+}
+/*---------------------------------------------------------------------------*/
+static const char *builtin_name(int token) {
+  unsigned int i;
+
+  for (i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+    if (builtins[i].token == token) {
+      return builtins[i].name;
+    }
+  }
+  fatal("unknown builtin in bytecode", "");
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Expressions never span a jump, so walking the code in order gives the
+ * stack depth at every instruction. Also marks the jump targets and the
+ * places return and next come back to.
+ */
+static void analyse(void) {
+  int pc, op, d = 0;
+
+  depth = calloc(bc.code_len + 1, sizeof(int));
+  label = calloc(bc.code_len + 1, 1);
+  resume = calloc(bc.code_len + 1, 1);
+  if (depth == NULL || label == NULL || resume == NULL) {
+    fatal("out of memory", "");
+  }
+  for (pc = 0; pc < bc.code_len; pc += 1 + operands[op]) {
+    op = bc.code[pc];
+    if (op < 0 || op >= OP__COUNT) {
+      fatal("bad opcode in bytecode", "");
+    }
+    depth[pc] = d;
+    d += effect[op] - (op == OP_CONCAT ? bc.code[pc + 1] : 0);
+    if (d < 0 || d > BC_STACK_DEPTH) {
+      fatal("operand stack out of range", "");
+    }
+    switch (op) {
+    case OP_JMP: case OP_JZ:
+      label[bc.code[pc + 1]] = 1;
+      break;
+    case OP_GOSUB:
+    uses_gosub = uses_poll = 1;
+      label[bc.code[pc + 1]] = 1;
+      resume[pc + 2] = 1;
+      has_resume = 1;
+      break;
+    case OP_JLTVI: case OP_JGTVI: case OP_JEQVI:
+      label[bc.code[pc + 3]] = 1;
+      break;
+    case OP_FOR: case OP_FORF: case OP_FORI:
+      resume[pc + 1 + operands[op]] = 1;
+      has_resume = 1;
+      break;
+    default:
+      break;
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static const char *slot_name(const char *prefix, int d, int type) {
+  static char names[8][8];
+  static int next;
+  char *name = names[next++ & 7];
+
+  sprintf(name, "%s%c%d", prefix,
+          type == T_INT ? 'i' : type == T_FLOAT ? 'f' : 's', d);
+  return name;
+}
+/*---------------------------------------------------------------------------*/
+static const char *slot(int d, int type) {
+  slot_used[type][d] = 1;
+  return slot_name("", d, type);
+}
+/*---------------------------------------------------------------------------*/
+static const char *temp(int t, int type) {
+  temp_used[type][t] = 1;
+  return slot_name("t", t, type);
+}
+/*---------------------------------------------------------------------------*/
+static void emit_float(VARFLOAT_TYPE f) {
+  if (isnan(f)) {
+    fprintf(out, "NAN");
+  } else if (isinf(f)) {
+    fprintf(out, f > 0 ? "HUGE_VAL" : "-HUGE_VAL");
+  } else {
+    fprintf(out, "%.17g", f);
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void emit_int(int32_t i) {
+  if (i == INT32_MIN) {
+    fprintf(out, "(-2147483647 - 1)");
+  } else {
+    fprintf(out, "%d", (int)i);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * The pool as the compiler laid it out, each string after its struct
+ * bc_string header, so the runtime takes them as counted strings. The
+ * headers are in the host's byte order, little endian like the Pico's.
+ */
+static void emit_strings(void) {
+  int i, col = 0;
+  unsigned char c;
+
+  fprintf(out, "static const union {\n  char text[%d];\n", bc.strings_len + 1);
+  fprintf(out, "  int32_t align; /* of the headers */\n} strings = {\n    \"");
+  for (i = 0; i < bc.strings_len; i++) {
+    c = bc.strings[i];
+    if (col > 64) {
+      fprintf(out, "\"\n    \"");
+      col = 0;
+    }
+    if (c == '"' || c == '\\') {
+      col += fprintf(out, "\\%c", c);
+    } else if (c < ' ' || c > '~' || c == '?') {
+      col += fprintf(out, "\\%03o", c);
+    } else {
+      col += fprintf(out, "%c", c);
+    }
+  }
+  fprintf(out, "\"};\n\n");
+}
+/*---------------------------------------------------------------------------*/
+/* A jump taken, backward ones let CMD mode in like the VM's budget */
+static void emit_goto(int pc, int target) {
+  if (target <= pc) {
+    uses_poll = 1;
+    fprintf(out, "  POLL();\n");
+  }
+  fprintf(out, "  goto L%d;\n", target);
+}
+/*---------------------------------------------------------------------------*/
+/* Where a next most likely loops back to: its own for, found statically */
+static int for_resume(int pc, int var, int is_float) {
+  int at, op, found = -1;
+
+  for (at = 0; at < pc; at += 1 + operands[op]) {
+    op = bc.code[at];
+    if (((op == OP_FOR || op == OP_FORI) && !is_float) ||
+        (op == OP_FORF && is_float)) {
+      if (bc.code[at + 1] == var) {
+        found = at + 1 + operands[op];
+      }
+    }
+  }
+  return found;
+}
+/*---------------------------------------------------------------------------*/
+static void emit_next(int pc, int var, int is_float) {
+  const char *v = is_float ? "f" : "v";
+  int *uses = is_float ? &uses_f : &uses_v;
+  const char *to = is_float ? "tof" : "to";
+  const char *step = is_float ? "stepf" : "step";
+  int guess = for_resume(pc, var, is_float);
+
+  uses_for = uses_poll = *uses = 1;
+  fprintf(out, "  if (fp <= 0 || fors[fp - 1].var != %d ||\n", var);
+  fprintf(out, "      %sfors[fp - 1].is_float) {\n", is_float ? "!" : "");
+  fprintf(out, "    ubasic_native_error(%d,\n", line_of(pc));
+  fprintf(out, "        \"Unexpected next, no matching for\", \"\");\n");
+  fprintf(out, "  }\n");
+  fprintf(out, "  fs = &fors[fp - 1];\n");
+  fprintf(out, "  %s[%d] += fs->%s;\n", v, var, step);
+  fprintf(out, "  if (fs->%s >= 0 ? %s[%d] <= fs->%s : %s[%d] >= fs->%s) {\n",
+          step, v, var, to, v, var, to);
+  fprintf(out, "    POLL();\n");
+  if (guess >= 0) {
+    fprintf(out, "    if (fs->resume == %d) {\n      goto L%d;\n    }\n", guess,
+            guess);
+  }
+  fprintf(out, "    resume = fs->resume;\n    goto resume_at;\n  }\n");
+  fprintf(out, "  fp--;\n");
+}
+/*---------------------------------------------------------------------------*/
+static void emit_for(int pc, int var, int is_float, const char *limit,
+                     const char *step) {
+  uses_for = 1;
+  fprintf(out, "  if (fp >= %d) {\n", MAX_FOR_STACK_DEPTH);
+  fprintf(out, "    ubasic_native_error(%d, \"for stack depth exceeded\",",
+          line_of(pc));
+  fprintf(out, " \"%d\");\n", MAX_FOR_STACK_DEPTH);
+  fprintf(out, "  }\n");
+  fprintf(out, "  fs = &fors[fp++];\n");
+  fprintf(out, "  fs->var = %d;\n  fs->is_float = %d;\n", var, is_float);
+  fprintf(out, "  fs->%s = %s;\n  fs->%s = %s;\n", is_float ? "tof" : "to",
+          limit, is_float ? "stepf" : "step", step);
+  fprintf(out, "  fs->resume = %d;\n", pc + 1 + operands[bc.code[pc]]);
+}
+/*---------------------------------------------------------------------------*/
+static void emit_binop(int d, const char *op, int in, int result) {
+  fprintf(out, "  %s = ", slot(d - 2, result));
+  fprintf(out, "%s %s ", slot(d - 2, in), op);
+  fprintf(out, "%s;\n", slot(d - 1, in));
+  slot_type[d - 2] = result;
+}
+/*---------------------------------------------------------------------------*/
+static void emit_instruction(int pc) {
+  const int32_t *code = bc.code + pc;
+  int d = depth[pc];
+  const char *top = d > 0 ? slot(d - 1, slot_type[d - 1]) : "";
+  char limit[16], step[16];
+  int i;
+
+  switch (code[0]) {
+  case OP_END:
+    fprintf(out, "  return;\n");
+    break;
+  case OP_PUSHI:
+    fprintf(out, "  %s = ", slot(d, T_INT));
+    emit_int(code[1]);
+    fprintf(out, ";\n");
+    slot_type[d] = T_INT;
+    break;
+  case OP_PUSHF:
+    fprintf(out, "  %s = ", slot(d, T_FLOAT));
+    emit_float(bc.floats[code[1]]);
+    fprintf(out, ";\n");
+    slot_type[d] = T_FLOAT;
+    break;
+  case OP_PUSHS:
+    uses_strings = 1;
+    /* Never counted, as in the VM */
+    fprintf(out, "  %s = (VARSTRING_TYPE)strings.text + %d;\n",
+            slot(d, T_STRING), code[1]);
+    slot_type[d] = T_STRING;
+    break;
+  case OP_LOADI:
+    uses_v = 1;
+    fprintf(out, "  %s = v[%d];\n", slot(d, T_INT), code[1]);
+    slot_type[d] = T_INT;
+    break;
+  case OP_LOADF:
+    uses_f = 1;
+    fprintf(out, "  %s = f[%d];\n", slot(d, T_FLOAT), code[1]);
+    slot_type[d] = T_FLOAT;
+    break;
+  case OP_LOADS:
+    fprintf(out, "  %s = ubasic_native_load_string(%d);\n", slot(d, T_STRING),
+            code[1]);
+    slot_type[d] = T_STRING;
+    break;
+  case OP_LOADT:
+    slot_type[d] = temp_type[code[1]];
+    fprintf(out, "  %s = ", slot(d, slot_type[d]));
+    fprintf(out, "%s;\n", temp(code[1], slot_type[d]));
+    break;
+  case OP_STORET:
+    temp_type[code[1]] = slot_type[d - 1];
+    fprintf(out, "  %s = %s;\n", temp(code[1], slot_type[d - 1]), top);
+    break;
+  case OP_STOREI:
+    uses_v = 1;
+    fprintf(out, "  v[%d] = %s;\n", code[1], top);
+    break;
+  case OP_STOREF:
+    uses_f = 1;
+    fprintf(out, "  f[%d] = %s;\n", code[1], top);
+    break;
+  case OP_STORES:
+    fprintf(out, "  ubasic_native_store_string(%d, %s);\n", code[1], top);
+    break;
+  case OP_ADDI: emit_binop(d, "+", T_INT, T_INT); break;
+  case OP_SUBI: emit_binop(d, "-", T_INT, T_INT); break;
+  case OP_MULI: emit_binop(d, "*", T_INT, T_INT); break;
+  case OP_DIVI: emit_binop(d, "/", T_INT, T_INT); break;
+  case OP_MODI: emit_binop(d, "%", T_INT, T_INT); break;
+  case OP_ANDI: emit_binop(d, "&", T_INT, T_INT); break;
+  case OP_ORI: emit_binop(d, "|", T_INT, T_INT); break;
+  case OP_LTI: emit_binop(d, "<", T_INT, T_INT); break;
+  case OP_GTI: emit_binop(d, ">", T_INT, T_INT); break;
+  case OP_EQI: emit_binop(d, "==", T_INT, T_INT); break;
+  case OP_ADDF: emit_binop(d, "+", T_FLOAT, T_FLOAT); break;
+  case OP_SUBF: emit_binop(d, "-", T_FLOAT, T_FLOAT); break;
+  case OP_MULF: emit_binop(d, "*", T_FLOAT, T_FLOAT); break;
+  case OP_DIVF: emit_binop(d, "/", T_FLOAT, T_FLOAT); break;
+  case OP_LTF: emit_binop(d, "<", T_FLOAT, T_INT); break;
+  case OP_GTF: emit_binop(d, ">", T_FLOAT, T_INT); break;
+  case OP_EQF: emit_binop(d, "==", T_FLOAT, T_INT); break;
+  case OP_ITOF:
+    fprintf(out, "  %s = %s;\n", slot(d - 1, T_FLOAT), top);
+    slot_type[d - 1] = T_FLOAT;
+    break;
+  case OP_FTOI:
+    fprintf(out, "  %s = (VARIABLE_TYPE)%s;\n", slot(d - 1, T_INT), top);
+    slot_type[d - 1] = T_INT;
+    break;
+  case OP_ITOS:
+    uses_buff = 1;
+    fprintf(out, "  %s = ubasic_native_string(buff, ", slot(d - 1, T_STRING));
+    fprintf(out, "sprintf(buff, \"%%d\", %s));\n", top);
+    slot_type[d - 1] = T_STRING;
+    break;
+  case OP_FTOS:
+    fprintf(out, "  %s = ubasic_native_sprintfloat(%s);\n",
+            slot(d - 1, T_STRING), top);
+    slot_type[d - 1] = T_STRING;
+    break;
+  case OP_FTOSF:
+    uses_buff = 1;
+    fprintf(out, "  %s = ubasic_native_string(buff, ", slot(d - 1, T_STRING));
+    fprintf(out, "sprintf(buff, \"%%f\", %s));\n", top);
+    slot_type[d - 1] = T_STRING;
+    break;
+  case OP_CONCAT:
+    /* One call for all of them, so the result is sized and copied once */
+    fprintf(out, "  %s = ubasic_native_concat_n(%d", slot(d - code[1], T_STRING),
+            code[1]);
+    for (i = 0; i < code[1]; i++) {
+      fprintf(out, ",%s%s", i % 6 == 5 ? "\n      " : " ",
+              slot(d - code[1] + i, T_STRING));
+    }
+    fprintf(out, ");\n");
+    break;
+  case OP_LEN:
+    fprintf(out, "  %s = BC_STRING(%s)->len;\n", slot(d - 1, T_INT), top);
+    fprintf(out, "  ubasic_native_release(%s);\n", top);
+    slot_type[d - 1] = T_INT;
+    break;
+  case OP_BUILTIN:
+    fprintf(out, "  %s = ubasic_native_builtin(%s, %s);\n", top,
+            builtin_name(code[1]), top);
+    break;
+  case OP_BUILTINF:
+    fprintf(out, "  %s = ubasic_native_builtinf(%s, %s);\n", top,
+            builtin_name(code[1]), top);
+    break;
+  case OP_PRINTI:
+    fprintf(out, "  printf(\"%%d\", %s);\n", top);
+    break;
+  case OP_PRINTF:
+    fprintf(out, "  ubasic_native_printfloat(%s);\n", top);
+    break;
+  case OP_PRINTS:
+    fprintf(out, "  fwrite(%s, 1, BC_STRING(%s)->len, stdout);\n", top, top);
+    fprintf(out, "  ubasic_native_release(%s);\n", top);
+    break;
+  case OP_PRINTLIT:
+    uses_strings = 1;
+    fprintf(out, "  printf(\"%%s\", strings.text + %d);\n", code[1]);
+    break;
+  case OP_PRINTSP:
+    fprintf(out, "  printf(\" \");\n");
+    break;
+  case OP_PRINTNL:
+    fprintf(out, "  printf(\"\\n\");\n");
+    break;
+  case OP_JMP:
+    emit_goto(pc, code[1]);
+    break;
+  case OP_JZ:
+    fprintf(out, "  if (%s == 0) {\n  ", top);
+    emit_goto(pc, code[1]);
+    fprintf(out, "  }\n");
+    break;
+  case OP_GOSUB:
+    uses_gosub = uses_poll = 1;
+    fprintf(out, "  if (gp >= %d) {\n", gosub_depth);
+    fprintf(out, "    ubasic_native_error(%d, \"Gosub stack exhausted\",",
+            line_of(pc));
+    fprintf(out, " \"\");\n");
+    fprintf(out, "  }\n");
+    fprintf(out, "  gosubs[gp++] = %d;\n", pc + 2);
+    fprintf(out, "  POLL();\n  goto L%d;\n", code[1]);
+    break;
+  case OP_RETURN:
+    uses_gosub = uses_poll = 1;
+    fprintf(out, "  if (gp <= 0) {\n");
+    fprintf(out, "    ubasic_native_error(%d, \"No matching return\", \"\");\n",
+            line_of(pc));
+    fprintf(out, "  }\n");
+    fprintf(out, "  POLL();\n");
+    fprintf(out, "  resume = gosubs[--gp];\n  goto resume_at;\n");
+    break;
+  case OP_FOR:
+  case OP_FORF:
+    emit_for(pc, code[1], code[0] == OP_FORF, slot(d - 2, slot_type[d - 2]),
+             top);
+    break;
+  case OP_NEXT:
+  case OP_NEXTF:
+    emit_next(pc, code[1], code[0] == OP_NEXTF);
+    break;
+  case OP_PEEK:
+    uses_v = 1;
+    fprintf(out, "  v[%d] = ubasic_native_peek(%s);\n", code[1], top);
+    break;
+  case OP_POKE:
+    fprintf(out, "  ubasic_native_poke(%s, ", slot(d - 2, T_INT));
+    fprintf(out, "%s);\n", top);
+    break;
+  case OP_SLEEP:
+    fprintf(out, "  sleep_ms(%s * 1000);\n", top);
+    fprintf(out, "  check_if_should_enter_CMD_mode();\n");
+    break;
+  case OP_DELAY:
+    fprintf(out, "  sleep_ms(%s);\n", top);
+    fprintf(out, "  check_if_should_enter_CMD_mode();\n");
+    break;
+  case OP_RANDOMIZE:
+    fprintf(out, "  ubasic_native_randomize(%s);\n", top);
+    break;
+  case OP_PUSH:
+    fprintf(out, "  ubasic_native_push(%d, %s);\n", line_of(pc), top);
+    break;
+  case OP_POP:
+    uses_v = 1;
+    fprintf(out, "  v[%d] = ubasic_native_pop(%d);\n", code[1], line_of(pc));
+    break;
+  case OP_OS:
+    fprintf(out, "  system(%s);\n", top);
+    fprintf(out, "  ubasic_native_release(%s);\n", top);
+    break;
+  case OP_GPIOINIT:
+    fprintf(out, "  gpio_init(%s);\n", top);
+    break;
+  case OP_GPIODIRIN:
+    fprintf(out, "  gpio_set_dir(%s, GPIO_IN);\n", top);
+    break;
+  case OP_GPIODIROUT:
+    fprintf(out, "  gpio_set_dir(%s, GPIO_OUT);\n", top);
+    break;
+  case OP_GPIOON:
+    fprintf(out, "  gpio_put(%s, 1);\n", top);
+    break;
+  case OP_GPIOOFF:
+    fprintf(out, "  gpio_put(%s, 0);\n", top);
+    break;
+  case OP_ADDVI:
+    uses_v = 1;
+    fprintf(out, "  v[%d] += ", code[1]);
+    emit_int(code[2]);
+    fprintf(out, ";\n");
+    break;
+  case OP_JLTVI:
+  case OP_JGTVI:
+  case OP_JEQVI:
+    uses_v = 1;
+    fprintf(out, "  if (v[%d] %s ", code[1],
+            code[0] == OP_JLTVI ? "<" : code[0] == OP_JGTVI ? ">" : "==");
+    emit_int(code[2]);
+    fprintf(out, ") {\n  ");
+    emit_goto(pc, code[3]);
+    fprintf(out, "  }\n");
+    break;
+  case OP_FORI:
+    snprintf(limit, sizeof limit, "%d", code[2]);
+    snprintf(step, sizeof step, "%d", code[3]);
+    emit_for(pc, code[1], 0, limit, step);
+    break;
+  case OP_GPIOONI:
+    fprintf(out, "  gpio_put(%d, 1);\n", code[1]);
+    break;
+  case OP_GPIOOFFI:
+    fprintf(out, "  gpio_put(%d, 0);\n", code[1]);
+    break;
+  case OP_DELAYI:
+    fprintf(out, "  sleep_ms(%d);\n", code[1]);
+    fprintf(out, "  check_if_should_enter_CMD_mode();\n");
+    break;
+  default:
+    fatal("opcode not handled", "");
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void emit_helpers(void) {
+  char budget[32];
+
+  /* Backward jumps let CMD mode in every so often, like the VM's budget */
+  snprintf(budget, sizeof budget, "    budget = %d;", VM_SLICE);
+  fprintf(out, "%-79s\\\n", "#define POLL()");
+  fprintf(out, "%-79s\\\n", "  if (--budget == 0) {");
+  fprintf(out, "%-79s\\\n", budget);
+  fprintf(out, "%-79s\\\n", "    check_if_should_enter_CMD_mode();");
+  fprintf(out, "  }\n\n");
+  if (uses_for) {
+    fprintf(out, "struct native_for {\n"
+                 "  int var;\n"
+                 "  int is_float;\n"
+                 "  int resume;\n"
+                 "  VARIABLE_TYPE to, step;\n"
+                 "  VARFLOAT_TYPE tof, stepf;\n"
+                 "};\n\n");
+  }
+  if (uses_strings) {
+    emit_strings();
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* One to a line, VARSTRING_TYPE is a char * so a list would declare chars */
+static void emit_locals(const char *prefix, unsigned char *used, int n,
+                        const char *type) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (used[i]) {
+      fprintf(out, "  %s %s%d;\n", type, prefix, i);
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void translate(const char *source, FILE *dest) {
+  static const char *const types[] = {"VARIABLE_TYPE", "VARFLOAT_TYPE",
+                                      "VARSTRING_TYPE"};
+  static const char *const prefixes[] = {"i", "f", "s"};
+  char prefix[4];
+  FILE *body = tmpfile();
+  int pc, c, t;
+
+  if (body == NULL) {
+    fatal("can't create a temporary file", "");
+  }
+  analyse();
+
+  /* The body first, to know which locals and helpers it needs */
+  out = body;
+  for (pc = 0; pc < bc.code_len; pc += 1 + operands[bc.code[pc]]) {
+    if (label[pc] || resume[pc]) {
+      fprintf(out, "L%d:\n", pc);
+    }
+    emit_instruction(pc);
+  }
+  if (has_resume) {
+    fprintf(out, "resume_at:\n  switch (resume) {\n");
+    for (pc = 0; pc < bc.code_len; pc++) {
+      if (resume[pc]) {
+        fprintf(out, "  case %d:\n    goto L%d;\n", pc, pc);
+      }
+    }
+    fprintf(out, "  }\n");
+  }
+
+  out = dest;
+  fprintf(out, "/* Generated by bas2c from %s, edit that instead */\n\n",
+          source);
+  fprintf(out, "#include <math.h>\n#include <stdio.h>\n#include <stdlib.h>\n"
+               "#include <string.h>\n\n#include \"pico/stdlib.h\"\n\n"
+               "#include \"piccoloBASIC.h\"\n#include \"tokenizer.h\"\n"
+               "#include \"ubasic_native.h\"\n\n");
+  emit_helpers();
+  fprintf(out, "void ubasic_native_program(void) {\n");
+  if (uses_v) {
+    fprintf(out, "  VARIABLE_TYPE *v;\n");
+  }
+  if (uses_f) {
+    fprintf(out, "  VARFLOAT_TYPE *f;\n");
+  }
+  for (t = T_INT; t <= T_STRING; t++) {
+    emit_locals(prefixes[t], slot_used[t], BC_STACK_DEPTH, types[t]);
+  }
+  for (t = T_INT; t <= T_STRING; t++) {
+    snprintf(prefix, sizeof prefix, "t%s", prefixes[t]);
+    emit_locals(prefix, temp_used[t], BC_TEMPS, types[t]);
+  }
+  if (uses_for) {
+    fprintf(out, "  struct native_for fors[%d], *fs;\n  int fp = 0;\n",
+            MAX_FOR_STACK_DEPTH);
+  }
+  if (uses_gosub) {
+    fprintf(out, "  int gosubs[%d];\n  int gp = 0;\n", gosub_depth);
+  }
+  if (has_resume) {
+    fprintf(out, "  int resume;\n");
+  }
+  if (uses_poll) {
+    fprintf(out, "  int budget = %d;\n", VM_SLICE);
+  }
+  if (uses_buff) {
+    fprintf(out, "  char buff[64];\n");
+  }
+  fprintf(out, "\n  ubasic_init(\"\");\n");
+  if (uses_v) {
+    fprintf(out, "  v = ubasic_native_variables();\n");
+  }
+  if (uses_f) {
+    fprintf(out, "  f = ubasic_native_float_variables();\n");
+  }
+  rewind(body);
+  while ((c = fgetc(body)) != EOF) {
+    fputc(c, out);
+  }
+  fclose(body);
+  fprintf(out, "}\n");
+}
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[]) {
+  char *program;
+
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: bas2c program.bas [program.c]\n");
+    return 2;
+  }
+  program = read_file(argv[1]);
+  gosub_depth =
+      tokenizer_pragma(program, "gosub_depth", MAX_GOSUB_STACK_DEPTH);
+  if (gosub_depth < 1 || gosub_depth > GOSUB_STACK_DEPTH_LIMIT) {
+    fprintf(stderr, "bas2c: gosub_depth %d out of range\n", gosub_depth);
+    gosub_depth = MAX_GOSUB_STACK_DEPTH;
+  }
+  if (compiler_compile(program, &bc) != 0) {
+    fatal(argv[1], " doesn't compile, run it on the interpreter to see why");
+  }
+  if (argc == 3) {
+    out = fopen(argv[2], "w");
+    if (out == NULL) {
+      fatal("can't create ", argv[2]);
+    }
+  } else {
+    out = stdout;
+  }
+  translate(argv[1], out);
+  if (out != stdout) {
+    fclose(out);
+  }
+  compiler_free(&bc);
+  free(program);
+  return 0;
+}
@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2023, Gary Sims
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Host runner for benchmarks and tests, built by CMakeLists.txt here
+ * from the firmware's own sources, once for each interpreter variant:
+ *
+ *   bench_vm [-n runs] [-s | -m] [-q] program.bas
+ *
+ * The program runs as it would on the device, n times over (1 by
+ * default), printing to stdout. The time per run goes to stderr, and if
+ * the program says how many statements one run executes, with a line
+ *   rem pragma statements 300002
+ * so do statements per second. Counters of the last run follow, where
+ * the variant has them; strings made and bytes copied into them are
+ * given per pass of the program's main loop if it says how many passes
+ * that is, with rem pragma iterations. -s runs it on a thread of its own whose stack is
+ * filled with a pattern first, and reports how deep into it the program
+ * got beyond what the thread takes by itself. -m compares the heap in use
+ * after the first run with that after the last and fails if it grew,
+ * for soak tests (glibc counts the blocks its per-thread cache keeps as
+ * in use, set GLIBC_TUNABLES=glibc.malloc.tcache_count=0 for an exact
+ * count); -q drops the program's output.
+ *
+ * sleep and delay don't wait, they move a simulated clock on. Once a run
+ * has slept SLEEP_LIMIT_MS in all it is stopped there, which ends the
+ * endless examples (blinky) and the error loop of ubasic_exit() after
+ * the same output every time.
+ *
+ * Built with UBASIC_NATIVE=1 and a program translated by tools/bas2c, it
+ * runs that instead; the program named is then only read for pragmas.
+ */
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pico/stdlib.h"
+
+#include "piccoloBASIC.h"
+#include "tokenizer.h"
+#include "ubasic.h"
+#include "ubasic_native.h"
+
+/* Set by the build when a program translated by tools/bas2c is linked in */
+#ifndef UBASIC_NATIVE
+#define UBASIC_NATIVE 0
+#endif
+
+#define SLEEP_LIMIT_MS 10000
+#define STACK_SIZE (1024 * 1024)
+#define STACK_FILL 0xa5
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define HEAP_IN_USE() ((long)mallinfo2().uordblks)
+#else
+#define HEAP_IN_USE() (-1L) /* not known here */
+#endif
+
+static unsigned long slept_ms;
+static jmp_buf stop;
+
+struct job {
+  const char *program; /* NULL to only measure the thread itself */
+  int runs;
+  int stopped;
+  double ms;       /* per run */
+  long heap_first; /* heap in use after the first run */
+  long heap_last;  /* and after the last */
+};
+
+/*---------------------------------------------------------------------------*/
+int check_if_should_enter_CMD_mode() { return 0; }
+/*---------------------------------------------------------------------------*/
+void sleep_ms(uint32_t ms) {
+  slept_ms += ms;
+  if (slept_ms > SLEEP_LIMIT_MS) {
+    longjmp(stop, 1);
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void fatal(const char *msg, const char *arg) {
+  fprintf(stderr, "bench: %s%s\n", msg, arg);
+  exit(1);
+}
+/*---------------------------------------------------------------------------*/
+static char *read_file(const char *name) {
+  FILE *f = fopen(name, "rb");
+  char *text;
+  long len;
+
+  if (f == NULL) {
+    fatal("can't open ", name);
+  }
+  fseek(f, 0, SEEK_END);
+  len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  text = malloc(len + 1);
+  if (text == NULL || fread(text, 1, len, f) != (size_t)len) {
+    fatal("can't read ", name);
+  }
+  text[len] = 0;
+  fclose(f);
+  return text;
+}
+/*---------------------------------------------------------------------------*/
+static double now_ms(void) {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+/*---------------------------------------------------------------------------*/
+/* Runs program once, returns 1 if it was stopped asleep */
+static int run(const char *program) {
+  slept_ms = 0;
+  if (setjmp(stop) != 0) {
+    return 1;
+  }
+#if UBASIC_NATIVE
+  (void)program;
+  ubasic_native_program();
+#else
+  ubasic_init(program);
+  do {
+    ubasic_run();
+  } while (!ubasic_finished());
+#endif
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static void *run_job(void *arg) {
+  struct job *job = arg;
+  double start = now_ms();
+  int i;
+
+  for (i = 0; job->program != NULL && i < job->runs; i++) {
+    job->stopped |= run(job->program);
+    if (i == 0) {
+      job->heap_first = HEAP_IN_USE();
+    }
+  }
+  job->heap_last = HEAP_IN_USE();
+  job->ms = (now_ms() - start) / job->runs;
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* Runs job on a thread with a filled stack, returns the bytes it used */
+static int stack_used(struct job *job) {
+  pthread_attr_t attr;
+  pthread_t thread;
+  unsigned char *stack;
+  int i;
+
+  stack = malloc(STACK_SIZE);
+  if (stack == NULL) {
+    fatal("out of memory for a stack", "");
+  }
+  memset(stack, STACK_FILL, STACK_SIZE);
+  if (pthread_attr_init(&attr) != 0 ||
+      pthread_attr_setstack(&attr, stack, STACK_SIZE) != 0 ||
+      pthread_create(&thread, &attr, run_job, job) != 0) {
+    fatal("can't start a thread", "");
+  }
+  pthread_join(thread, NULL);
+  pthread_attr_destroy(&attr);
+  for (i = 0; i < STACK_SIZE && stack[i] == STACK_FILL; i++) {
+  }
+  free(stack);
+  return STACK_SIZE - i;
+}
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[]) {
+  const struct ubasic_stats *stats;
+  struct job job = {NULL, 1, 0, 0, 0, 0}, idle = {NULL, 1, 0, 0, 0, 0};
+  int statements, iterations, measure_stack = 0, stack = 0, opt;
+  int measure_heap = 0, grew = 0;
+  char *name;
+
+  while ((opt = getopt(argc, argv, "n:smq")) != -1) {
+    if (opt == 'n') {
+      job.runs = atoi(optarg);
+    } else if (opt == 's') {
+      measure_stack = 1;
+    } else if (opt == 'm') {
+      measure_heap = 1;
+    } else if (opt == 'q') {
+      if (freopen("/dev/null", "w", stdout) == NULL) {
+        fatal("can't drop the output", "");
+      }
+    } else {
+      break;
+    }
+  }
+  /* -s runs on another thread, whose heap mallinfo2() doesn't count */
+  if (opt != -1 || optind != argc - 1 || job.runs < 1 ||
+      (measure_stack && measure_heap)) {
+    fprintf(stderr, "usage: bench [-n runs] [-s | -m] [-q] program.bas\n");
+    return 2;
+  }
+  name = argv[optind];
+  job.program = read_file(name);
+  statements = tokenizer_pragma(job.program, "statements", 0);
+  iterations = tokenizer_pragma(job.program, "iterations", 0);
+
+  if (measure_stack) {
+    stack = stack_used(&job) - stack_used(&idle);
+  } else {
+    run_job(&job);
+  }
+  fflush(stdout);
+
+  fprintf(stderr, "%s: %d runs, %.4g ms per run", name, job.runs, job.ms);
+  if (statements > 0 && job.ms > 0) {
+    fprintf(stderr, ", %.2f M statements/s", statements / job.ms / 1e3);
+  }
+  fprintf(stderr, "\n");
+  stats = ubasic_get_stats();
+  if (stats->not_compiled != NULL) {
+    fprintf(stderr, "%s: not compiled, line %d: %s\n", name,
+            stats->not_compiled_line, stats->not_compiled);
+  }
+  if (stats->jit_regions > 0) {
+    fprintf(stderr, "%s: jit regions %d, %d bytes of code\n", name,
+            stats->jit_regions, stats->jit_bytes);
+  }
+  if (iterations > 0) {
+    fprintf(stderr, "%s: %.2f strings made, %.1f bytes copied per iteration\n",
+            name, (double)stats->string_allocs / iterations,
+            (double)stats->string_copied / iterations);
+  } else if (stats->string_allocs > 0) {
+    fprintf(stderr, "%s: %lu strings made, %lu bytes copied\n", name,
+            stats->string_allocs, stats->string_copied);
+  }
+  if (measure_stack) {
+    fprintf(stderr, "%s: %d bytes of stack at most\n", name, stack);
+  }
+  if (measure_heap && job.heap_first >= 0) {
+    grew = job.heap_last > job.heap_first;
+    fprintf(stderr, "%s: heap in use %ld bytes after the first run, %ld after "
+            "the last%s\n", name, job.heap_first, job.heap_last,
+            grew ? ", it grew" : "");
+  } else if (measure_heap) {
+    fprintf(stderr, "%s: heap in use not known on this host\n", name);
+  }
+  if (job.stopped) {
+    fprintf(stderr, "%s: stopped after sleeping %d s\n", name,
+            SLEEP_LIMIT_MS / 1000);
+  }
+  free((char *)job.program);
+  return grew;
+}
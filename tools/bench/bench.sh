@@ -0,0 +1,42 @@
+#!/bin/sh
+# Times every benchmark program on every runner built in a build directory
+# of tools/bench, best of 5 goes of RUNS runs each (5 by default):
+#
+#   tools/bench/bench.sh build-bench [program.bas ...]
+#   RUNS=1000 tools/bench/bench.sh build-bench tools/bench/programs/for.bas
+#
+# A runner that can't run a program whole (bench_vm on one that doesn't
+# compile falls back to the text interpreter) still gets timed, so read the
+# columns together with the program. The last column is the program
+# translated to C by tools/bas2c (native_<name>), where it was built.
+
+dir=$1
+[ -d "$dir" ] || { echo "usage: bench.sh build-dir [program.bas ...]" >&2; exit 2; }
+shift
+here=$(dirname "$0")
+[ $# -gt 0 ] || set -- "$here"/programs/*.bas "$dir"/programs/*.bas
+
+printf "%-14s" program
+for runner in "$dir"/bench_*; do
+  [ -x "$runner" ] && printf " %12s" "$(basename "$runner" | sed 's/^bench_//')"
+done
+printf " %12s   (ms per run)\n" native
+for program in "$@"; do
+  [ -f "$program" ] || continue
+  name=$(basename "$program" .bas)
+  printf "%-14s" "$name"
+  for runner in "$dir"/bench_* "$dir/native_$name"; do
+    if [ ! -x "$runner" ]; then
+      case $runner in */native_*) printf " %12s" - ;; esac
+      continue
+    fi
+    best=
+    for i in 1 2 3 4 5; do
+      ms=$("$runner" -n "${RUNS:-5}" "$program" 2>&1 >/dev/null |
+           sed -n 's/.* runs, \([0-9.]*\) ms per run.*/\1/p')
+      best=$(echo "$ms $best" | awk '{ print ($2 == "" || $1 < $2) ? $1 : $2 }')
+    done
+    printf " %12s" "$best"
+  done
+  printf "\n"
+done
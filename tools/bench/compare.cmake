@@ -0,0 +1,25 @@
+# Runs PROGRAM on RUNNER and fails unless it prints the same as it does on
+# OTHER, or as the file EXPECT holds:
+#
+#   cmake -DRUNNER=bench_vm -DPROGRAM=p.bas -DOTHER=bench_text -P compare.cmake
+#   cmake -DRUNNER=bench_vm -DPROGRAM=p.bas -DEXPECT=p.out -P compare.cmake
+
+function(run_program runner out)
+  execute_process(COMMAND ${runner} ${PROGRAM}
+      OUTPUT_VARIABLE output RESULT_VARIABLE status)
+  if(NOT status EQUAL 0)
+    message(FATAL_ERROR "${runner} ${PROGRAM} failed: ${status}")
+  endif()
+  set(${out} "${output}" PARENT_SCOPE)
+endfunction()
+
+run_program(${RUNNER} output)
+if(DEFINED EXPECT)
+  file(READ ${EXPECT} expected)
+else()
+  run_program(${OTHER} expected)
+endif()
+if(NOT output STREQUAL expected)
+  message(FATAL_ERROR "${PROGRAM} prints differently on ${RUNNER}:\n"
+      "${output}\nexpected:\n${expected}")
+endif()
@@ -0,0 +1,10 @@
+pininit 25
+pindirout 25
+loop:
+print "ON"
+pinon 25
+sleep 1
+print "OFF"
+pinoff 25
+sleep 1
+goto loop:
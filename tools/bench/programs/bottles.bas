@@ -0,0 +1,14 @@
+let b = 99
+let b$ = "99"
+let s$ = " bottles"
+for a = 1 to 99
+    print b$; s$; " of soda on the wall, "; b$; s$; " of soda."
+    let b = b - 1
+    if b > 0 then let p$ = "one"
+    if b > 0 then let b$ = b else let b$ = "no more"
+    if b = 0 then let p$ = "it"
+    if b = 1 then let s$ = " bottle" else let s$ = " bottles"
+    print "take "; p$; " down and pass it around, "; b$; s$; " of soda on the wall."
+next a
+print "no more bottles of soda on the wall, no more bottles of soda."
+print "go to the store and buy some more, 99 bottles of soda on the wall."
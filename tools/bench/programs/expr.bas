@@ -0,0 +1,10 @@
+rem Deeply parenthesised expressions with unary minus and comparisons, for
+rem the expression evaluator. Run with -s to see its stack use.
+rem pragma statements 80003
+let s = 0
+for i = 1 to 20000
+let a = ((((((((i + 1) * 3) - 2) % 97) + ((i % 5) * (2 - -i % 3))) * 2) - 7) % 1000)
+let b = -(-(a - (i % 13)) * (a > 500)) + ((a < 100) - (a = 7))
+let s = s + (a + b) % 17 - -(((((((b % 3)))))))
+next i
+print s
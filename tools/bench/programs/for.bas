@@ -0,0 +1,5 @@
+for i = 1 to 10
+let x = randint()
+print x
+next i
+end
@@ -0,0 +1,9 @@
+gosub asub:
+for i = 1 to 10
+print i
+next i
+print "end"
+end
+asub:
+print "subroutine"
+return
@@ -0,0 +1,4 @@
+loop:
+print "Gary Explains"
+sleep 1
+goto loop:
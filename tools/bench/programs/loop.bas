@@ -0,0 +1,11 @@
+rem A synthetic loop: for, next, arithmetic and an if, the bulk of what
+rem control scripts run.
+rem pragma statements 960003
+let s = 0
+for i = 1 to 30000
+for j = 1 to 10
+let s = s + i * j % 7
+if s > 100000 then let s = s - 100000
+next j
+next i
+print s
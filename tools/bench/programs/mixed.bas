@@ -0,0 +1,14 @@
+rem Mixed int and float arithmetic in let and print, for the typed
+rem expression evaluator.
+rem pragma statements 120005
+let a# = 1.5
+let s = 0
+let t# = 0.0
+for i = 1 to 20000
+let f# = i / 4.0 + a# * 3
+let n = f# * 2 + i % 7
+let t# = t# + n / 8 - f# / 16
+let s = s + n % 11 + a# * 2
+if i % 5000 = 0 then print i; " "; f#; " "; n; " "; t#; " "; s
+next i
+print t# / s + 1
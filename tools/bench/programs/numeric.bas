@@ -0,0 +1,9 @@
+rem A numeric loop for the JIT: integer arithmetic, a compare and a
+rem conditional let, a million times round.
+rem pragma statements 3000003
+let s = 0
+for i = 1 to 1000000
+let s = s + i % 7 * 3
+if s > 100000 then let s = s - 100000
+next i
+print s
@@ -0,0 +1,6 @@
+for i = 10 to 0 step 0 - 2
+print i
+next i
+for x# = 0 to 1 step 0.25
+print x#
+next x#
@@ -0,0 +1,13 @@
+rem String assignment: let b$ = a$ should share a$'s string, not copy it.
+rem a$ is built at run time so the compiler can't fold it to a literal.
+rem pragma statements 400005
+rem pragma iterations 100000
+let a$ = "the quick brown fox"
+let k = randint()
+if k > -1 then let a$ = a$ + " jumps over the lazy dog"
+for i = 1 to 100000
+let b$ = a$
+let c$ = b$
+if i % 25000 = 0 then print c$
+next i
+end
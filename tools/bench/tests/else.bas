@@ -0,0 +1,16 @@
+rem print before an else, run by the text interpreter since the goto to
+rem nowhere doesn't compile. The line cache must print what the text
+rem interpreter does also when the line has been evicted (cache2).
+let a = 1
+let n = 0
+again:
+if a = 1 then print "a" else print "b"
+let n = n + 1
+let m = n
+if n < 3 then goto again:
+if a = 2 then goto nowhere:
+let a = 2
+if a = 1 then print "a"; n else print "b"; n
+if a = 1 then print "a", else print "b",
+print "done"
+end
@@ -0,0 +1,14 @@
+rem Soak test: string temporaries in print, let and expressions, 10^6
+rem times. Run with bench -q -m -n 2, which fails if the heap grew. It
+rem must compile: ctest fails the vm run if bench says "not compiled".
+rem pragma statements 4000005
+rem pragma iterations 1000000
+let a$ = "abc"
+let b$ = "defgh"
+for i = 1 to 1000000
+print a$ + b$ + " " + i
+let c$ = a$ + b$ + i
+if len(c$ + a$) = 0 then print "never"
+next i
+print c$
+end
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2023, Gary Sims
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Host compiler for programs the device runs from a compiled image:
+ *
+ *   pbcc main.bas [main.pbc]
+ *
+ * The program goes through the same load time compiler as on the device
+ * and the bytecode is written out as an image (image.h), recording the
+ * interpreter version and a checksum. Upload main.pbc as well as, or
+ * instead of, main.bas and the device runs it without lexing, scanning
+ * labels or compiling. Rebuild the image whenever the firmware is
+ * updated, an interpreter of another version refuses it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "image.h"
+#include "tokenizer.h"
+#include "ubasic.h"
+
+/*---------------------------------------------------------------------------*/
+static void fatal(const char *msg, const char *arg) {
+  fprintf(stderr, "pbcc: %s%s\n", msg, arg);
+  exit(1);
+}
+/*---------------------------------------------------------------------------*/
+static char *read_file(const char *name) {
+  FILE *f = fopen(name, "rb");
+  char *text;
+  long len;
+
+  if (f == NULL) {
+    fatal("can't open ", name);
+  }
+  fseek(f, 0, SEEK_END);
+  len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  text = malloc(len + 1);
+  if (text == NULL || fread(text, 1, len, f) != (size_t)len) {
+    fatal("can't read ", name);
+  }
+  text[len] = 0;
+  fclose(f);
+  return text;
+}
+/*---------------------------------------------------------------------------*/
+/* name with its extension, if any, replaced by .pbc */
+static char *image_name(const char *name) {
+  const char *dot = strrchr(name, '.');
+  int len = dot != NULL && strchr(dot, '/') == NULL ? dot - name
+                                                    : (int)strlen(name);
+  char *out = malloc(len + 5);
+
+  memcpy(out, name, len);
+  strcpy(out + len, ".pbc");
+  return out;
+}
+/*---------------------------------------------------------------------------*/
+int main(int argc, char *argv[]) {
+  struct bc_program bc, check;
+  char *program, *image, *name;
+  int gosub_depth, size, check_depth;
+  FILE *out;
+
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: pbcc program.bas [program.pbc]\n");
+    return 2;
+  }
+  program = read_file(argv[1]);
+  gosub_depth =
+      tokenizer_pragma(program, "gosub_depth", MAX_GOSUB_STACK_DEPTH);
+  if (gosub_depth < 1 || gosub_depth > GOSUB_STACK_DEPTH_LIMIT) {
+    fprintf(stderr, "pbcc: gosub_depth %d out of range\n", gosub_depth);
+    gosub_depth = MAX_GOSUB_STACK_DEPTH;
+  }
+  if (compiler_compile(program, &bc) != 0) {
+    const char *why = compiler_error(&size);
+
+    fprintf(stderr, "pbcc: %s doesn't compile, line %d: %s\n", argv[1], size,
+            why != NULL ? why : "unknown");
+    exit(1);
+  }
+
+  size = image_size(&bc);
+  image = malloc(size);
+  if (image == NULL) {
+    fatal("out of memory for ", argv[1]);
+  }
+  image_build(&bc, gosub_depth, program, image);
+  if (image_load(image, size, &check, &check_depth) != NULL) {
+    fatal("wrote a bad image for ", argv[1]);
+  }
+
+  name = argc == 3 ? argv[2] : image_name(argv[1]);
+  out = fopen(name, "wb");
+  if (out == NULL || fwrite(image, 1, size, out) != (size_t)size ||
+      fclose(out) != 0) {
+    fatal("can't write ", name);
+  }
+  printf("%s: %d bytes, %d words of code, %d lines (interpreter version %d)\n",
+         name, size, bc.code_len, bc.lines_len, BC_VERSION);
+  if (compiler_pruned() > 0) {
+    printf("%s: %d bytes of dead code left out\n", name, compiler_pruned());
+  }
+
+  compiler_free(&bc);
+  free(image);
+  free(program);
+  return 0;
+}
@@ -32,6 +32,7 @@
  *
  */
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,6 +40,7 @@
 #include <time.h>
 #include <math.h>
 #include <limits.h>
+#include <stddef.h>
 
 #include "pico/stdlib.h"
 
@@ -58,28 +60,117 @@
 #define DDEBUG_PRINTF(...)
 #endif
 
+/* Compile the program to bytecode at load, 0 runs the text interpreter only */
+#ifndef UBASIC_BYTECODE
+#define UBASIC_BYTECODE 1
+#endif
+
+/* Run the text interpreter over a token array lexed at load */
+#ifndef UBASIC_TOKEN_STREAM
+#define UBASIC_TOKEN_STREAM 1
+#endif
+
+/* Dispatch bytecode with computed goto, where the compiler has it */
+#ifndef UBASIC_THREADED_DISPATCH
+#ifdef __GNUC__
+#define UBASIC_THREADED_DISPATCH 1
+#else
+#define UBASIC_THREADED_DISPATCH 0
+#endif
+#endif
+
+/*
+ * With threaded dispatch, decode every instruction to the address of its
+ * handler at load. Saves a load per instruction, but the table takes as
+ * much RAM as the code, which is all the program needs when it runs from
+ * an image in flash (PICCOLO_XIP in piccoloBASIC.c).
+ */
+#ifndef UBASIC_PREDECODE
+#define UBASIC_PREDECODE 1
+#endif
+
+/*
+ * Lines the text interpreter keeps compiled when the program as a whole
+ * doesn't compile, see line_cache_run(). The least recently run one makes
+ * way for a new one and is left to the interpreter, 0 turns it off.
+ */
+#ifndef UBASIC_LINE_CACHE
+#define UBASIC_LINE_CACHE 32
+#endif
+
+/*
+ * Operands, and operators waiting for theirs, the text interpreter holds
+ * while it evaluates an expression, see eval(). Limits how deeply
+ * parentheses and builtin calls nest. eval() keeps both stacks in its
+ * frame, about 14 bytes of C stack an entry.
+ */
+#ifndef UBASIC_EXPR_DEPTH
+#define UBASIC_EXPR_DEPTH 16
+#endif
+
+/*
+ * Bytes of scratch the text interpreter takes its string temporaries
+ * from (operands, joins, numbers turned into text). It is emptied at the
+ * start of every line, a line needing more borrows from the heap and
+ * gives it back then too. See scratch_alloc().
+ */
+#ifndef UBASIC_SCRATCH_SIZE
+#define UBASIC_SCRATCH_SIZE 512
+#endif
+
+/* Count how often the VM superinstructions run, see ubasic_get_stats() */
+#ifndef UBASIC_STATS
+#define UBASIC_STATS 1
+#endif
+
+/* Print what was built at load (token stream size etc) */
+#ifndef UBASIC_VERBOSE
+#define UBASIC_VERBOSE 0
+#endif
+
 #include "tokenizer.h"
 #include "ubasic.h"
+#include "ubasic_native.h"
 #include "piccoloBASIC.h"
+#include "compiler.h"
+#include "image.h"
+#include "jit.h"
 
 static char const *program_ptr;
-#define MAX_STRINGLEN 128
-static char string[MAX_STRINGLEN];
 
-#define MAX_GOSUB_STACK_DEPTH 10
-static int gosub_stack[MAX_GOSUB_STACK_DEPTH];
+/*
+ * Like FOR, a gosub keeps where to resume directly, so return is a
+ * tokenizer_goto() or a pc reload. The default depth (ubasic.h) can be
+ * changed at build time, or per program with a line like
+ *   rem pragma gosub_depth 32
+ */
+struct gosub_state {
+  char const *pos_after_gosub;
+  int pc_after_gosub;
+};
+static struct gosub_state *gosub_stack;
+static int gosub_stack_depth;
 static int gosub_stack_ptr;
 
+static struct ubasic_stats stats;
+
 #define MAX_INT_STACK_DEPTH 256
 static int int_stack[MAX_INT_STACK_DEPTH];
 static int int_stack_ptr;
 
+union for_value {
+  VARIABLE_TYPE i;
+  VARFLOAT_TYPE f;
+};
+/* Where to resume is kept directly, as text position or bytecode offset */
 struct for_state {
-  int line_after_for;
-  int for_variable;
-  int to;
+  char const *pos_after_for;
+  int pc_after_for;
+  short for_variable;
+  short is_float;
+  union for_value to;
+  union for_value step;
 };
-#define MAX_FOR_STACK_DEPTH 4
 static struct for_state for_stack[MAX_FOR_STACK_DEPTH];
 static int for_stack_ptr;
 
@@ -87,16 +178,32 @@ static int gline_number;
 
 static unsigned long RANDOM_NUM_SEED_x=123456789;
 
-#define MAX_VARNUM 26
-
+/*
+ * Line index, built once at load: the position of the first token of
+ * every line that has one, in program order, so lookups by position or
+ * by line number are binary searches over one contiguous array.
+ */
 struct line_index {
   int line_number;
+  char const *program_text_position;
+  short cached; /* line_cache entry + 1, 0 if none, -1 if not to be cached */
+};
+static struct line_index *line_index;
+static int line_index_len;
+static int line_index_current;
+
+/*
+ * Label definitions, found in one pass over the program by ubasic_init().
+ * Open addressing, so no allocation per label. If a program has more
+ * labels than fit, the rest are found by jump_label_slow().
+ */
+#define LABEL_TABLE_SIZE 64 // Must be a power of 2
+struct label_entry {
   char label[MAX_LABELLEN];
   char const *program_text_position;
-  struct line_index *next;
 };
-struct line_index *line_index_head = NULL;
-struct line_index *line_index_current = NULL;
+static struct label_entry label_table[LABEL_TABLE_SIZE];
+static int label_table_len;
 
 static VARIABLE_TYPE variables[MAX_VARNUM];
 static VARFLOAT_TYPE float_variables[MAX_VARNUM];
@@ -104,38 +211,156 @@ static VARSTRING_TYPE string_variables[MAX_VARNUM];
 
 static int ended;
 
+static struct bc_program bc;
+static int use_bytecode;
+static int bc_from_image; /* bc points into an image, see image.h */
+static int vm_pc;
+#if UBASIC_THREADED_DISPATCH && UBASIC_PREDECODE
+static const void **vm_handlers;
+#endif
+
 static VARIABLE_TYPE expr(void);
 static VARFLOAT_TYPE exprf(void);
+#if UBASIC_BYTECODE && UBASIC_LINE_CACHE
+static int line_cache_run(char const *pos);
+static void line_cache_free(void);
+#endif
 static VARSTRING_TYPE exprs(void);
 static void line_statement(void);
 static void statement(void);
 static void index_free(void);
-static void index_add_label(int linenum, char *label);
+static void scratch_reset(void);
+static void string_release(char *s);
+static void index_build(const char *program);
 static VARIABLE_TYPE builtin(int token, int p);
 static VARFLOAT_TYPE builtinf(int token, VARFLOAT_TYPE p);
-static VARSTRING_TYPE builtinstr(int token, VARSTRING_TYPE p);
-static VARSTRING_TYPE sprintfloat(VARFLOAT_TYPE f);
+static char *floattext(char *buff, VARFLOAT_TYPE f);
 static void printfloat(VARFLOAT_TYPE f);
+#if UBASIC_JIT
+static void vm_jit_init(void);
+#endif
 
 peek_func peek_function = NULL;
 poke_func poke_function = NULL;
 
 /*---------------------------------------------------------------------------*/
-void ubasic_init(const char *program) {
-  program_ptr = program;
+/* Forgets the last program and sets up for one needing gosub_depth entries */
+static void init_state(int gosub_depth) {
   for_stack_ptr = gosub_stack_ptr = 0;
   index_free();
+  scratch_reset();
+#if UBASIC_BYTECODE && UBASIC_LINE_CACHE
+  line_cache_free();
+#endif
+  free(gosub_stack);
+  gosub_stack_depth = gosub_depth;
+  if (gosub_stack_depth < 1 || gosub_stack_depth > GOSUB_STACK_DEPTH_LIMIT) {
+    printf("Error: gosub_depth %d out of range\n", gosub_stack_depth);
+    gosub_stack_depth = MAX_GOSUB_STACK_DEPTH;
+  }
+  gosub_stack = malloc(gosub_stack_depth * sizeof(struct gosub_state));
+  memset(&stats, 0, sizeof(stats));
+  stats.gosub_stack_depth = gosub_stack_depth;
   peek_function = NULL;
   poke_function = NULL;
-  tokenizer_init(program);
+  if (use_bytecode && !bc_from_image) {
+    compiler_free(&bc);
+  }
+  use_bytecode = bc_from_image = 0;
+#if UBASIC_THREADED_DISPATCH && UBASIC_PREDECODE
+  free(vm_handlers);
+  vm_handlers = NULL;
+#endif
+#if UBASIC_JIT
+  jit_free();
+#endif
+  vm_pc = 0;
   gline_number = 1;
   ended = 0;
   for(int i=0;i<MAX_VARNUM;i++) {
     variables[i] = 0;
     float_variables[i] = 0.0;
+    string_release(string_variables[i]);
     string_variables[i] = NULL;
   }
 }
+/*---------------------------------------------------------------------------*/
+void ubasic_init(const char *program) {
+  program_ptr = program;
+  init_state(tokenizer_pragma(program, "gosub_depth", MAX_GOSUB_STACK_DEPTH));
+  use_bytecode = UBASIC_BYTECODE && compiler_compile(program, &bc) == 0;
+  if (use_bytecode) {
+    stats.pruned_bytes = compiler_pruned();
+  } else if (UBASIC_BYTECODE) {
+    stats.not_compiled = compiler_error(&stats.not_compiled_line);
+  }
+#if UBASIC_JIT
+  if (use_bytecode) {
+    vm_jit_init();
+  }
+#endif
+  if (!use_bytecode) {
+    if (UBASIC_TOKEN_STREAM) {
+      stats.token_bytes = tokenizer_init_stream(program);
+      stats.tokens = tokenizer_stream_tokens();
+    }
+    if (stats.token_bytes <= 0) {
+      stats.token_bytes = 0;
+      tokenizer_init(program);
+    }
+    index_build(program);
+    if (UBASIC_VERBOSE && stats.tokens > 0) {
+      printf("Token stream: %d tokens, %d bytes (%d per token)\n",
+             stats.tokens, stats.token_bytes,
+             stats.token_bytes / stats.tokens);
+    }
+  }
+  tokenizer_goto(program);
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Runs a program compiled by tools/pbcc rather than source text. The
+ * image is used in place and has to stay around while the program runs.
+ * Returns -1, having said why, if it can't be run by this interpreter.
+ */
+int ubasic_init_image(const char *image, int len) {
+  struct bc_program prog;
+  int gosub_depth;
+  const char *err = image_load(image, len, &prog, &gosub_depth);
+
+  if (err != NULL) {
+    printf("Error: Compiled program refused, %s\n", err);
+    return -1;
+  }
+  program_ptr = "";
+  init_state(gosub_depth);
+  bc = prog;
+  use_bytecode = bc_from_image = 1;
+#if UBASIC_JIT
+  vm_jit_init();
+#endif
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * The program ubasic_init() compiled, as a malloc()ed image that
+ * ubasic_init_image() can run next time without compiling. NULL if the
+ * program runs on the text interpreter.
+ */
+char *ubasic_build_image(int *len) {
+  char *image;
+
+  if (!use_bytecode || bc_from_image) {
+    return NULL;
+  }
+  *len = image_size(&bc);
+  image = malloc(*len);
+  if (image != NULL) {
+    image_build(&bc, gosub_stack_depth, program_ptr, image);
+  }
+  return image;
+}
+/*---------------------------------------------------------------------------*/
 char ubasic_exit_buffer[64];
 char *ubasic_exit_static_itoa(int e) {
   sprintf(ubasic_exit_buffer, "%d", e);
@@ -191,563 +416,616 @@ static VARSTRING_TYPE varstrfactor(void) {
   accept(TOKENIZER_VARSTRING);
   return s;
 }
-/*---------------------------------------------------------------------------*/
-static int factor(void) {
-  VARIABLE_TYPE r;
-  VARIABLE_TYPE p;
-  int builtin_token;
+/* Strings made and bytes copied into them, see ubasic_get_stats() */
+#if UBASIC_STATS
+#define STRING_COUNT(counter, n) stats.counter += (n)
+#else
+#define STRING_COUNT(counter, n)
+#endif
 
-  DEBUG_PRINTF("factor: token %d\n", tokenizer_token());
-  switch (tokenizer_token()) {
-  case TOKENIZER_NUMBER:
-    r = tokenizer_num();
-    DEBUG_PRINTF("factor: number %ld\n", r);
-    accept(TOKENIZER_NUMBER);
-    break;
-  case TOKENIZER_ZERO:
-  case TOKENIZER_NOT:
-  case TOKENIZER_RANDINT:
-  case TOKENIZER_TIME:
-    builtin_token = tokenizer_token();
-    accept(builtin_token);
-    accept(TOKENIZER_LEFTPAREN);
-    if (tokenizer_token() == TOKENIZER_RIGHTPAREN) {
-      p = 0;
-      accept(TOKENIZER_RIGHTPAREN);
-    } else {
-      p = expr();
-      accept(TOKENIZER_RIGHTPAREN);
+/*---------------------------------------------------------------------------
+ * Scratch for string temporaries. Strings in an expression are never
+ * freed one by one, they all go when the next line starts; only
+ * ubasic_set_string_variable() makes a copy that lasts. Whatever a line
+ * does with strings, the heap is back where it was after it.
+ *---------------------------------------------------------------------------*/
+struct scratch_block {
+  struct scratch_block *next;
+  char data[];
+};
+
+static char scratch[UBASIC_SCRATCH_SIZE];
+static char *scratch_next = scratch; /* where the next string goes */
+static int scratch_room = UBASIC_SCRATCH_SIZE; /* and how much fits there */
+static struct scratch_block *scratch_heap; /* this line's overflow */
+
+static char *scratch_alloc(int len) {
+  struct scratch_block *b;
+  int size;
+
+  if (len > scratch_room) {
+    /* Room for this and more like it, a chain of + keeps growing */
+    size = len * 2 > UBASIC_SCRATCH_SIZE ? len * 2 : UBASIC_SCRATCH_SIZE;
+    b = malloc(sizeof(struct scratch_block) + size);
+    if (b == NULL) {
+      printf("Error: On line %d, out of memory for strings\n",
+             gline_number - 1);
+      ubasic_exit(gline_number - 1, "out of memory for strings",
+                  ubasic_exit_static_itoa(len));
     }
-    r = builtin(builtin_token, p);
-    DEBUG_PRINTF("builtin %d(%ld)=%ld\n", builtin_token, p, r);
-    break;
-  case TOKENIZER_LEFTPAREN:
-    accept(TOKENIZER_LEFTPAREN);
-    r = expr();
-    accept(TOKENIZER_RIGHTPAREN);
-    break;
-  case TOKENIZER_VARFLOAT:
-    r = (VARIABLE_TYPE)varfloatfactor();
-    break;
-  default:
-    r = varfactor();
-    break;
+    b->next = scratch_heap;
+    scratch_heap = b;
+    scratch_next = b->data;
+    scratch_room = size;
+    stats.scratch_overflows++;
+    STRING_COUNT(string_allocs, 1);
   }
-  return r;
+  scratch_next += len;
+  scratch_room -= len;
+  if (scratch_heap == NULL && scratch_next - scratch > stats.scratch_max) {
+    stats.scratch_max = scratch_next - scratch;
+  }
+  return scratch_next - len;
 }
 /*---------------------------------------------------------------------------*/
-static VARFLOAT_TYPE factorf(void) {
-  VARFLOAT_TYPE f;
-  VARFLOAT_TYPE p;
-  int builtin_token;
-
-  DEBUG_PRINTF("factorf: token %d\n", tokenizer_token());
-  switch (tokenizer_token()) {
-  case TOKENIZER_NUMBER:
-    f = (VARFLOAT_TYPE)tokenizer_num();
-    DEBUG_PRINTF("factorf: number %f\n", f);
-    accept(TOKENIZER_NUMBER);
-    break;
-  case TOKENIZER_NUMFLOAT:
-    f = tokenizer_numfloat();
-    DEBUG_PRINTF("factorf: float number %f\n", f);
-    accept(TOKENIZER_NUMFLOAT);
-    break;
-  case TOKENIZER_SQR:
-  case TOKENIZER_RND:
-  case TOKENIZER_ABS:
-  case TOKENIZER_ATN:
-  case TOKENIZER_COS:
-  case TOKENIZER_EXP:
-  case TOKENIZER_LOG:
-  case TOKENIZER_SIN:
-  case TOKENIZER_TAN:
-    builtin_token = tokenizer_token();
-    accept(builtin_token);
-    accept(TOKENIZER_LEFTPAREN);
-    if (tokenizer_token() == TOKENIZER_RIGHTPAREN) {
-      p = 0.0;
-      accept(TOKENIZER_RIGHTPAREN);
-    } else {
-      p = expr();
-      accept(TOKENIZER_RIGHTPAREN);
-    }
-    f = builtinf(builtin_token, p);
-    DEBUG_PRINTF("builtinf %d(%f)=%f\n", builtin_token, p, f);
-    break;
-  case TOKENIZER_LEFTPAREN:
-    accept(TOKENIZER_LEFTPAREN);
-    f = exprf();
-    accept(TOKENIZER_RIGHTPAREN);
-    break;
-  case TOKENIZER_VARIABLE:
-    f = (VARFLOAT_TYPE)varfactor();
-    break;
-  default:
-    f = varfloatfactor();
-    break;
+/*
+ * Appends t to s where s is, when s (len characters, in the scratch) is
+ * the last thing there or only t (tlen characters) comes after it.
+ * Returns 0 if it can't, leaving both alone.
+ */
+static int scratch_append(char *s, int len, const char *t, int tlen) {
+  if (s + len + 1 == t && t + tlen + 1 == scratch_next) {
+    memmove(s + len, t, tlen + 1);
+    scratch_next--;
+    scratch_room++;
+  } else if (s + len + 1 == scratch_next && tlen <= scratch_room) {
+    memcpy(s + len, t, tlen);
+    s[len + tlen] = 0;
+    scratch_next += tlen;
+    scratch_room -= tlen;
+  } else {
+    return 0;
   }
-  return f;
+  STRING_COUNT(string_copied, tlen + 1);
+  return 1;
 }
 /*---------------------------------------------------------------------------*/
-static int term(void) {
-  VARIABLE_TYPE f1, f2;
-  int op;
+/* A copy of s, len characters long and not necessarily 0 terminated */
+static char *scratch_copy(const char *s, int len) {
+  char *t = scratch_alloc(len + 1);
 
-  f1 = factor();
-  op = tokenizer_token();
-  DEBUG_PRINTF("term: token %d\n", op);
-  while (op == TOKENIZER_ASTR || op == TOKENIZER_SLASH || op == TOKENIZER_MOD) {
-    tokenizer_next();
-    f2 = factor();
-    DEBUG_PRINTF("term: %ld %d %ld\n", f1, op, f2);
-    switch (op) {
-    case TOKENIZER_ASTR:
-      f1 = f1 * f2;
-      break;
-    case TOKENIZER_SLASH:
-      f1 = f1 / f2;
-      break;
-    case TOKENIZER_MOD:
-      f1 = f1 % f2;
-      break;
-    }
-    op = tokenizer_token();
+  memcpy(t, s, len);
+  t[len] = 0;
+  STRING_COUNT(string_copied, len + 1);
+  return t;
+}
+/*---------------------------------------------------------------------------*/
+static void scratch_reset(void) {
+  struct scratch_block *b;
+
+  while (scratch_heap != NULL) {
+    b = scratch_heap;
+    scratch_heap = b->next;
+    free(b);
+  }
+  scratch_next = scratch;
+  scratch_room = UBASIC_SCRATCH_SIZE;
+}
+/*---------------------------------------------------------------------------
+ * String variables, and the strings on the VM stack, are counted and
+ * never changed once made (struct bc_string). Assigning one variable to
+ * another or loading one onto the stack takes a reference instead of
+ * copying the text, and a new value is always a new string. Only the
+ * text pointer is passed around, the count and length sit just before
+ * it. Strings with a count below zero, like those in the string pool,
+ * are never counted or freed.
+ *---------------------------------------------------------------------------*/
+
+/* What an unset variable reads as */
+static struct bc_string string_empty = {-1, 0, ""};
+
+/* A string of len bytes with s copied in if given, holding one reference */
+static char *string_new(const char *s, int len) {
+  struct bc_string *r = malloc(sizeof(struct bc_string) + len);
+
+  if (r == NULL) {
+    printf("Error: On line %d, out of memory for strings\n", gline_number - 1);
+    ubasic_exit(gline_number - 1, "out of memory for strings",
+                ubasic_exit_static_itoa(len));
+  }
+  r->refs = 1;
+  r->len = len;
+  if (s != NULL) {
+    memcpy(r->text, s, len);
+    STRING_COUNT(string_copied, len);
   }
-  DEBUG_PRINTF("term: %ld\n", f1);
-  return f1;
+  r->text[len] = 0;
+  STRING_COUNT(string_allocs, 1);
+  return r->text;
 }
 /*---------------------------------------------------------------------------*/
-static VARIABLE_TYPE expr(void) {
-  VARIABLE_TYPE t1, t2;
-  int op;
-
-  t1 = term();
-  op = tokenizer_token();
-  DEBUG_PRINTF("expr: token %d\n", op);
-  while (op == TOKENIZER_PLUS || op == TOKENIZER_MINUS || op == TOKENIZER_AND ||
-         op == TOKENIZER_OR) {
-    tokenizer_next();
-    t2 = term();
-    DEBUG_PRINTF("expr: %ld %d %ld\n", t1, op, t2);
-    switch (op) {
-    case TOKENIZER_PLUS:
-      t1 = t1 + t2;
-      break;
-    case TOKENIZER_MINUS:
-      t1 = t1 - t2;
-      break;
-    case TOKENIZER_AND:
-      t1 = t1 & t2;
-      break;
-    case TOKENIZER_OR:
-      t1 = t1 | t2;
-      break;
-    }
-    op = tokenizer_token();
+static char *string_hold(char *s) {
+  if (BC_STRING(s)->refs > 0) {
+    BC_STRING(s)->refs++;
   }
-  DEBUG_PRINTF("expr: %ld\n", t1);
-  return t1;
+  return s;
 }
 /*---------------------------------------------------------------------------*/
-static VARFLOAT_TYPE termf(void) {
-  VARFLOAT_TYPE f1, f2;
-  int op;
-
-  f1 = factorf();
-  op = tokenizer_token();
-  DEBUG_PRINTF("termf: token %d\n", op);
-  while (op == TOKENIZER_ASTR || op == TOKENIZER_SLASH) {
-    tokenizer_next();
-    f2 = factorf();
-    DEBUG_PRINTF("termf: %f %d %f\n", f1, op, f2);
-    switch (op) {
-    case TOKENIZER_ASTR:
-      f1 = f1 * f2;
-      break;
-    case TOKENIZER_SLASH:
-      f1 = f1 / f2;
-      break;
-    }
-    op = tokenizer_token();
+static void string_release(char *s) {
+  if (s != NULL && BC_STRING(s)->refs > 0 && --BC_STRING(s)->refs == 0) {
+    free(BC_STRING(s));
   }
-  DEBUG_PRINTF("termf: %f\n", f1);
-  return f1;
 }
 /*---------------------------------------------------------------------------*/
-static VARFLOAT_TYPE exprf(void) {
-  VARFLOAT_TYPE t1, t2;
-  int op;
+/* Variable var as s, whose reference it takes over */
+static void string_assign(int var, char *s) {
+  string_release(string_variables[var]);
+  string_variables[var] = s;
+}
+/*---------------------------------------------------------------------------*/
+/* The text of variable var with a reference held for the caller */
+static char *string_load(int var) {
+  return string_hold(string_variables[var] != NULL ? string_variables[var]
+                                                   : string_empty.text);
+}
+/*---------------------------------------------------------------------------
+ * Expression evaluator. Precedence climbing without recursion: operands
+ * and the operators still waiting for their right hand side are kept on
+ * two fixed stacks, so nesting costs UBASIC_EXPR_DEPTH entries at most
+ * instead of C stack frames. From loosest to tightest:
+ *
+ *   < > =      comparisons, 0 or 1
+ *   + - & |
+ *   * / %
+ *   -          negation
+ *
+ * Operands carry their type and each operator looks at its operands'
+ * types once when it is applied: it works in float if either one is a
+ * float, %, & and | in integer, and + joins strings. Integer division is
+ * done in float when the whole expression is wanted as a float (the
+ * compiler's typed() does the same).
+ *
+ * An expression wanted as a string, or starting with one, is a string
+ * expression. Numbers in it are turned into text where they appear, so
+ * "1 + 2 + a$" is "12" followed by a$, and + is its only operator.
+ *---------------------------------------------------------------------------*/
+enum { V_INT, V_FLOAT, V_STRING };
+enum { IN_SCRATCH, IN_VARIABLE, IN_PROGRAM }; /* where a string's text is */
+#define V_ANY (-1) /* what an expression is wanted as: whatever it is */
+
+struct expr_value {
+  unsigned char type;
+  unsigned char in; /* of s */
+  int len;          /* of s */
+  union {
+    VARIABLE_TYPE i;
+    VARFLOAT_TYPE f;
+    /*
+     * In the scratch, a variable's own (see string_new()), or a literal
+     * in the program text, which isn't 0 terminated
+     */
+    VARSTRING_TYPE s;
+  } v;
+};
 
-  t1 = termf();
-  op = tokenizer_token();
-  DEBUG_PRINTF("exprf: token %d\n", op);
-  while (op == TOKENIZER_PLUS || op == TOKENIZER_MINUS) {
-    tokenizer_next();
-    t2 = termf();
-    DEBUG_PRINTF("exprf: %f %d %f\n", t1, op, t2);
-    switch (op) {
-    case TOKENIZER_PLUS:
-      t1 = t1 + t2;
-      break;
-    case TOKENIZER_MINUS:
-      t1 = t1 - t2;
-      break;
-    }
-    op = tokenizer_token();
+enum { EXPR_BINARY, EXPR_NEGATE, EXPR_PAREN, EXPR_CALL };
+
+#define EXPR_PREC_NEGATE 4
+
+struct expr_op {
+  unsigned char kind;
+  unsigned char prec;  /* 0 for parentheses and calls, nothing passes them */
+  signed char want;    /* parentheses and calls: of the expression around */
+  unsigned char first; /* and whether they are its first operand */
+  short token;         /* operator or builtin */
+};
+
+/*---------------------------------------------------------------------------*/
+static void type_mismatch(void) {
+  printf("Error: On line %d, type mismatch\n", gline_number - 1);
+  ubasic_exit(gline_number - 1, "type mismatch", "");
+}
+/*---------------------------------------------------------------------------*/
+static VARIABLE_TYPE value_int(const struct expr_value *v) {
+  if (v->type == V_STRING) {
+    type_mismatch();
   }
-  DEBUG_PRINTF("exprf: %f\n", t1);
-  return t1;
+  return v->type == V_FLOAT ? (VARIABLE_TYPE)v->v.f : v->v.i;
 }
 /*---------------------------------------------------------------------------*/
-static VARSTRING_TYPE factors(void) {
-  VARSTRING_TYPE s;
-  VARSTRING_TYPE p;
-  int builtin_token;
+static VARFLOAT_TYPE value_float(const struct expr_value *v) {
+  if (v->type == V_STRING) {
+    type_mismatch();
+  }
+  return v->type == V_FLOAT ? v->v.f : (VARFLOAT_TYPE)v->v.i;
+}
+/*---------------------------------------------------------------------------*/
+/* v as a copy of s, len characters long */
+static void value_string(struct expr_value *v, const char *s, int len) {
+  v->type = V_STRING;
+  v->in = IN_SCRATCH;
+  v->len = len;
+  v->v.s = scratch_copy(s, len);
+}
+/*---------------------------------------------------------------------------*/
+/* A number in a string expression, as the text it is replaced by */
+static void value_text(struct expr_value *v) {
   char buff[64];
 
-  DEBUG_PRINTF("factors: token %d\n", tokenizer_token());
-  switch (tokenizer_token()) {
+  if (v->type == V_INT) {
+    value_string(v, buff, sprintf(buff, "%d", v->v.i));
+  } else if (v->type == V_FLOAT) {
+    value_string(v, buff, sprintf(buff, "%f", v->v.f));
+  }
+}
+/*---------------------------------------------------------------------------*/
+static int expr_prec(int token, int want) {
+  switch (token) {
+  case TOKENIZER_LT:
+  case TOKENIZER_GT:
+  case TOKENIZER_EQ:
+    return want == V_STRING ? 0 : 1;
+  case TOKENIZER_PLUS:
+    return 2;
+  case TOKENIZER_MINUS:
+  case TOKENIZER_AND:
+  case TOKENIZER_OR:
+    return want == V_STRING ? 0 : 2;
+  case TOKENIZER_ASTR:
+  case TOKENIZER_SLASH:
+  case TOKENIZER_MOD:
+    return want == V_STRING ? 0 : 3;
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static void expr_overflow(void) {
+  printf("Error: On line %d, expression nested too deeply\n",
+         gline_number - 1);
+  ubasic_exit(gline_number - 1, "expression nested too deeply",
+              ubasic_exit_static_itoa(UBASIC_EXPR_DEPTH));
+}
+/*---------------------------------------------------------------------------*/
+/* Reads the operand at the tokenizer, which is token, into v */
+static void expr_operand(int token, struct expr_value *v, int want) {
+  char buff[48];
+
+  v->in = IN_SCRATCH;
+  switch (token) {
   case TOKENIZER_NUMBER:
-    // Potential overflow bug
-    sprintf(buff,"%d",tokenizer_num());
-    s = strdup(buff);
-    DEBUG_PRINTF("factors: number %s\n", s);
+    v->type = V_INT;
+    v->v.i = tokenizer_num();
     accept(TOKENIZER_NUMBER);
     break;
   case TOKENIZER_NUMFLOAT:
-    // Potential overflow bug
-    s = sprintfloat(tokenizer_numfloat());
-    // sprintf(buff, "%f", tokenizer_numfloat());
-    // s = strdup(buff);
-    DEBUG_PRINTF("factors: float number %s\n", s);
-    accept(TOKENIZER_NUMFLOAT);
-    break;
-  case TOKENIZER_LEN:
-    builtin_token = tokenizer_token();
-    accept(builtin_token);
-    accept(TOKENIZER_LEFTPAREN);
-    if (tokenizer_token() == TOKENIZER_RIGHTPAREN) {
-      p = NULL;
-      accept(TOKENIZER_RIGHTPAREN);
-    } else {
-      p = exprs();
-      accept(TOKENIZER_RIGHTPAREN);
+    v->type = V_FLOAT;
+    v->v.f = tokenizer_numfloat();
+    if (want == V_STRING) {
+      /* As written, where a float variable gets "%f" */
+      floattext(buff, v->v.f);
+      value_string(v, buff, strlen(buff));
     }
-    s = builtinstr(builtin_token, p);
-    DEBUG_PRINTF("builtins %d(%s)=%s\n", builtin_token, p, s);
-    break;
-  case TOKENIZER_LEFTPAREN:
-    accept(TOKENIZER_LEFTPAREN);
-    s = exprs();
-    accept(TOKENIZER_RIGHTPAREN);
+    accept(TOKENIZER_NUMFLOAT);
     break;
-  case TOKENIZER_VARIABLE:
-    // Potential overflow bug
-    sprintf(buff,"%d",varfactor());
-    s = strdup(buff);
+  case TOKENIZER_VARFLOAT:
+    v->type = V_FLOAT;
+    v->v.f = varfloatfactor();
     break;
   case TOKENIZER_VARSTRING:
-    s = strdup(varstrfactor());
+    /* Not copied, the variable can only change once the line is done */
+    v->type = V_STRING;
+    v->v.s = varstrfactor();
+    if (v->v.s == NULL) {
+      v->v.s = string_empty.text;
+    }
+    v->in = IN_VARIABLE;
+    v->len = BC_STRING(v->v.s)->len;
     break;
   case TOKENIZER_STRING:
-    tokenizer_string(string, sizeof(string));
-    s = strdup(string);
+    /* Not copied either, only a store or a join has to */
+    v->type = V_STRING;
+    v->v.s = (char *)tokenizer_string(&v->len);
+    v->in = IN_PROGRAM;
     accept(TOKENIZER_STRING);
     break;
   default:
-    // TOKENIZER_VARFLOAT
-    // Potential overflow bug
-    sprintf(buff,"%f",varfloatfactor());
-    s = strdup(buff);
+    v->type = V_INT;
+    v->v.i = varfactor();
     break;
   }
-  return s;
+  if (want == V_STRING) {
+    value_text(v);
+  }
 }
 /*---------------------------------------------------------------------------*/
-static VARSTRING_TYPE terms(void) {
-  VARSTRING_TYPE s1, s2;
-  int op;
+/* Applies the operator op to the operands on top of the stack */
+static void expr_apply(const struct expr_op *op, struct expr_value *v,
+                       int want) {
+  VARIABLE_TYPE li, ri;
+  VARFLOAT_TYPE lf, rf;
+  VARSTRING_TYPE s;
+  int isfloat, len;
 
-  s1 = factors();
-  DEBUG_PRINTF("terms: %s\n", s1);
-  return s1;
-}
-/*---------------------------------------------------------------------------*/
-static VARSTRING_TYPE exprs(void) {
-  VARSTRING_TYPE t1;
-  VARSTRING_TYPE t2;
-  VARSTRING_TYPE r1;
-  VARSTRING_TYPE t1_temp;
-  int op;
-
-  r1 = NULL;
-
-  t1 = terms();
-  r1 = strdup(t1);
-  op = tokenizer_token();
-  DEBUG_PRINTF("exprs: token %d\n", op);
-  while (op == TOKENIZER_PLUS) {
-    tokenizer_next();
-    t2 = terms();
-    DEBUG_PRINTF("exprs: %s %d %s\n", t1, op, t2);
-    switch (op) {
-    case TOKENIZER_PLUS:
-      t1_temp = t1;
-      t1 = malloc(strlen(t1_temp) + strlen(t2) + 2);
-      sprintf(t1, "%s%s", t1_temp, t2);
-      if(t1_temp!=NULL)
-         free(t1_temp);
-      break;
+  if (op->kind == EXPR_NEGATE) {
+    if (v[0].type == V_STRING) {
+      type_mismatch();
+    }
+    if (v[0].type == V_FLOAT) {
+      v[0].v.f = 0 - v[0].v.f;
+    } else {
+      v[0].v.i = 0 - v[0].v.i;
     }
-    op = tokenizer_token();
+    return;
   }
-  DEBUG_PRINTF("exprs: %s\n", t1);
-  return t1;
-}
-/*---------------------------------------------------------------------------*/
-static int relation(void) {
-  int r1, r2;
-  int op;
-
-  r1 = expr();
-  op = tokenizer_token();
-  DEBUG_PRINTF("relation: token %d\n", op);
-  while (op == TOKENIZER_LT || op == TOKENIZER_GT || op == TOKENIZER_EQ) {
-    tokenizer_next();
-    r2 = expr();
-    DEBUG_PRINTF("relation: %d %d %d\n", r1, op, r2);
-    switch (op) {
+  DEBUG_PRINTF("eval: %d %d %d\n", v[0].type, op->token, v[1].type);
+  if (v[0].type == V_INT && v[1].type == V_INT &&
+      (op->token != TOKENIZER_SLASH || want != V_FLOAT)) {
+    isfloat = 0;
+  } else if (v[0].type == V_STRING || v[1].type == V_STRING) {
+    if (op->token != TOKENIZER_PLUS || v[0].type != v[1].type) {
+      type_mismatch();
+    }
+    /*
+     * A chain of + is built where its first join put it, each part being
+     * copied on once rather than everything so far again at every +.
+     */
+    len = v[0].len;
+    if (v[0].in != IN_SCRATCH ||
+        !scratch_append(v[0].v.s, len, v[1].v.s, v[1].len)) {
+      s = scratch_alloc(len + v[1].len + 1);
+      memcpy(s, v[0].v.s, len);
+      memcpy(s + len, v[1].v.s, v[1].len);
+      s[len + v[1].len] = 0;
+      STRING_COUNT(string_copied, len + v[1].len + 1);
+      v[0].in = IN_SCRATCH;
+      v[0].v.s = s;
+    }
+    v[0].len = len + v[1].len;
+    return;
+  } else {
+    /* At least one float, or a division wanted as one */
+    isfloat = op->token != TOKENIZER_MOD && op->token != TOKENIZER_AND &&
+              op->token != TOKENIZER_OR;
+  }
+  if (isfloat) {
+    /* No strings get this far */
+    lf = v[0].type == V_FLOAT ? v[0].v.f : v[0].v.i;
+    rf = v[1].type == V_FLOAT ? v[1].v.f : v[1].v.i;
+    v[0].type = V_FLOAT;
+    switch (op->token) {
     case TOKENIZER_LT:
-      r1 = r1 < r2;
+      v[0].type = V_INT;
+      v[0].v.i = lf < rf;
       break;
     case TOKENIZER_GT:
-      r1 = r1 > r2;
+      v[0].type = V_INT;
+      v[0].v.i = lf > rf;
       break;
     case TOKENIZER_EQ:
-      r1 = r1 == r2;
+      v[0].type = V_INT;
+      v[0].v.i = lf == rf;
+      break;
+    case TOKENIZER_PLUS:
+      v[0].v.f = lf + rf;
+      break;
+    case TOKENIZER_MINUS:
+      v[0].v.f = lf - rf;
+      break;
+    case TOKENIZER_ASTR:
+      v[0].v.f = lf * rf;
+      break;
+    case TOKENIZER_SLASH:
+      v[0].v.f = lf / rf;
       break;
     }
-    op = tokenizer_token();
+    return;
   }
-  return r1;
-}
-/*---------------------------------------------------------------------------*/
-static void index_free(void) {
-  if (line_index_head != NULL) {
-    line_index_current = line_index_head;
-    do {
-      DDEBUG_PRINTF("Freeing index for line %d.\n",
-                   line_index_current->line_number);
-      line_index_head = line_index_current;
-      line_index_current = line_index_current->next;
-      free(line_index_head);
-    } while (line_index_current != NULL);
-    line_index_head = NULL;
+
+  li = v[0].type == V_FLOAT ? (VARIABLE_TYPE)v[0].v.f : v[0].v.i;
+  ri = v[1].type == V_FLOAT ? (VARIABLE_TYPE)v[1].v.f : v[1].v.i;
+  v[0].type = V_INT;
+  switch (op->token) {
+  case TOKENIZER_LT:
+    v[0].v.i = li < ri;
+    break;
+  case TOKENIZER_GT:
+    v[0].v.i = li > ri;
+    break;
+  case TOKENIZER_EQ:
+    v[0].v.i = li == ri;
+    break;
+  case TOKENIZER_PLUS:
+    v[0].v.i = li + ri;
+    break;
+  case TOKENIZER_MINUS:
+    v[0].v.i = li - ri;
+    break;
+  case TOKENIZER_AND:
+    v[0].v.i = li & ri;
+    break;
+  case TOKENIZER_OR:
+    v[0].v.i = li | ri;
+    break;
+  case TOKENIZER_ASTR:
+    v[0].v.i = li * ri;
+    break;
+  case TOKENIZER_SLASH:
+    v[0].v.i = li / ri;
+    break;
+  case TOKENIZER_MOD:
+    v[0].v.i = li % ri;
+    break;
   }
 }
 /*---------------------------------------------------------------------------*/
-static char const *index_find(int linenum) {
-  struct line_index *lidx;
-  lidx = line_index_head;
-
-#if DEBUG
-  int step = 0;
-#endif
-
-  while (lidx != NULL && lidx->line_number != linenum) {
-    lidx = lidx->next;
-
-#if DEBUG
-    if (lidx != NULL) {
-      DDEBUG_PRINTF("index_find: Step %3d. Found index for line %d: %p.\n", step,
-                   lidx->line_number, (void *)lidx->program_text_position);
-    }
-    step++;
-#endif
+/* What the argument of builtin token is wanted as, or -2 if not a builtin */
+static int expr_builtin(int token) {
+  if (token > TOKENIZER_BUILTINS__START && token < TOKENIZER_BUILTINS__END) {
+    return V_INT;
   }
-  if (lidx != NULL && lidx->line_number == linenum) {
-    DDEBUG_PRINTF("index_find: Returning index for line %d.\n", linenum);
-    return lidx->program_text_position;
+  if (token > TOKENIZER_BUILTINSF__START && token < TOKENIZER_BUILTINSF__END) {
+    return V_FLOAT;
   }
-  DEBUG_PRINTF("index_find: Returning NULL for %d.\n", linenum);
-  return NULL;
+  return token == TOKENIZER_LEN ? V_STRING : -2;
 }
 /*---------------------------------------------------------------------------*/
-static char const *index_find_by_pos(const char *pos) {
-  struct line_index *lidx;
-  lidx = line_index_head;
-
-#if DEBUG
-  int step = 0;
-#endif
-
-  while (lidx != NULL && lidx->program_text_position != pos) {
-    lidx = lidx->next;
-
-#if DEBUG
-    if (lidx != NULL) {
-      DDEBUG_PRINTF(
-          "index_find_by_pos: Step %3d. Found index for %p at line %d: %p.\n",
-          step, pos, lidx->line_number, (void *)lidx->program_text_position);
+/* Calls builtin token with the argument in v, leaving the result there */
+static void expr_call(int token, struct expr_value *v) {
+  VARIABLE_TYPE len;
+
+  if (token == TOKENIZER_LEN) {
+    len = 0;
+    if (v->type == V_STRING) {
+      len = v->len;
     }
-    step++;
-#endif
-  }
-  if (lidx != NULL && lidx->program_text_position == pos) {
-    DDEBUG_PRINTF("index_find_by_pos: Returning index for line %d.\n",
-                 lidx->line_number);
-    return lidx->program_text_position;
+    v->type = V_INT;
+    v->v.i = len;
+  } else if (expr_builtin(token) == V_INT) {
+    v->v.i = builtin(token, value_int(v));
+    v->type = V_INT;
+  } else {
+    v->v.f = builtinf(token, value_float(v));
+    v->type = V_FLOAT;
   }
-  DDEBUG_PRINTF("index_find_by_pos: Returning NULL for %p.\n", pos);
-  return NULL;
 }
-
 /*---------------------------------------------------------------------------*/
-static int linenum_find_by_pos(const char *pos) {
-  struct line_index *lidx;
-  lidx = line_index_head;
-
-#if DEBUG
-  int step = 0;
-#endif
-
-  while (lidx != NULL && lidx->program_text_position != pos) {
-    lidx = lidx->next;
+static struct expr_value eval(int want) {
+  struct expr_value values[UBASIC_EXPR_DEPTH];
+  struct expr_op ops[UBASIC_EXPR_DEPTH];
+  int nvalues = 0, nops = 0, first = 1, token, prec;
+
+  while (1) {
+    /* An operand, after any negations, parentheses and calls opening */
+    token = tokenizer_token();
+    if (nops == UBASIC_EXPR_DEPTH || nvalues == UBASIC_EXPR_DEPTH) {
+      expr_overflow();
+    }
+    if (token == TOKENIZER_MINUS && want != V_STRING) {
+      tokenizer_next();
+      ops[nops].kind = EXPR_NEGATE;
+      ops[nops++].prec = EXPR_PREC_NEGATE;
+      continue;
+    }
+    if (token == TOKENIZER_LEFTPAREN || expr_builtin(token) != -2) {
+      if (token != TOKENIZER_LEFTPAREN) {
+        accept(token);
+      }
+      accept(TOKENIZER_LEFTPAREN);
+      if (token != TOKENIZER_LEFTPAREN &&
+          tokenizer_token() == TOKENIZER_RIGHTPAREN) {
+        /* An empty () passes zero */
+        accept(TOKENIZER_RIGHTPAREN);
+        values[nvalues].type = V_INT;
+        values[nvalues].v.i = 0;
+        expr_call(token, &values[nvalues++]);
+        if (want == V_STRING) {
+          value_text(&values[nvalues - 1]);
+        }
+      } else {
+        ops[nops].kind = token == TOKENIZER_LEFTPAREN ? EXPR_PAREN : EXPR_CALL;
+        ops[nops].prec = 0;
+        ops[nops].want = want;
+        ops[nops].first = first;
+        ops[nops++].token = token;
+        if (token != TOKENIZER_LEFTPAREN) {
+          want = expr_builtin(token);
+        }
+        first = 1;
+        continue;
+      }
+    } else {
+      expr_operand(token, &values[nvalues++], want);
+    }
 
-#if DEBUG
-    if (lidx != NULL) {
-      DDEBUG_PRINTF(
-          "linenum_find_by_pos: Step %3d. Found index for %p at line %d: %p.\n",
-          step, pos, lidx->line_number, (void *)lidx->program_text_position);
+    while (1) {
+      if (first && want == V_ANY && values[nvalues - 1].type == V_STRING) {
+        want = V_STRING;
+      }
+      first = 0;
+
+      /* Operators that bind at least as tightly as the next one are done */
+      token = tokenizer_token();
+      prec = expr_prec(token, want);
+      while (nops > 0 && ops[nops - 1].prec > 0 &&
+             ops[nops - 1].prec >= prec) {
+        nops--;
+        if (ops[nops].kind == EXPR_BINARY) {
+          nvalues--;
+        }
+        expr_apply(&ops[nops], &values[nvalues - 1], want);
+      }
+      if (prec > 0) {
+        break;
+      }
+      if (nops == 0) {
+        return values[0];
+      }
+      /* The end of a parenthesis or call, anything else is an error */
+      accept(TOKENIZER_RIGHTPAREN);
+      nops--;
+      if (ops[nops].kind == EXPR_CALL) {
+        expr_call(ops[nops].token, &values[nvalues - 1]);
+      }
+      want = ops[nops].want;
+      first = ops[nops].first;
+      if (want == V_STRING) {
+        value_text(&values[nvalues - 1]);
+      }
     }
-    step++;
-#endif
-  }
-  if (lidx != NULL && lidx->program_text_position == pos) {
-    DDEBUG_PRINTF("linenum_find_by_pos: Returning line %d for index %p.\n",
-                 lidx->line_number, pos);
-    return lidx->line_number;
+    tokenizer_next();
+    ops[nops].kind = EXPR_BINARY;
+    ops[nops].prec = prec;
+    ops[nops++].token = token;
   }
-  DDEBUG_PRINTF("linenum_find_by_pos: Returning NULL for %p.\n", pos);
-  return -1;
 }
 /*---------------------------------------------------------------------------*/
-static char const *index_find_by_label(char *label) {
-  struct line_index *lidx;
-  lidx = line_index_head;
-
-#if DEBUG
-  int step = 0;
-#endif
-
-  while ((lidx != NULL) && (strcmp(lidx->label, label) != 0)) {
-    lidx = lidx->next;
+static VARIABLE_TYPE expr(void) {
+  struct expr_value v = eval(V_INT);
 
-#if DEBUG
-    if (lidx != NULL) {
-      DDEBUG_PRINTF(
-          "index_find_by_label: Step %3d. Found index for label %s: %p.\n",
-          step, lidx->label, (void *)lidx->program_text_position);
-    }
-    step++;
-#endif
-  }
-  if ((lidx != NULL) && (strcmp(lidx->label, label) == 0)) {
-    DDEBUG_PRINTF("index_find_by_label: Returning index for label %s.\n", label);
-    return lidx->program_text_position;
-  }
-  DDEBUG_PRINTF("index_find_by_label: Returning NULL for %s.\n", label);
-  return NULL;
+  return value_int(&v);
 }
 /*---------------------------------------------------------------------------*/
-static void index_add_label(int linenum, char *label) {
-  struct line_index *lidx;
-  lidx = line_index_head;
-
-#if DEBUG
-  int step = 0;
-#endif
-
-  while (lidx != NULL && lidx->line_number != linenum) {
-    lidx = lidx->next;
+static VARFLOAT_TYPE exprf(void) {
+  struct expr_value v = eval(V_FLOAT);
 
-#if DEBUG
-    if (lidx != NULL) {
-      DDEBUG_PRINTF("index_add_label: Step %3d. Found index for line %d: %p.\n",
-                   step, lidx->line_number,
-                   (void *)lidx->program_text_position);
-    }
-    step++;
-#endif
-  }
-  if (lidx != NULL && lidx->line_number == linenum) {
-    DDEBUG_PRINTF("index_add_label: Setting label to %s for line %d.\n", label,
-                 linenum);
-    strcpy(lidx->label, label);
-    return;
-  }
-  DDEBUG_PRINTF("index_add_label: Label not set for line %d.\n", linenum);
-  return;
+  return value_float(&v);
 }
-
 /*---------------------------------------------------------------------------*/
-static void index_add(int linenum, char const *sourcepos) {
-  if (line_index_head != NULL && index_find(linenum)) {
-    return;
-  }
-
-  struct line_index *new_lidx;
-
-  new_lidx = malloc(sizeof(struct line_index));
-  new_lidx->line_number = linenum;
-  new_lidx->program_text_position = sourcepos;
-  new_lidx->next = NULL;
+/* Valid until the next line starts, see scratch_alloc() */
+static VARSTRING_TYPE exprs(void) {
+  struct expr_value v = eval(V_STRING);
 
-  if (line_index_head != NULL) {
-    line_index_current->next = new_lidx;
-    line_index_current = line_index_current->next;
-  } else {
-    line_index_current = new_lidx;
-    line_index_head = line_index_current;
-  }
-  DDEBUG_PRINTF("index_add: Adding index for line %d: %p.\n", linenum,
-               (void *)sourcepos);
+  return v.in == IN_PROGRAM ? scratch_copy(v.v.s, v.len) : v.v.s;
 }
 /*---------------------------------------------------------------------------*/
-static void jump_linenum_slow(int linenum) {
-  int lc = 1;
-  int last_token = TOKENIZER_ERROR;
-  int err_lc = gline_number - 1;
-
-  DEBUG_PRINTF("jump_linenum_slow: start\n");
-  tokenizer_init(program_ptr);
-  do {
-    last_token = tokenizer_token();
-    if (last_token == TOKENIZER_CR)
-      lc++;
-
-    tokenizer_next();
-    if (lc == linenum) {
-      gline_number = lc;
-      DEBUG_PRINTF("## jump_linenum_slow: returning at line %d\n", lc);
-      return;
-    }
-  } while (tokenizer_token() != TOKENIZER_ENDOFINPUT);
-  printf("Error: On line %d, line %d not found\n", err_lc, linenum);
+static void index_free(void) {
+  free(line_index);
+  line_index = NULL;
+  line_index_len = line_index_current = 0;
 }
 /*---------------------------------------------------------------------------*/
-static void jump_linenum(int linenum) {
-  char const *pos = index_find(linenum);
-  DEBUG_PRINTF("jump_linenum: Trying to go to line %d.\n", linenum);
-  if (pos != NULL) {
-    DEBUG_PRINTF("jump_linenum: Going to line %d.\n", linenum);
-    tokenizer_goto(pos);
-  } else {
-    /* We'll try to find a yet-unindexed line to jump to. */
-    DEBUG_PRINTF("jump_linenum: Calling jump_linenum_slow for %d.\n", linenum);
-    jump_linenum_slow(linenum);
+/* Line containing pos, usually the line after the last one looked up */
+static int index_find_by_pos(const char *pos) {
+  int lo, hi, mid;
+
+  if (line_index_current + 1 < line_index_len &&
+      line_index[line_index_current + 1].program_text_position == pos) {
+    return line_index[++line_index_current].line_number;
+  }
+  lo = 0;
+  hi = line_index_len - 1;
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (line_index[mid].program_text_position <= pos) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
   }
+  line_index_current = lo;
+  DDEBUG_PRINTF("index_find_by_pos: Returning line %d for %p.\n",
+                line_index[lo].line_number, pos);
+  return line_index[lo].line_number;
 }
 /*---------------------------------------------------------------------------*/
 static void jump_label_slow(char *label) {
@@ -757,7 +1035,7 @@ static void jump_label_slow(char *label) {
   int err_lc = gline_number - 1;
 
   DEBUG_PRINTF("jump_label_slow: start\n");
-  tokenizer_init(program_ptr);
+  tokenizer_goto(program_ptr);
   do {
     last_token = tokenizer_token();
     if (last_token == TOKENIZER_CR)
@@ -775,18 +1053,94 @@ static void jump_label_slow(char *label) {
         return;
       }
     }
-  } while (tokenizer_token() != TOKENIZER_ENDOFINPUT);
-  printf("Error: On line %d, label %s not found\n", err_lc, label);
+  } while (tokenizer_token() != TOKENIZER_ENDOFINPUT);
+  printf("Error: On line %d, label %s not found\n", err_lc, label);
+}
+/*---------------------------------------------------------------------------*/
+static unsigned int label_hash(const char *label) {
+  unsigned int h = 2166136261u;
+
+  while (*label) {
+    h = (h ^ (unsigned char)*label++) * 16777619u;
+  }
+  return h;
+}
+/*---------------------------------------------------------------------------*/
+static struct label_entry *label_table_slot(const char *label) {
+  unsigned int i = label_hash(label);
+  int n;
+
+  for (n = 0; n < LABEL_TABLE_SIZE; n++, i++) {
+    struct label_entry *e = &label_table[i & (LABEL_TABLE_SIZE - 1)];
+    if (e->program_text_position == NULL || strcmp(e->label, label) == 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* One pass over the program to fill in line_index and label_table */
+static void index_build(const char *program) {
+  char l[MAX_LABELLEN];
+  char const *pos, *scan = program;
+  int last_token = TOKENIZER_ERROR;
+  int line = 1, lines = 1;
+  struct label_entry *e;
+
+  index_free();
+  for (pos = program; *pos; pos++) {
+    if (*pos == '\n') {
+      lines++;
+    }
+  }
+  line_index = malloc(lines * sizeof(struct line_index));
+  if (line_index == NULL) {
+    printf("Error: Not enough memory for the line index\n");
+    ubasic_exit(0, "Not enough memory for the line index", "");
+  }
+
+  memset(label_table, 0, sizeof(label_table));
+  label_table_len = 0;
+  tokenizer_goto(program);
+  while (tokenizer_token() != TOKENIZER_ENDOFINPUT) {
+    pos = tokenizer_pos();
+    while (scan < pos) {
+      if (*scan++ == '\n') {
+        line++;
+      }
+    }
+    if (line_index_len == 0 ||
+        line_index[line_index_len - 1].line_number != line) {
+      line_index[line_index_len].line_number = line;
+      line_index[line_index_len].program_text_position = pos;
+      line_index[line_index_len].cached = 0;
+      line_index_len++;
+    }
+    if (tokenizer_token() == TOKENIZER_LABEL && last_token != TOKENIZER_GOTO &&
+        last_token != TOKENIZER_GOSUB) {
+      tokenizer_label(l, MAX_LABELLEN);
+      e = label_table_slot(l);
+      if (e != NULL && e->program_text_position == NULL) {
+        strcpy(e->label, l);
+        e->program_text_position = pos;
+        label_table_len++;
+      }
+    }
+    last_token = tokenizer_token();
+    tokenizer_next();
+  }
+  DEBUG_PRINTF("index_build: %d lines, %d labels\n", line_index_len,
+               label_table_len);
 }
 /*---------------------------------------------------------------------------*/
 static void jump_label(char *label) {
-  char const *pos = index_find_by_label(label);
+  struct label_entry *e = label_table_slot(label);
   DEBUG_PRINTF("jump_label: Trying to go to label %s.\n", label);
-  if (pos != NULL) {
+  if (e != NULL && e->program_text_position != NULL) {
     DEBUG_PRINTF("jump_label: Going to label %s.\n", label);
-    tokenizer_goto(pos);
+    tokenizer_goto(e->program_text_position);
   } else {
-    /* We'll try to find a yet-unindexed line to jump to. */
+    /* Not in the table, either it was full or the label doesn't exist */
     DEBUG_PRINTF("jump_label: Calling jump_label_slow for %s.\n", label);
     jump_label_slow(label);
   }
@@ -869,25 +1223,6 @@ static VARFLOAT_TYPE builtinf(int token, VARFLOAT_TYPE p) {
   return 0.0;
 }
 /*---------------------------------------------------------------------------*/
-static VARSTRING_TYPE builtinstr(int token, VARSTRING_TYPE p) {
-  int r;
-
-  // if (token <= TOKENIZER_BUILTINSF__START || token > TOKENIZER_BUILTINSF__END) {
-  //   printf("Error: Invalid builtinf function %d (%f)\n", token, p);
-  //   ubasic_exit(-1);
-  // }
-
-  switch (token) {
-  case TOKENIZER_LEN:
-    return NULL;
-    break;
-  default:
-    break;
-  }
-
-  return NULL;
-}
-/*---------------------------------------------------------------------------*/
 static void goto_statement(void) {
   char l[MAX_LABELLEN];
   accept(TOKENIZER_GOTO);
@@ -918,13 +1253,11 @@ static void printfloat(VARFLOAT_TYPE f) {
   printf("%s", buff);
 }
 /*---------------------------------------------------------------------------*/
-// Potential overflow bug
-static VARSTRING_TYPE sprintfloat(VARFLOAT_TYPE f) {
-
-  char buff[48];
+/* f as printed into buff, which takes 48 characters */
+static char *floattext(char *buff, VARFLOAT_TYPE f) {
   int len;
-  len = snprintf(buff, sizeof buff, "%f", f);
-  DEBUG_PRINTF("sprintfloat: %s\n", buff);
+  len = snprintf(buff, 48, "%f", f);
+  DEBUG_PRINTF("floattext: %s\n", buff);
   char *p = buff + len - 1;
   while (*p == '0') {
     *p-- = 0;
@@ -933,32 +1266,42 @@ static VARSTRING_TYPE sprintfloat(VARFLOAT_TYPE f) {
     *(p + 1) = '0';
     *(p + 2) = 0;
   }
-  return strdup(buff);
+  return buff;
+}
+/*---------------------------------------------------------------------------*/
+static VARSTRING_TYPE sprintfloat(VARFLOAT_TYPE f) {
+  char buff[48];
+
+  floattext(buff, f);
+  return string_new(buff, strlen(buff));
 }
 /*---------------------------------------------------------------------------*/
 static void print_statement(void) {
+  struct expr_value v;
+  int token;
+
   accept(TOKENIZER_PRINT);
   do {
     DEBUG_PRINTF("Print loop\n");
-    if (tokenizer_token() == TOKENIZER_STRING) {
-      tokenizer_string(string, sizeof(string));
-      printf("%s", string);
-      tokenizer_next();
-    } else if (tokenizer_token() == TOKENIZER_VARSTRING) {
-      printf("%s", exprs());
-    } else if (tokenizer_token() == TOKENIZER_COMMA) {
+    token = tokenizer_token();
+    if (token == TOKENIZER_COMMA) {
       printf(" ");
       tokenizer_next();
-    } else if (tokenizer_token() == TOKENIZER_SEMICOLON) {
+    } else if (token == TOKENIZER_SEMICOLON) {
       tokenizer_next();
-    } else if (tokenizer_token() == TOKENIZER_VARIABLE ||
-               tokenizer_token() == TOKENIZER_NUMBER ||
-               (tokenizer_token() > TOKENIZER_BUILTINS__START && tokenizer_token() < TOKENIZER_BUILTINS__END)) {
-      printf("%d", expr());
-    } else if (tokenizer_token() == TOKENIZER_VARFLOAT ||
-               tokenizer_token() == TOKENIZER_NUMFLOAT ||
-               (tokenizer_token() > TOKENIZER_BUILTINSF__START && tokenizer_token() < TOKENIZER_BUILTINSF__END)) {
-      printfloat(exprf());
+    } else if (token == TOKENIZER_STRING || token == TOKENIZER_VARSTRING ||
+               token == TOKENIZER_VARIABLE || token == TOKENIZER_NUMBER ||
+               token == TOKENIZER_VARFLOAT || token == TOKENIZER_NUMFLOAT ||
+               token == TOKENIZER_MINUS || token == TOKENIZER_LEFTPAREN ||
+               expr_builtin(token) != -2) {
+      v = eval(V_ANY);
+      if (v.type == V_STRING) {
+        fwrite(v.v.s, 1, v.len, stdout);
+      } else if (v.type == V_FLOAT) {
+        printfloat(v.v.f);
+      } else {
+        printf("%d", v.v.i);
+      }
     } else {
       break;
     }
@@ -966,18 +1309,18 @@ static void print_statement(void) {
            tokenizer_token() != TOKENIZER_ENDOFINPUT);
   printf("\n");
   DEBUG_PRINTF("End of print\n");
-  tokenizer_next();
+  /* An else after it is left for if_statement(), as the compiler does */
+  if (tokenizer_token() != TOKENIZER_ELSE) {
+    tokenizer_next();
+  }
 }
 /*---------------------------------------------------------------------------*/
 static void os_statement(void) {
   accept(TOKENIZER_OS);
   do {
     DEBUG_PRINTF("OS loop\n");
-    if (tokenizer_token() == TOKENIZER_STRING) {
-      tokenizer_string(string, sizeof(string));
-      system(string);
-      tokenizer_next();
-    } else if (tokenizer_token() == TOKENIZER_VARSTRING) {
+    if (tokenizer_token() == TOKENIZER_STRING ||
+        tokenizer_token() == TOKENIZER_VARSTRING) {
       system(exprs());
     } else {
       break;
@@ -986,7 +1329,9 @@ static void os_statement(void) {
            tokenizer_token() != TOKENIZER_ENDOFINPUT);
   printf("\n");
   DEBUG_PRINTF("End of OS statement\n");
-  tokenizer_next();
+  if (tokenizer_token() != TOKENIZER_ELSE) {
+    tokenizer_next();
+  }
 }
 /*---------------------------------------------------------------------------*/
 static void if_statement(void) {
@@ -994,8 +1339,8 @@ static void if_statement(void) {
   DEBUG_PRINTF("if_statement start\n");
   accept(TOKENIZER_IF);
 
-  r = relation();
-  DEBUG_PRINTF("if_statement: relation %d\n", r);
+  r = expr();
+  DEBUG_PRINTF("if_statement: condition %d\n", r);
   accept(TOKENIZER_THEN);
   if (r) {
     statement();
@@ -1028,6 +1373,7 @@ static void if_statement(void) {
 }
 /*---------------------------------------------------------------------------*/
 static void let_statement(void) {
+  struct expr_value v;
   int var;
 
   if (tokenizer_token() == TOKENIZER_VARIABLE) {
@@ -1053,7 +1399,10 @@ static void let_statement(void) {
     var = tokenizer_variable_num();
     accept(TOKENIZER_VARSTRING);
     accept(TOKENIZER_EQ);
-    ubasic_set_string_variable(var, exprs());
+    v = eval(V_STRING);
+    /* let b$ = a$ shares a$'s string, anything else is copied once */
+    string_assign(var, v.in == IN_VARIABLE ? string_hold(v.v.s)
+                                           : string_new(v.v.s, v.len));
     DEBUG_PRINTF("let_statement: assign %s to %d\n", string_variables[var], var);
     if (tokenizer_token() == TOKENIZER_CR)
       tokenizer_next();
@@ -1066,13 +1415,23 @@ static void gosub_statement(void) {
   DEBUG_PRINTF("Enter gosub_statement\n");
   tokenizer_label(l, MAX_LABELLEN);
   accept(TOKENIZER_LABEL);
+  /* Return to the next line, also from "if c then gosub l else ..." */
+  if (tokenizer_token() == TOKENIZER_ELSE) {
+    while (tokenizer_token() != TOKENIZER_CR &&
+           tokenizer_token() != TOKENIZER_ENDOFINPUT) {
+      tokenizer_next();
+    }
+  }
   if (tokenizer_token() == TOKENIZER_CR) {
     accept(TOKENIZER_CR);
   }
 
-  if (gosub_stack_ptr < MAX_GOSUB_STACK_DEPTH) {
-    gosub_stack[gosub_stack_ptr] = gline_number;
+  if (gosub_stack_ptr < gosub_stack_depth) {
+    gosub_stack[gosub_stack_ptr].pos_after_gosub = tokenizer_pos();
     gosub_stack_ptr++;
+    if (gosub_stack_ptr > stats.gosub_max_depth) {
+      stats.gosub_max_depth = gosub_stack_ptr;
+    }
     jump_label(l);
   } else {
     printf("Error: gosub stack exhausted\n");
@@ -1084,7 +1443,7 @@ static void return_statement(void) {
   accept(TOKENIZER_RETURN);
   if (gosub_stack_ptr > 0) {
     gosub_stack_ptr--;
-    jump_linenum(gosub_stack[gosub_stack_ptr]);
+    tokenizer_goto(gosub_stack[gosub_stack_ptr].pos_after_gosub);
   } else {
     printf("Error: No matching return on line %d\n", gline_number - 1);
     ubasic_exit(gline_number - 1, "No matching return", 0);
@@ -1092,18 +1451,31 @@ static void return_statement(void) {
 }
 /*---------------------------------------------------------------------------*/
 static void next_statement(void) {
-  int var;
+  struct for_state *fs;
+  int var, is_float, more;
 
   accept(TOKENIZER_NEXT);
   var = tokenizer_variable_num();
-  accept(TOKENIZER_VARIABLE);
-  if (for_stack_ptr > 0 && var == for_stack[for_stack_ptr - 1].for_variable) {
-    ubasic_set_variable(var, ubasic_get_variable(var) + 1);
-    if (ubasic_get_variable(var) <= for_stack[for_stack_ptr - 1].to) {
-      jump_linenum(for_stack[for_stack_ptr - 1].line_after_for);
+  is_float = tokenizer_token() == TOKENIZER_VARFLOAT;
+  accept(is_float ? TOKENIZER_VARFLOAT : TOKENIZER_VARIABLE);
+  fs = for_stack_ptr > 0 ? &for_stack[for_stack_ptr - 1] : NULL;
+  if (fs != NULL && var == fs->for_variable && is_float == fs->is_float) {
+    if (is_float) {
+      VARFLOAT_TYPE f = ubasic_get_float_variable(var) + fs->step.f;
+      ubasic_set_float_variable(var, f);
+      more = fs->step.f >= 0 ? f <= fs->to.f : f >= fs->to.f;
+    } else {
+      VARIABLE_TYPE i = ubasic_get_variable(var) + fs->step.i;
+      ubasic_set_variable(var, i);
+      more = fs->step.i >= 0 ? i <= fs->to.i : i >= fs->to.i;
+    }
+    if (more) {
+      tokenizer_goto(fs->pos_after_for);
     } else {
       for_stack_ptr--;
-      accept(TOKENIZER_CR);
+      if (tokenizer_token() == TOKENIZER_CR) {
+        tokenizer_next();
+      }
     }
   } else {
     printf("Error: On line %d, unexpected next, no matching for\n",
@@ -1113,33 +1485,48 @@ static void next_statement(void) {
 }
 /*---------------------------------------------------------------------------*/
 static void for_statement(void) {
-  int for_variable, to;
+  struct for_state *fs = &for_stack[for_stack_ptr];
+  int for_variable;
 
   accept(TOKENIZER_FOR);
-  for_variable = tokenizer_variable_num();
-  accept(TOKENIZER_VARIABLE);
-  accept(TOKENIZER_EQ);
-  ubasic_set_variable(for_variable, expr());
-  accept(TOKENIZER_TO);
-  to = expr();
-  accept(TOKENIZER_CR);
-
-  if (for_stack_ptr < MAX_FOR_STACK_DEPTH) {
-    for_stack[for_stack_ptr].line_after_for = gline_number;
-    for_stack[for_stack_ptr].for_variable = for_variable;
-    for_stack[for_stack_ptr].to = to;
-    DEBUG_PRINTF("for_statement: new for at %d, var %d, from %d to %d\n",
-                 for_stack[for_stack_ptr].line_after_for,
-                 for_stack[for_stack_ptr].for_variable,
-                 variables[for_stack[for_stack_ptr].for_variable],
-                 for_stack[for_stack_ptr].to);
-
-    for_stack_ptr++;
-  } else {
+  if (for_stack_ptr >= MAX_FOR_STACK_DEPTH) {
     printf("Error: On line %d, for stack depth exceeded (max: %d)\n",
            gline_number - 1, MAX_FOR_STACK_DEPTH);
     ubasic_exit(gline_number - 1, "for stack depth exceeded", ubasic_exit_static_itoa(MAX_FOR_STACK_DEPTH));
   }
+  for_variable = tokenizer_variable_num();
+  if (tokenizer_token() == TOKENIZER_VARFLOAT) {
+    accept(TOKENIZER_VARFLOAT);
+    accept(TOKENIZER_EQ);
+    ubasic_set_float_variable(for_variable, exprf());
+    accept(TOKENIZER_TO);
+    fs->to.f = exprf();
+    fs->step.f = 1.0;
+    if (tokenizer_token() == TOKENIZER_STEP) {
+      accept(TOKENIZER_STEP);
+      fs->step.f = exprf();
+    }
+    fs->is_float = 1;
+  } else {
+    accept(TOKENIZER_VARIABLE);
+    accept(TOKENIZER_EQ);
+    ubasic_set_variable(for_variable, expr());
+    accept(TOKENIZER_TO);
+    fs->to.i = expr();
+    fs->step.i = 1;
+    if (tokenizer_token() == TOKENIZER_STEP) {
+      accept(TOKENIZER_STEP);
+      fs->step.i = expr();
+    }
+    fs->is_float = 0;
+  }
+  accept(TOKENIZER_CR);
+
+  fs->for_variable = for_variable;
+  fs->pos_after_for = tokenizer_pos();
+  DEBUG_PRINTF("for_statement: new for at %p, var %d\n", fs->pos_after_for,
+               fs->for_variable);
+  for_stack_ptr++;
 }
 /*---------------------------------------------------------------------------*/
 static void peek_statement(void) {
@@ -1299,11 +1686,8 @@ static void gpio_off_statement(void) {
  *---------------------------------------------------------------------------*/
 
 static void label_statement(void) {
-  char l[MAX_LABELLEN];
   DEBUG_PRINTF("Enter label_statement\n");
-  tokenizer_label(l, MAX_LABELLEN);
-  DEBUG_PRINTF("Found label %s\n", l);
-  index_add_label(gline_number - 1, l);
+  /* Already in label_table, nothing to record */
   accept(TOKENIZER_LABEL);
   accept(TOKENIZER_CR);
   DEBUG_PRINTF("End label_statement\n");
@@ -1397,23 +1781,704 @@ static void statement(void) {
 }
 /*---------------------------------------------------------------------------*/
 static void line_statement(void) {
-  // DEBUG_PRINTF("----------- Line number %d ---------\n", tokenizer_num());
-  // index_add(tokenizer_num(), tokenizer_pos());
-  // accept(TOKENIZER_NUMBER);
-  int cline_number = linenum_find_by_pos(tokenizer_pos());
-  if (cline_number < 0) {
-    DEBUG_PRINTF("----------- New Line number %d ---------\n", gline_number);
-    index_add(gline_number++, tokenizer_pos());
-  } else {
-    DEBUG_PRINTF("----------- Line number %d ---------\n", cline_number);
-    gline_number = cline_number + 1;
-  }
+  char const *pos = tokenizer_pos();
 
+  gline_number = index_find_by_pos(pos) + 1;
+  DEBUG_PRINTF("----------- Line number %d ---------\n", gline_number - 1);
+  scratch_reset();
+
+#if UBASIC_BYTECODE && UBASIC_LINE_CACHE
+  if (line_cache_run(pos)) {
+    return;
+  }
+#endif
   statement();
   return;
 }
+/*---------------------------------------------------------------------------
+ * Bytecode VM
+ *---------------------------------------------------------------------------*/
+union vm_value {
+  VARIABLE_TYPE i;
+  VARFLOAT_TYPE f;
+  VARSTRING_TYPE s;
+};
+
+static union vm_value vm_temps[BC_TEMPS];
+
+/*
+ * With threaded dispatch every handler ends in its own indirect jump,
+ * through a table built once per program that holds the handler address
+ * for each instruction word of bc.code, instead of all of them sharing
+ * the jump at the top of a switch.
+ */
+#if UBASIC_STATS
+#define VM_COUNT(counter) stats.counter++
+#else
+#define VM_COUNT(counter)
+#endif
+
+/*
+ * After a backward jump that didn't end the slice, lets the JIT run the
+ * loop at pc natively if it's hot, which can end the slice too.
+ */
+#if UBASIC_JIT
+#define VM_JIT                                                                 \
+  if (jit_heads != NULL && jit_heads[pc]) {                                    \
+    pc = jit_loop(pc, &budget);                                                \
+    if (budget == 0) {                                                         \
+      vm_pc = pc;                                                              \
+      return;                                                                  \
+    }                                                                          \
+  }
+#else
+#define VM_JIT
+#endif
+
+#if UBASIC_THREADED_DISPATCH && UBASIC_PREDECODE
+#define VM_DISPATCH_START goto *handlers[pc++];
+#define VM_CASE(name) L_##name:
+#define VM_NEXT goto *handlers[pc++]
+#define VM_DISPATCH_END
+#elif UBASIC_THREADED_DISPATCH
+#define VM_DISPATCH_START goto *labels[code[pc++]];
+#define VM_CASE(name) L_##name:
+#define VM_NEXT goto *labels[code[pc++]]
+#define VM_DISPATCH_END
+#else
+#define VM_DISPATCH_START                                                      \
+  for (;;) {                                                                   \
+    switch (code[pc++]) {
+#define VM_CASE(name) case OP_##name:
+#define VM_NEXT break
+#define VM_DISPATCH_END                                                        \
+    }                                                                          \
+  }
+#endif
+
+static int vm_line(int pc) {
+  int lo = 0, hi = bc.lines_len - 1, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (bc.lines[mid].pc <= pc) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return bc.lines_len > 0 ? bc.lines[lo].line : 0;
+}
+/*---------------------------------------------------------------------------*/
+static void vm_error(int pc, char *msg, char *errp) {
+  gline_number = vm_line(pc) + 1;
+  printf("Error: On line %d, %s\n", gline_number - 1, msg);
+  ubasic_exit(gline_number - 1, msg, errp);
+}
+#if UBASIC_THREADED_DISPATCH && UBASIC_PREDECODE
+/*---------------------------------------------------------------------------*/
+static const void **vm_thread(const void *const *labels) {
+#define BC_OPERANDS(name, operands, pops, pushes) operands,
+  static const unsigned char operands[] = {BC_OPCODES(BC_OPERANDS)};
+#undef BC_OPERANDS
+  const void **handlers = calloc(bc.code_len, sizeof(void *));
+  int pc;
+
+  if (handlers == NULL) {
+    printf("Error: Not enough memory for the VM\n");
+    ubasic_exit(0, "Not enough memory for the VM", "");
+  }
+  for (pc = 0; pc < bc.code_len; pc += 1 + operands[bc.code[pc]]) {
+    handlers[pc] = labels[bc.code[pc]];
+  }
+  return handlers;
+}
+#endif
+#if UBASIC_JIT
+/*---------------------------------------------------------------------------*/
+/* NEXT for native code, see struct jit_vm */
+static int vm_jit_next(int var, int head) {
+  struct for_state *fs;
+
+  if (for_stack_ptr <= 0) {
+    return -1;
+  }
+  fs = &for_stack[for_stack_ptr - 1];
+  if (var != fs->for_variable || fs->is_float || fs->pc_after_for != head) {
+    return -1;
+  }
+  variables[var] += fs->step.i;
+  if (fs->step.i >= 0 ? variables[var] <= fs->to.i
+                      : variables[var] >= fs->to.i) {
+    return 1;
+  }
+  for_stack_ptr--;
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static void vm_jit_init(void) {
+  struct jit_vm vm;
+
+  vm.variables = variables;
+  vm.temps = vm_temps;
+  vm.temp_size = sizeof(union vm_value);
+  vm.next = vm_jit_next;
+  jit_init(&bc, &vm);
+}
+#endif
+/*---------------------------------------------------------------------------*/
+static void vm_run(void) {
+  const int32_t *code = bc.code;
+  union vm_value stack[BC_STACK_DEPTH];
+  union vm_value *sp = stack;
+  int pc = vm_pc;
+  int budget = VM_SLICE;
+  char buff[64];
+  VARSTRING_TYPE s;
+  struct for_state *fs;
+  int var, len, i;
+#if UBASIC_THREADED_DISPATCH
+#define BC_LABEL(name, operands, pops, pushes) &&L_##name,
+  static const void *const labels[] = {BC_OPCODES(BC_LABEL)};
+#undef BC_LABEL
+#if UBASIC_PREDECODE
+  const void **handlers;
+
+  if (vm_handlers == NULL) {
+    vm_handlers = vm_thread(labels);
+  }
+  handlers = vm_handlers;
+#endif
+#endif
+
+  VM_JIT
+  VM_DISPATCH_START
+    VM_CASE(END)
+      ended = 1;
+      vm_pc = pc - 1;
+      return;
+    VM_CASE(PUSHI)
+      (sp++)->i = code[pc++];
+      VM_NEXT;
+    VM_CASE(PUSHF)
+      (sp++)->f = bc.floats[code[pc++]];
+      VM_NEXT;
+    VM_CASE(PUSHS)
+      /* Pool strings are never counted, so are used where they are */
+      (sp++)->s = bc.strings + code[pc++];
+      VM_NEXT;
+    VM_CASE(LOADI)
+      (sp++)->i = variables[code[pc++]];
+      VM_NEXT;
+    VM_CASE(LOADF)
+      (sp++)->f = float_variables[code[pc++]];
+      VM_NEXT;
+    VM_CASE(LOADS)
+      (sp++)->s = string_load(code[pc++]);
+      VM_NEXT;
+    VM_CASE(LOADT)
+      *sp++ = vm_temps[code[pc++]];
+      VM_NEXT;
+    VM_CASE(STORET)
+      vm_temps[code[pc++]] = *--sp;
+      VM_NEXT;
+    VM_CASE(STOREI)
+      variables[code[pc++]] = (--sp)->i;
+      VM_NEXT;
+    VM_CASE(STOREF)
+      float_variables[code[pc++]] = (--sp)->f;
+      VM_NEXT;
+    VM_CASE(STORES)
+      /* The pool may go before the variable does */
+      --sp;
+      if (BC_STRING(sp->s)->refs < 0 && sp->s != string_empty.text) {
+        sp->s = string_new(sp->s, BC_STRING(sp->s)->len);
+      }
+      string_assign(code[pc++], sp->s);
+      VM_NEXT;
+    VM_CASE(ADDI)
+      --sp;
+      sp[-1].i = sp[-1].i + sp->i;
+      VM_NEXT;
+    VM_CASE(SUBI)
+      --sp;
+      sp[-1].i = sp[-1].i - sp->i;
+      VM_NEXT;
+    VM_CASE(MULI)
+      --sp;
+      sp[-1].i = sp[-1].i * sp->i;
+      VM_NEXT;
+    VM_CASE(DIVI)
+      --sp;
+      sp[-1].i = sp[-1].i / sp->i;
+      VM_NEXT;
+    VM_CASE(MODI)
+      --sp;
+      sp[-1].i = sp[-1].i % sp->i;
+      VM_NEXT;
+    VM_CASE(ANDI)
+      --sp;
+      sp[-1].i = sp[-1].i & sp->i;
+      VM_NEXT;
+    VM_CASE(ORI)
+      --sp;
+      sp[-1].i = sp[-1].i | sp->i;
+      VM_NEXT;
+    VM_CASE(LTI)
+      --sp;
+      sp[-1].i = sp[-1].i < sp->i;
+      VM_NEXT;
+    VM_CASE(GTI)
+      --sp;
+      sp[-1].i = sp[-1].i > sp->i;
+      VM_NEXT;
+    VM_CASE(EQI)
+      --sp;
+      sp[-1].i = sp[-1].i == sp->i;
+      VM_NEXT;
+    VM_CASE(ADDF)
+      --sp;
+      sp[-1].f = sp[-1].f + sp->f;
+      VM_NEXT;
+    VM_CASE(SUBF)
+      --sp;
+      sp[-1].f = sp[-1].f - sp->f;
+      VM_NEXT;
+    VM_CASE(MULF)
+      --sp;
+      sp[-1].f = sp[-1].f * sp->f;
+      VM_NEXT;
+    VM_CASE(DIVF)
+      --sp;
+      sp[-1].f = sp[-1].f / sp->f;
+      VM_NEXT;
+    VM_CASE(LTF)
+      --sp;
+      sp[-1].i = sp[-1].f < sp->f;
+      VM_NEXT;
+    VM_CASE(GTF)
+      --sp;
+      sp[-1].i = sp[-1].f > sp->f;
+      VM_NEXT;
+    VM_CASE(EQF)
+      --sp;
+      sp[-1].i = sp[-1].f == sp->f;
+      VM_NEXT;
+    VM_CASE(ITOF)
+      sp[-1].f = (VARFLOAT_TYPE)sp[-1].i;
+      VM_NEXT;
+    VM_CASE(FTOI)
+      sp[-1].i = (VARIABLE_TYPE)sp[-1].f;
+      VM_NEXT;
+    VM_CASE(ITOS)
+      sp[-1].s = string_new(buff, sprintf(buff, "%d", sp[-1].i));
+      VM_NEXT;
+    VM_CASE(FTOS)
+      floattext(buff, sp[-1].f);
+      sp[-1].s = string_new(buff, strlen(buff));
+      VM_NEXT;
+    VM_CASE(FTOSF)
+      sp[-1].s = string_new(buff, sprintf(buff, "%f", sp[-1].f));
+      VM_NEXT;
+    VM_CASE(CONCAT)
+      /* Measured first, then copied into one string made at full size */
+      sp -= code[pc];
+      len = 0;
+      for (i = 0; i < code[pc]; i++) {
+        len += BC_STRING(sp[i].s)->len;
+      }
+      s = string_new(NULL, len);
+      STRING_COUNT(string_copied, len);
+      len = 0;
+      for (i = 0; i < code[pc]; i++) {
+        memcpy(s + len, sp[i].s, BC_STRING(sp[i].s)->len);
+        len += BC_STRING(sp[i].s)->len;
+        string_release(sp[i].s);
+      }
+      (sp++)->s = s;
+      pc++;
+      VM_NEXT;
+    VM_CASE(LEN)
+      s = sp[-1].s;
+      sp[-1].i = BC_STRING(s)->len;
+      string_release(s);
+      VM_NEXT;
+    VM_CASE(BUILTIN)
+      sp[-1].i = builtin(code[pc++], sp[-1].i);
+      VM_NEXT;
+    VM_CASE(BUILTINF)
+      sp[-1].f = builtinf(code[pc++], sp[-1].f);
+      VM_NEXT;
+    VM_CASE(PRINTI)
+      printf("%d", (--sp)->i);
+      VM_NEXT;
+    VM_CASE(PRINTF)
+      printfloat((--sp)->f);
+      VM_NEXT;
+    VM_CASE(PRINTS)
+      --sp;
+      fwrite(sp->s, 1, BC_STRING(sp->s)->len, stdout);
+      string_release(sp->s);
+      VM_NEXT;
+    VM_CASE(PRINTLIT)
+      s = bc.strings + code[pc++];
+      fwrite(s, 1, BC_STRING(s)->len, stdout);
+      VM_NEXT;
+    VM_CASE(PRINTSP)
+      printf(" ");
+      VM_NEXT;
+    VM_CASE(PRINTNL)
+      printf("\n");
+      VM_NEXT;
+    VM_CASE(JMP)
+      pc = code[pc];
+      if (--budget == 0) {
+        vm_pc = pc;
+        return;
+      }
+      VM_JIT
+      VM_NEXT;
+    VM_CASE(JZ)
+      if ((--sp)->i == 0) {
+        pc = code[pc];
+      } else {
+        pc++;
+      }
+      VM_NEXT;
+    VM_CASE(GOSUB)
+      if (gosub_stack_ptr >= gosub_stack_depth) {
+        vm_error(pc - 1, "Gosub stack exhausted", "");
+      }
+      gosub_stack[gosub_stack_ptr++].pc_after_gosub = pc + 1;
+      if (gosub_stack_ptr > stats.gosub_max_depth) {
+        stats.gosub_max_depth = gosub_stack_ptr;
+      }
+      pc = code[pc];
+      if (--budget == 0) {
+        vm_pc = pc;
+        return;
+      }
+      VM_NEXT;
+    VM_CASE(RETURN)
+      if (gosub_stack_ptr <= 0) {
+        vm_error(pc - 1, "No matching return", "");
+      }
+      pc = gosub_stack[--gosub_stack_ptr].pc_after_gosub;
+      if (--budget == 0) {
+        vm_pc = pc;
+        return;
+      }
+      VM_NEXT;
+    VM_CASE(FOR)
+    VM_CASE(FORF)
+      if (for_stack_ptr >= MAX_FOR_STACK_DEPTH) {
+        vm_error(pc - 1, "for stack depth exceeded",
+                 ubasic_exit_static_itoa(MAX_FOR_STACK_DEPTH));
+      }
+      fs = &for_stack[for_stack_ptr++];
+      fs->is_float = code[pc - 1] == OP_FORF;
+      fs->for_variable = code[pc++];
+      sp -= 2;
+      if (fs->is_float) {
+        fs->to.f = sp[0].f;
+        fs->step.f = sp[1].f;
+      } else {
+        fs->to.i = sp[0].i;
+        fs->step.i = sp[1].i;
+      }
+      fs->pc_after_for = pc;
+      VM_NEXT;
+    VM_CASE(NEXT)
+      var = code[pc++];
+      fs = for_stack_ptr > 0 ? &for_stack[for_stack_ptr - 1] : NULL;
+      if (fs == NULL || var != fs->for_variable || fs->is_float) {
+        vm_error(pc - 2, "Unexpected next, no matching for", "");
+      }
+      variables[var] += fs->step.i;
+      if (fs->step.i >= 0 ? variables[var] <= fs->to.i
+                          : variables[var] >= fs->to.i) {
+        pc = fs->pc_after_for;
+        if (--budget == 0) {
+          vm_pc = pc;
+          return;
+        }
+        VM_JIT
+      } else {
+        for_stack_ptr--;
+      }
+      VM_NEXT;
+    VM_CASE(NEXTF)
+      var = code[pc++];
+      fs = for_stack_ptr > 0 ? &for_stack[for_stack_ptr - 1] : NULL;
+      if (fs == NULL || var != fs->for_variable || !fs->is_float) {
+        vm_error(pc - 2, "Unexpected next, no matching for", "");
+      }
+      float_variables[var] += fs->step.f;
+      if (fs->step.f >= 0 ? float_variables[var] <= fs->to.f
+                          : float_variables[var] >= fs->to.f) {
+        pc = fs->pc_after_for;
+        if (--budget == 0) {
+          vm_pc = pc;
+          return;
+        }
+        VM_JIT
+      } else {
+        for_stack_ptr--;
+      }
+      VM_NEXT;
+    VM_CASE(PEEK)
+      variables[code[pc++]] = peek_function((--sp)->i);
+      VM_NEXT;
+    VM_CASE(POKE)
+      sp -= 2;
+      poke_function(sp[0].i, sp[1].i);
+      VM_NEXT;
+    VM_CASE(SLEEP)
+      sleep_ms((--sp)->i * 1000);
+      vm_pc = pc;
+      return;
+    VM_CASE(DELAY)
+      sleep_ms((--sp)->i);
+      vm_pc = pc;
+      return;
+    VM_CASE(RANDOMIZE)
+      RANDOM_NUM_SEED_x = (--sp)->i;
+      VM_NEXT;
+    VM_CASE(PUSH)
+      if (int_stack_ptr >= MAX_INT_STACK_DEPTH) {
+        vm_error(pc - 1, "integer stack exhausted", "");
+      }
+      int_stack[int_stack_ptr++] = (--sp)->i;
+      VM_NEXT;
+    VM_CASE(POP)
+      if (int_stack_ptr <= 0) {
+        vm_error(pc - 1, "integer stack is empty", "");
+      }
+      variables[code[pc++]] = int_stack[--int_stack_ptr];
+      VM_NEXT;
+    VM_CASE(OS)
+      --sp;
+      system(sp->s);
+      string_release(sp->s);
+      VM_NEXT;
+    VM_CASE(GPIOINIT)
+      gpio_init((--sp)->i);
+      VM_NEXT;
+    VM_CASE(GPIODIRIN)
+      gpio_set_dir((--sp)->i, GPIO_IN);
+      VM_NEXT;
+    VM_CASE(GPIODIROUT)
+      gpio_set_dir((--sp)->i, GPIO_OUT);
+      VM_NEXT;
+    VM_CASE(GPIOON)
+      gpio_put((--sp)->i, 1);
+      VM_NEXT;
+    VM_CASE(GPIOOFF)
+      gpio_put((--sp)->i, 0);
+      VM_NEXT;
+    VM_CASE(ADDVI)
+      VM_COUNT(fused_let_add);
+      variables[code[pc]] += code[pc + 1];
+      pc += 2;
+      VM_NEXT;
+    VM_CASE(JLTVI)
+      VM_COUNT(fused_if_goto);
+      if (!(variables[code[pc]] < code[pc + 1])) {
+        pc += 3;
+        VM_NEXT;
+      }
+      pc = code[pc + 2];
+      if (--budget == 0) {
+        vm_pc = pc;
+        return;
+      }
+      VM_JIT
+      VM_NEXT;
+    VM_CASE(JGTVI)
+      VM_COUNT(fused_if_goto);
+      if (!(variables[code[pc]] > code[pc + 1])) {
+        pc += 3;
+        VM_NEXT;
+      }
+      pc = code[pc + 2];
+      if (--budget == 0) {
+        vm_pc = pc;
+        return;
+      }
+      VM_JIT
+      VM_NEXT;
+    VM_CASE(JEQVI)
+      VM_COUNT(fused_if_goto);
+      if (!(variables[code[pc]] == code[pc + 1])) {
+        pc += 3;
+        VM_NEXT;
+      }
+      pc = code[pc + 2];
+      if (--budget == 0) {
+        vm_pc = pc;
+        return;
+      }
+      VM_JIT
+      VM_NEXT;
+    VM_CASE(FORI)
+      VM_COUNT(fused_for);
+      if (for_stack_ptr >= MAX_FOR_STACK_DEPTH) {
+        vm_error(pc - 1, "for stack depth exceeded",
+                 ubasic_exit_static_itoa(MAX_FOR_STACK_DEPTH));
+      }
+      fs = &for_stack[for_stack_ptr++];
+      fs->is_float = 0;
+      fs->for_variable = code[pc];
+      fs->to.i = code[pc + 1];
+      fs->step.i = code[pc + 2];
+      pc += 3;
+      fs->pc_after_for = pc;
+      VM_NEXT;
+    VM_CASE(GPIOONI)
+      VM_COUNT(fused_pin);
+      gpio_put(code[pc++], 1);
+      VM_NEXT;
+    VM_CASE(GPIOOFFI)
+      VM_COUNT(fused_pin);
+      gpio_put(code[pc++], 0);
+      VM_NEXT;
+    VM_CASE(DELAYI)
+      VM_COUNT(fused_delay);
+      sleep_ms(code[pc++]);
+      vm_pc = pc;
+      return;
+  VM_DISPATCH_END
+}
+#if UBASIC_BYTECODE && UBASIC_LINE_CACHE
+/*---------------------------------------------------------------------------
+ * Line cache. A program the compiler rejects as a whole runs on the text
+ * interpreter, but most of its lines usually compile on their own. When
+ * the interpreter runs a line for the first time the compiler is asked
+ * for just that statement. If it compiles (only statements that don't
+ * jump do, see compiler_compile_line()) the code is kept and from then on
+ * the VM runs the line instead. Entries are found through the line index
+ * and keyed by the position of the line's first token.
+ *---------------------------------------------------------------------------*/
+struct line_cache_entry {
+  char const *pos; /* first token of the line */
+  char const *end; /* where the interpreter carries on after it */
+  int line;        /* its line_index entry */
+  unsigned long used;
+  struct bc_program code;
+#if UBASIC_THREADED_DISPATCH && UBASIC_PREDECODE
+  const void **handlers;
+#endif
+};
+static struct line_cache_entry line_cache[UBASIC_LINE_CACHE];
+static unsigned long line_cache_clock;
+
+/*---------------------------------------------------------------------------*/
+static void line_cache_drop(struct line_cache_entry *e) {
+  compiler_free(&e->code);
+#if UBASIC_THREADED_DISPATCH && UBASIC_PREDECODE
+  free(e->handlers);
+#endif
+  memset(e, 0, sizeof(*e));
+}
+/*---------------------------------------------------------------------------*/
+static void line_cache_free(void) {
+  int i;
+
+  for (i = 0; i < UBASIC_LINE_CACHE; i++) {
+    line_cache_drop(&line_cache[i]);
+  }
+  line_cache_clock = 0;
+}
+/*---------------------------------------------------------------------------*/
+/* Compiles the line at pos into the least recently used entry */
+static struct line_cache_entry *line_cache_fill(struct line_index *li,
+                                                char const *pos) {
+  struct line_cache_entry *e = &line_cache[0];
+  struct bc_program code;
+  int i;
+
+  if (compiler_compile_line(&code) != 0) {
+    li->cached = -1;
+    tokenizer_goto(pos);
+    return NULL;
+  }
+  for (i = 1; i < UBASIC_LINE_CACHE; i++) {
+    if (line_cache[i].used < e->used) {
+      e = &line_cache[i];
+    }
+  }
+  if (e->code.code != NULL) {
+    /*
+     * A loop with more lines than the cache would otherwise compile all
+     * of them on every pass, so an evicted line stays interpreted
+     */
+    stats.line_cache_evictions++;
+    line_index[e->line].cached = -1;
+    line_cache_drop(e);
+  }
+  /* Errors in the VM report the line the interpreter is on */
+  for (i = 0; i < code.lines_len; i++) {
+    code.lines[i].line = li->line_number;
+  }
+  e->code = code;
+  e->pos = pos;
+  e->end = tokenizer_pos();
+  e->line = li - line_index;
+  li->cached = e - line_cache + 1;
+  stats.line_cache_misses++;
+  return e;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Runs the line at pos from the cache, compiling it first if need be.
+ * Returns 0 if it is for the interpreter to run.
+ */
+static int line_cache_run(char const *pos) {
+  struct line_index *li = &line_index[line_index_current];
+  struct line_cache_entry *e;
+
+  if (use_bytecode || li->program_text_position != pos || li->cached < 0) {
+    return 0;
+  }
+  if (li->cached > 0) {
+    e = &line_cache[li->cached - 1];
+    stats.line_cache_hits++;
+  } else {
+    e = line_cache_fill(li, pos);
+    if (e == NULL) {
+      return 0;
+    }
+  }
+  e->used = ++line_cache_clock;
+
+  bc = e->code;
+#if UBASIC_THREADED_DISPATCH && UBASIC_PREDECODE
+  vm_handlers = e->handlers;
+#endif
+  vm_pc = 0;
+  do {
+    vm_run();
+  } while (!ended);
+  ended = 0;
+#if UBASIC_THREADED_DISPATCH && UBASIC_PREDECODE
+  e->handlers = vm_handlers;
+  vm_handlers = NULL;
+#endif
+  memset(&bc, 0, sizeof(bc));
+
+  tokenizer_goto(e->end);
+  return 1;
+}
+#endif
 /*---------------------------------------------------------------------------*/
 void ubasic_run(void) {
+  if (use_bytecode) {
+    if (!ended) {
+      vm_run();
+    }
+    check_if_should_enter_CMD_mode();
+    return;
+  }
   if (tokenizer_finished()) {
     DEBUG_PRINTF("uBASIC program finished\n");
     return;
@@ -1423,7 +2488,16 @@ void ubasic_run(void) {
   check_if_should_enter_CMD_mode();
 }
 /*---------------------------------------------------------------------------*/
-int ubasic_finished(void) { return ended || tokenizer_finished(); }
+int ubasic_finished(void) {
+  return ended || (!use_bytecode && tokenizer_finished());
+}
+/*---------------------------------------------------------------------------*/
+const struct ubasic_stats *ubasic_get_stats(void) {
+#if UBASIC_JIT
+  jit_get_stats(&stats.jit_regions, &stats.jit_bytes);
+#endif
+  return &stats;
+}
 /*---------------------------------------------------------------------------*/
 void ubasic_set_variable(int varnum, VARIABLE_TYPE value) {
   if (varnum >= 0 && varnum <= MAX_VARNUM) {
@@ -1454,10 +2528,8 @@ VARFLOAT_TYPE ubasic_get_float_variable(int varnum) {
 /*---------------------------------------------------------------------------*/
 void ubasic_set_string_variable(int varnum, VARSTRING_TYPE value) {
   if (varnum >= 0 && varnum <= MAX_VARNUM) {
-    if(string_variables[varnum]!=NULL)
-      free(string_variables[varnum]);
-    string_variables[varnum] = malloc(strlen(value) + 1);
-    strcpy(string_variables[varnum], value);
+    /* Copied first, value may be the old string itself */
+    string_assign(varnum, string_new(value, strlen(value)));
   }
 }
 /*---------------------------------------------------------------------------*/
@@ -1467,3 +2539,101 @@ VARSTRING_TYPE ubasic_get_string_variable(int varnum) {
   }
   return 0;
 }
+/*---------------------------------------------------------------------------
+ * Runtime for programs translated to C by tools/bas2c, see ubasic_native.h
+ *---------------------------------------------------------------------------*/
+VARIABLE_TYPE *ubasic_native_variables(void) {
+  return variables;
+}
+/*---------------------------------------------------------------------------*/
+VARFLOAT_TYPE *ubasic_native_float_variables(void) {
+  return float_variables;
+}
+/*---------------------------------------------------------------------------*/
+VARIABLE_TYPE ubasic_native_builtin(int token, VARIABLE_TYPE p) {
+  return builtin(token, p);
+}
+/*---------------------------------------------------------------------------*/
+VARFLOAT_TYPE ubasic_native_builtinf(int token, VARFLOAT_TYPE p) {
+  return builtinf(token, p);
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_native_printfloat(VARFLOAT_TYPE f) {
+  printfloat(f);
+}
+/*---------------------------------------------------------------------------*/
+VARSTRING_TYPE ubasic_native_sprintfloat(VARFLOAT_TYPE f) {
+  return sprintfloat(f);
+}
+/*---------------------------------------------------------------------------*/
+VARSTRING_TYPE ubasic_native_string(const char *s, int len) {
+  return string_new(s, len);
+}
+/*---------------------------------------------------------------------------*/
+VARSTRING_TYPE ubasic_native_load_string(int var) {
+  return string_load(var);
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_native_store_string(int var, VARSTRING_TYPE s) {
+  /* The translated program's pool lasts, so its strings aren't copied */
+  string_assign(var, s);
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_native_release(VARSTRING_TYPE s) {
+  string_release(s);
+}
+/*---------------------------------------------------------------------------*/
+/* As the VM's concat: measured first, then copied into one string */
+VARSTRING_TYPE ubasic_native_concat_n(int count, ...) {
+  char *parts[BC_STACK_DEPTH], *s;
+  va_list ap;
+  int i, len = 0;
+
+  va_start(ap, count);
+  for (i = 0; i < count; i++) {
+    parts[i] = va_arg(ap, char *);
+    len += BC_STRING(parts[i])->len;
+  }
+  va_end(ap);
+  s = string_new(NULL, len);
+  STRING_COUNT(string_copied, len);
+  len = 0;
+  for (i = 0; i < count; i++) {
+    memcpy(s + len, parts[i], BC_STRING(parts[i])->len);
+    len += BC_STRING(parts[i])->len;
+    string_release(parts[i]);
+  }
+  return s;
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_native_randomize(VARIABLE_TYPE seed) {
+  RANDOM_NUM_SEED_x = seed;
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_native_push(int line, VARIABLE_TYPE value) {
+  if (int_stack_ptr >= MAX_INT_STACK_DEPTH) {
+    ubasic_native_error(line, "integer stack exhausted", "");
+  }
+  int_stack[int_stack_ptr++] = value;
+}
+/*---------------------------------------------------------------------------*/
+VARIABLE_TYPE ubasic_native_pop(int line) {
+  if (int_stack_ptr <= 0) {
+    ubasic_native_error(line, "integer stack is empty", "");
+  }
+  return int_stack[--int_stack_ptr];
+}
+/*---------------------------------------------------------------------------*/
+VARIABLE_TYPE ubasic_native_peek(VARIABLE_TYPE arg) {
+  return peek_function(arg);
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_native_poke(VARIABLE_TYPE arg, VARIABLE_TYPE value) {
+  poke_function(arg, value);
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_native_error(int line, char *msg, char *errp) {
+  gline_number = line + 1;
+  printf("Error: On line %d, %s\n", line, msg);
+  ubasic_exit(line, msg, errp);
+}
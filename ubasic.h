@@ -33,12 +33,64 @@
 
 #include "vartype.h"
 
+/*
+ * Build time limits. The host tools (tools/pbcc, tools/bas2c) include
+ * them too, so what they build behaves as it does here.
+ */
+#ifndef MAX_GOSUB_STACK_DEPTH
+#define MAX_GOSUB_STACK_DEPTH 10
+#endif
+#define GOSUB_STACK_DEPTH_LIMIT 1024 /* most rem pragma gosub_depth can ask */
+#ifndef MAX_FOR_STACK_DEPTH
+#define MAX_FOR_STACK_DEPTH 16
+#endif
+/* Jumps taken before the VM returns so CMD mode is still checked */
+#define VM_SLICE 64
+
 typedef VARIABLE_TYPE (*peek_func)(VARIABLE_TYPE);
 typedef void (*poke_func)(VARIABLE_TYPE, VARIABLE_TYPE);
 
+/* Counters for tuning the build time limits, reset by ubasic_init() */
+struct ubasic_stats {
+  int gosub_stack_depth; /* gosub entries available to this program */
+  int gosub_max_depth;   /* deepest gosub nesting reached */
+  int tokens;            /* token stream entries, 0 if not used */
+  int token_bytes;       /* memory used by the token stream */
+  int pruned_bytes;      /* dead code the compiler left out */
+  /* why the compiler refused the program, so it runs on the text
+   * interpreter, NULL if it didn't or UBASIC_BYTECODE is off */
+  const char *not_compiled;
+  int not_compiled_line; /* about where */
+  /* times each VM superinstruction ran (needs UBASIC_STATS) */
+  unsigned long fused_let_add; /* let x = x + 1 */
+  unsigned long fused_if_goto; /* if x < 9 then goto l: */
+  unsigned long fused_for;     /* for with constant limit and step */
+  unsigned long fused_pin;     /* pinon/pinoff with a constant pin */
+  unsigned long fused_delay;   /* delay with a constant */
+  int jit_regions; /* loops compiled to native code (needs UBASIC_JIT) */
+  int jit_bytes;   /* native code for them */
+  /* lines the text interpreter ran compiled, see UBASIC_LINE_CACHE */
+  unsigned long line_cache_hits;
+  unsigned long line_cache_misses;    /* compiled and added to the cache */
+  unsigned long line_cache_evictions; /* dropped to make room */
+  /* string temporaries of the text interpreter, see UBASIC_SCRATCH_SIZE */
+  int scratch_max;                 /* most scratch a line used */
+  unsigned long scratch_overflows; /* strings that went to the heap */
+  /* string allocations and bytes copied into strings (needs UBASIC_STATS) */
+  unsigned long string_allocs;
+  unsigned long string_copied;
+};
+
 void ubasic_init(const char *program);
+int ubasic_init_image(const char *image, int len);
+char *ubasic_build_image(int *len);
 void ubasic_run(void);
 int ubasic_finished(void);
+const struct ubasic_stats *ubasic_get_stats(void);
+/* Keeps reporting the error, never returns */
+#ifdef __GNUC__
+__attribute__((noreturn))
+#endif
 void ubasic_exit(int errline, char *errmsg, char *errp);
 
 VARIABLE_TYPE ubasic_get_variable(int varnum);
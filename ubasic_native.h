@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2023, Gary Sims
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+#ifndef __UBASIC_NATIVE_H__
+#define __UBASIC_NATIVE_H__
+
+#include "bytecode.h"
+#include "ubasic.h"
+
+/*
+ * The runtime that programs translated to C by tools/bas2c call into.
+ * A translated program keeps its variables, numbers formatting, builtins
+ * and error reporting in ubasic.c, so it behaves like the bytecode VM
+ * running the same source.
+ */
+
+/* Defined by the translated program, runs it to the end */
+void ubasic_native_program(void);
+
+VARIABLE_TYPE *ubasic_native_variables(void);
+VARFLOAT_TYPE *ubasic_native_float_variables(void);
+
+VARIABLE_TYPE ubasic_native_builtin(int token, VARIABLE_TYPE p);
+VARFLOAT_TYPE ubasic_native_builtinf(int token, VARFLOAT_TYPE p);
+void ubasic_native_printfloat(VARFLOAT_TYPE f);
+
+/*
+ * Strings are counted as in the VM (struct bc_string in bytecode.h): the
+ * functions that return one hand over a reference, which is given back
+ * with ubasic_native_release() or passed on to concat or a variable.
+ * The translated program's own pool is laid out as the compiler's, with
+ * counts below zero, so its strings are used where they are.
+ */
+VARSTRING_TYPE ubasic_native_sprintfloat(VARFLOAT_TYPE f);
+VARSTRING_TYPE ubasic_native_string(const char *s, int len);
+VARSTRING_TYPE ubasic_native_load_string(int var);
+void ubasic_native_store_string(int var, VARSTRING_TYPE s);
+void ubasic_native_release(VARSTRING_TYPE s);
+/* count strings joined into a new one, taking over their references */
+VARSTRING_TYPE ubasic_native_concat_n(int count, ...);
+
+void ubasic_native_randomize(VARIABLE_TYPE seed);
+void ubasic_native_push(int line, VARIABLE_TYPE value);
+VARIABLE_TYPE ubasic_native_pop(int line);
+VARIABLE_TYPE ubasic_native_peek(VARIABLE_TYPE arg);
+void ubasic_native_poke(VARIABLE_TYPE arg, VARIABLE_TYPE value);
+
+/* Reports the error like the VM and never returns */
+#ifdef __GNUC__
+__attribute__((noreturn))
+#endif
+void ubasic_native_error(int line, char *msg, char *errp);
+
+#endif /* __UBASIC_NATIVE_H__ */